@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+import math as m
+import sys
+
+# Mirrors include/txrx_packdef.h
+FRAME_PADDING = 2           # QWORDS of padding after each frame
+MODEM_BYTE_ALIGN = 8
+TX_LEN_WORD = 8             # frame length word in front of each frame in TX DMA memory
+HDR_V1 = 32                 # sizeof(modem_frame_header_t)
+HDR_V2 = 16                 # sizeof(modem_frame_header_v2_t)
+DESC_V2 = 16                # sizeof(modem_packet_desc_t)
+FEC_HDR = 8                 # sizeof(modem_fec_header_t)
+TRAILER = 4                 # packet CRC32
+MTU_MIN = 10 * 8 + FRAME_PADDING * 8 + HDR_V1
+MTU_MAX = 6144 - FRAME_PADDING * 8 - HDR_V1
+
+def align(sz):
+    return ((sz + MODEM_BYTE_ALIGN - 1) // MODEM_BYTE_ALIGN) * MODEM_BYTE_ALIGN
+
+def frame_bytes(payload, hdr, dma):
+    # bytes of a frame on air, or in TX DMA memory if dma is set
+    return hdr + align(payload) + FRAME_PADDING * 8 + (TX_LEN_WORD if dma else 0)
+
+def packet_bytes(pack_sz, mtu, hdr, prefix, crc, fec_n, fec_k, dma):
+    stream_sz = prefix + pack_sz + (TRAILER if crc else 0)
+    num_data = m.ceil(stream_sz / mtu)
+    tot = (num_data - 1) * frame_bytes(mtu, hdr, dma) + frame_bytes(stream_sz - (num_data - 1) * mtu, hdr, dma)
+    if fec_n > 0 and fec_k > 0:
+        tot += m.ceil(num_data / fec_n) * fec_k * frame_bytes(mtu + FEC_HDR, hdr, dma)
+    return tot
+
+def goodput(pack_sz, mtu, version, crc = False, fec_n = 0, fec_k = 0, dma = False):
+    if version == 1:
+        tot = packet_bytes(pack_sz, mtu, HDR_V1, 0, crc, fec_n, fec_k, dma)
+    else:
+        tot = packet_bytes(pack_sz, mtu, HDR_V2, DESC_V2, crc, fec_n, fec_k, dma)
+    return pack_sz / tot
+
+if __name__=='__main__':
+    if (len(sys.argv) < 2):
+        print("Invocation: calc_goodput.py <Packet Size> [CRC32 trailer (0/1)] [FEC data frames] [FEC parity frames]")
+        sys.exit(0)
+
+    pack_sz = int(sys.argv[1])
+    crc = len(sys.argv) > 2 and int(sys.argv[2]) != 0
+    fec_n = int(sys.argv[3]) if len(sys.argv) > 3 else 0
+    fec_k = int(sys.argv[4]) if len(sys.argv) > 4 else 0
+    print("Packet size: %d bytes"%(pack_sz))
+    print("CRC32 trailer: %s"%("yes" if crc else "no"))
+    print("FEC: %s"%("%d + %d"%(fec_n, fec_k) if fec_n > 0 and fec_k > 0 else "no"))
+    print("Goodput is packet bytes over bytes on air (TX DMA memory adds the %d byte length word per frame)"%(TX_LEN_WORD))
+    print("%6s %10s %10s %10s %10s %8s"%("MTU", "v1 air", "v2 air", "v1 DMA", "v2 DMA", "v2 gain"))
+    mtu = MTU_MIN
+    while True:
+        mtu = min(mtu, MTU_MAX - (FEC_HDR if fec_n > 0 and fec_k > 0 else 0))
+        mtu = (mtu // MODEM_BYTE_ALIGN) * MODEM_BYTE_ALIGN
+        g1 = goodput(pack_sz, mtu, 1, crc, fec_n, fec_k)
+        g2 = goodput(pack_sz, mtu, 2, crc, fec_n, fec_k)
+        d1 = goodput(pack_sz, mtu, 1, crc, fec_n, fec_k, True)
+        d2 = goodput(pack_sz, mtu, 2, crc, fec_n, fec_k, True)
+        print("%6d %9.2f%% %9.2f%% %9.2f%% %9.2f%% %7.2f%%"%(mtu, g1 * 100, g2 * 100, d1 * 100, d2 * 100, (g2 / g1 - 1) * 100))
+        if mtu >= MTU_MAX - 2 * MODEM_BYTE_ALIGN:
+            break
+        mtu *= 2
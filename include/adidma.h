@@ -237,8 +237,33 @@ typedef enum
     ADIDMA_BUF_SIZE_ERROR,
     ADIDMA_BUF_MMAP_ERROR,
     ADIDMA_XFER_SZ_ERR,
+    ADIDMA_XFER_HANDLE_ERR,
 } ADIDMAC_ERROR;
 
+typedef enum
+{
+    ADIDMA_DIR_TX = 0, /// Memory to stream
+    ADIDMA_DIR_RX      /// Stream to memory
+} ADIDMAC_DIR;
+
+typedef enum
+{
+    ADIDMA_STATE_RESET = 0, /// Channel disabled, programmed before the next transfer
+    ADIDMA_STATE_ENABLED,   /// Channel enabled with the per-channel registers programmed, transfers only set address, length, flags and start
+    ADIDMA_STATE_CYCLIC     /// A cyclic transfer is running, the next transfer resets the channel to stop it, adidma_stop stops it at the end of a cycle
+} ADIDMAC_STATE;
+
+/**
+ * @brief Number of transfers the DMAC keeps queued or active (transfer IDs 0-3)
+ */
+#define ADIDMA_MAX_XFERS 4
+
+/**
+ * @brief Time in ms adidma_stop waits for the last cycle of a cyclic transfer
+ * to end (stream stalled) before it resets the channel anyway
+ */
+#define ADIDMA_STOP_TIMEOUT_MS 1000
+
 typedef enum
 {
     ADIDMA_MEMCPY_TX = 1,
@@ -252,13 +277,18 @@ typedef enum
  */
 typedef struct
 {
-    uio_dev bus[1];                   /// UIO device descriptor
-    uint32_t mem_sz;                  /// Size of the DMA buffer
-    uint32_t mem_addr;                /// Address of the DMA buffer
-    int mem_fd;                       /// File descriptor to the DMA buffer for access (virtual address)
-    uint8_t *mem_virt_addr;           /// mmapped virtual address to the DMA buffer
-    uint8_t *mapping_addr;            /// mmap to the head of the virtual address that needs to be unmapped
-    unsigned int tx_check_completion; /// Set this variable to check for DMA transfer completion by busy-wait on the DMAC_REG_XFER_DONE register instead of TX IP transfer complete interrupt
+    uio_dev bus[1];                     /// UIO device descriptor
+    uint32_t mem_sz;                    /// Size of the DMA buffer
+    uint32_t mem_addr;                  /// Address of the DMA buffer
+    int mem_fd;                         /// File descriptor to the DMA buffer for access (virtual address)
+    uint8_t *mem_virt_addr;             /// mmapped virtual address to the DMA buffer
+    uint8_t *mapping_addr;              /// mmap to the head of the virtual address that needs to be unmapped
+    unsigned int tx_check_completion;   /// Unused, non-cyclic transfers always complete on the DMAC_REG_XFER_DONE register
+    uint64_t xfer_submitted;            /// Transfers submitted with adidma_submit, the next transfer handle
+    uint64_t xfer_completed;            /// Submitted transfers known to have completed
+    uint8_t xfer_ids[ADIDMA_MAX_XFERS]; /// DMAC IDs of the outstanding transfers, by handle
+    uint8_t state;                      /// Channel state, ADIDMAC_STATE
+    uint32_t flags;                     /// Value of DMAC_REG_FLAGS while the channel is enabled
 } adidma;
 /**
  * @brief This function initializes the ADI DMA UIO device with supplied 
@@ -281,9 +311,20 @@ int adidma_init(adidma *dev, int uio_id, unsigned char ext_buffer_enb);
  * management is left to the function calling adidma_destroy(). 
  */
 void adidma_destroy(adidma *dev);
+/**
+ * @brief Resets the DMA channel and enables it again, programming the IRQ
+ * mask, strides and flags that stay fixed across transfers. Outstanding
+ * transfers, and a running cyclic transfer, are dropped. Called by
+ * adidma_init, and by the next transfer after a cyclic one.
+ * 
+ * @param dev adidma struct with device configuration
+ * @return int Positive on success, negative on error.
+ */
+int adidma_reset(adidma *dev);
 /**
  * @brief Writes data to the ADI DMA FIFO interface specified by dev. This is a
- * non-blocking call when cyclic transfer is permitted.
+ * non-blocking call when cyclic transfer is permitted, otherwise the transfer
+ * is queued on the enabled channel and the call returns once it completes.
  * 
  * @param dev adidma struct with device configuration
  * @param offset Offset to DMA engine memory region base address
@@ -292,6 +333,47 @@ void adidma_destroy(adidma *dev);
  * @return int Positive on success, negative on error.
  */
 int adidma_write(adidma *dev, unsigned int offset, ssize_t size, unsigned char cyclic);
+/**
+ * @brief Stops a running cyclic transfer at the end of a cycle: clears the
+ * cyclic flag so that the cycle in progress is the last one, and waits for its
+ * end of transfer, so that the stream does not end in the middle of the data.
+ * The channel is reset if the cycle does not end within ADIDMA_STOP_TIMEOUT_MS.
+ * Does nothing if no cyclic transfer is running.
+ * 
+ * @param dev adidma struct with device configuration
+ * @return int Positive on success, negative on error.
+ */
+int adidma_stop(adidma *dev);
+/**
+ * @brief Queues a non-cyclic transfer behind the transfers already in flight,
+ * without resetting the channel, and returns once the DMAC has accepted it. If
+ * ADIDMA_MAX_XFERS transfers are outstanding, waits for the oldest first. The
+ * memory region must not be touched until the transfer has completed.
+ * 
+ * @param dev adidma struct with device configuration
+ * @param offset Offset to DMA engine memory region base address
+ * @param size Length of the transfer
+ * @param dir ADIDMA_DIR_TX (memory to stream) or ADIDMA_DIR_RX (stream to memory)
+ * @return int64_t Transfer handle (non-negative) on success, negative on error.
+ */
+int64_t adidma_submit(adidma *dev, unsigned int offset, ssize_t size, unsigned char dir);
+/**
+ * @brief Checks if a submitted transfer has completed, without blocking.
+ * 
+ * @param dev adidma struct with device configuration
+ * @param xfer Transfer handle returned by adidma_submit
+ * @return int 1 if complete, 0 if not, negative on error.
+ */
+int adidma_poll(adidma *dev, int64_t xfer);
+/**
+ * @brief Blocks until a submitted transfer has completed. Transfers complete
+ * in submission order, so the ones submitted before it are complete too.
+ * 
+ * @param dev adidma struct with device configuration
+ * @param xfer Transfer handle returned by adidma_submit
+ * @return int Positive on success, negative on error.
+ */
+int adidma_wait(adidma *dev, int64_t xfer);
 /**
  * @brief Reads data from the ADI DMA streaming interface specified by dev. This
  * is a blocking call that returns when the data has been transferred.
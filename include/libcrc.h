@@ -0,0 +1,125 @@
+/**
+ * @file libcrc.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Table driven checksum routines used by the modem framing code.
+ * @version 0.1
+ * @date 2021-06-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _LIB_CRC_H
+#define _LIB_CRC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC16_POLY 0x8408
+/*
+ * this is the CCITT CRC 16 polynomial X^16  + X^12  + X^5  + 1.
+ * This works out to be 0x1021, but the way the algorithm works
+ * lets us use 0x8408 (the reverse of the bit pattern).  The high
+ * bit is always assumed to be set, thus we only use 16 bits to
+ * represent the 17 bit value.
+ */
+
+/**
+ * @brief Initial value of the CRC16 shift register.
+ */
+#define CRC16_INIT 0xffff
+
+/**
+ * @brief Advance the CRC16 shift register over a buffer. Uses a slicing-by-8
+ * lookup table, and produces the same register value as running the bitwise
+ * algorithm over the same bytes. Can be called repeatedly on consecutive
+ * chunks of a buffer.
+ *
+ * @param crc Current register value, CRC16_INIT for the first chunk
+ * @param buf Pointer to data
+ * @param size Length of data in bytes
+ * @return uint16_t Updated register value, pass to crc16_final() to get the checksum
+ */
+uint16_t crc16_update(uint16_t crc, const void *buf, size_t size);
+/**
+ * @brief Copy a buffer and advance the CRC16 shift register over it in a
+ * single pass. Each 8-byte word is loaded once, stored to the destination and
+ * fed to the slicing-by-8 tables, so the source is read only once.
+ *
+ * @param crc Current register value, CRC16_INIT for the first chunk
+ * @param dst Destination buffer, e.g. the DMA window
+ * @param src Source buffer
+ * @param size Number of bytes to copy
+ * @return uint16_t Updated register value, pass to crc16_final() to get the checksum
+ */
+uint16_t crc16_copy_update(uint16_t crc, void *dst, const void *src, size_t size);
+/**
+ * @brief Convert the CRC16 shift register into the checksum stored in the
+ * frame header (inverted, byte swapped).
+ *
+ * @param crc Register value returned by crc16_update()
+ * @return uint16_t Checksum
+ */
+static inline uint16_t crc16_final(uint16_t crc)
+{
+    crc = ~crc;
+    return (uint16_t)((crc << 8) | (crc >> 8));
+}
+/**
+ * @brief Reference bit-by-bit CRC16 implementation (the original frame
+ * checksum routine). Kept for self-check and benchmarking only.
+ *
+ * @param buf Pointer to data
+ * @param size Length of data in bytes
+ * @return uint16_t Checksum
+ */
+uint16_t crc16_bitwise(const void *buf, size_t size);
+/**
+ * @brief Update a CRC32 (IEEE 802.3, reflected polynomial 0xedb88320) over a
+ * buffer. The implementation is selected once at startup: carry-less multiply
+ * folding (PCLMULQDQ on x86, PMULL on ARMv8) or the ARMv8 CRC32 instructions
+ * where the CPU has them, slicing-by-8 lookup tables otherwise.
+ *
+ * @param crc Checksum of the preceding data, 0 for the first chunk
+ * @param buf Pointer to data
+ * @param size Length of data in bytes
+ * @return uint32_t Checksum of all data seen so far
+ */
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t size);
+/**
+ * @brief Portable slicing-by-8 CRC32, same convention as crc32_update().
+ * Exposed for self-check and benchmarking.
+ */
+uint32_t crc32_slice8_update(uint32_t crc, const void *buf, size_t size);
+/**
+ * @brief Reference byte-at-a-time CRC32 (the original crc32_tab loop). Kept
+ * for self-check and benchmarking only.
+ *
+ * @param buf Pointer to data
+ * @param size Length of data in bytes
+ * @return uint32_t Checksum
+ */
+uint32_t crc32_bytewise(const void *buf, size_t size);
+/**
+ * @brief Name of the CRC32 implementation selected at runtime.
+ *
+ * @return const char* Implementation name
+ */
+const char *crc32_impl_name(void);
+/**
+ * @brief Compare the table driven routines against the reference
+ * implementations over known vectors and random buffers.
+ *
+ * @return int Positive on success, negative on mismatch
+ */
+int crc_self_check(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIB_CRC_H
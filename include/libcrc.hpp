@@ -0,0 +1,240 @@
+/**
+ * @file libcrc.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Compile-time parameterized CRC library for C++ consumers (header only)
+ * @version 0.1
+ * @date 2021-06-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _LIB_CRC_HPP
+#define _LIB_CRC_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace modem
+{
+namespace detail
+{
+template <size_t... I>
+struct index_seq
+{
+};
+
+template <size_t N, size_t... I>
+struct make_index_seq : make_index_seq<N - 1, N - 1, I...>
+{
+};
+
+template <size_t... I>
+struct make_index_seq<0, I...>
+{
+    typedef index_seq<I...> type;
+};
+
+template <int Width>
+struct crc_uint
+{
+    typedef typename crc_uint<Width + 1>::type type;
+};
+template <>
+struct crc_uint<8>
+{
+    typedef uint8_t type;
+};
+template <>
+struct crc_uint<16>
+{
+    typedef uint16_t type;
+};
+template <>
+struct crc_uint<32>
+{
+    typedef uint32_t type;
+};
+template <>
+struct crc_uint<64>
+{
+    typedef uint64_t type;
+};
+
+constexpr uint64_t reflect(uint64_t v, int bits)
+{
+    return bits == 0 ? 0 : (((v & 1) << (bits - 1)) | reflect(v >> 1, bits - 1));
+}
+} // namespace detail
+
+/**
+ * @brief CRC of width Width bits with generator polynomial Poly (normal
+ * notation, implied top bit omitted), input and output reflection Reflect,
+ * initial register Init and final xor XorOut (the Rocksoft model, with
+ * refin == refout). The slicing-by-8 lookup tables are generated by constexpr
+ * functions at compile time, there is no runtime initialization.
+ *
+ * @tparam Width CRC width in bits, 8 to 64
+ * @tparam Poly Generator polynomial
+ * @tparam Reflect Process bits LSB first (true) or MSB first (false)
+ * @tparam Init Initial value of the register
+ * @tparam XorOut Value XORed into the register to produce the checksum
+ */
+template <int Width, uint64_t Poly, bool Reflect, uint64_t Init, uint64_t XorOut>
+struct crc
+{
+    static_assert(Width >= 8 && Width <= 64, "CRC width must be between 8 and 64 bits");
+
+    typedef typename detail::crc_uint<Width>::type value_type;
+
+    static constexpr uint64_t mask = Width == 64 ? ~0ULL : (1ULL << Width) - 1;
+    static constexpr uint64_t rpoly = detail::reflect(Poly, Width);
+
+    /**
+     * @brief Feed i zero bits through the register
+     */
+    static constexpr uint64_t step(uint64_t c, int i)
+    {
+        return i == 0 ? c : step(Reflect ? ((c & 1) ? (c >> 1) ^ rpoly : c >> 1) : (((c >> (Width - 1)) & 1) ? ((c << 1) ^ Poly) & mask : (c << 1) & mask), i - 1);
+    }
+    /**
+     * @brief Feedback terms for one byte
+     */
+    static constexpr uint64_t entry0(uint64_t n)
+    {
+        return step(Reflect ? n : n << (Width - 8), 8);
+    }
+    /**
+     * @brief Advance a feedback term by k zero bytes
+     */
+    static constexpr uint64_t advance(uint64_t v, int k)
+    {
+        return k == 0 ? v : advance(Reflect ? (v >> 8) ^ entry0(v & 0xff) : ((v << 8) & mask) ^ entry0((v >> (Width - 8)) & 0xff), k - 1);
+    }
+    /**
+     * @brief Slicing table entry: byte n followed by k zero bytes
+     */
+    static constexpr value_type entry(int k, uint64_t n)
+    {
+        return (value_type)advance(entry0(n), k);
+    }
+
+    struct tables
+    {
+        value_type t[8][256];
+        template <size_t... I>
+        constexpr tables(detail::index_seq<I...>)
+            : t{{entry(0, I)...}, {entry(1, I)...}, {entry(2, I)...}, {entry(3, I)...}, {entry(4, I)...}, {entry(5, I)...}, {entry(6, I)...}, {entry(7, I)...}}
+        {
+        }
+    };
+
+    /**
+     * @brief Slicing-by-8 lookup tables, table.t[k][n] holds the feedback terms
+     * for byte n followed by k zero bytes.
+     */
+    static constexpr tables table = tables(typename detail::make_index_seq<256>::type());
+
+    /**
+     * @brief Initial register value
+     */
+    static constexpr value_type init()
+    {
+        return (value_type)(Reflect ? detail::reflect(Init, Width) : Init);
+    }
+    /**
+     * @brief Convert a register value into the checksum
+     */
+    static constexpr value_type finalize(value_type reg)
+    {
+        return (value_type)((reg ^ XorOut) & mask);
+    }
+    /**
+     * @brief Advance the register over a buffer, can be called on consecutive chunks
+     *
+     * @param reg Register value, init() for the first chunk
+     * @param buf Pointer to data
+     * @param size Length of data in bytes
+     * @return value_type Updated register value
+     */
+    static inline value_type update(value_type reg, const void *buf, size_t size)
+    {
+        const uint8_t *p = (const uint8_t *)buf;
+        uint64_t c = reg;
+        while (size >= 8)
+        {
+            uint64_t w = 0;
+            if (Reflect)
+            {
+                memcpy(&w, p, 8); // little endian
+                w ^= c;
+                c = table.t[7][w & 0xff] ^ table.t[6][(w >> 8) & 0xff] ^
+                    table.t[5][(w >> 16) & 0xff] ^ table.t[4][(w >> 24) & 0xff] ^
+                    table.t[3][(w >> 32) & 0xff] ^ table.t[2][(w >> 40) & 0xff] ^
+                    table.t[1][(w >> 48) & 0xff] ^ table.t[0][w >> 56];
+            }
+            else
+            {
+                for (int i = 0; i < 8; i++) // big endian word
+                    w = (w << 8) | p[i];
+                w ^= c << (64 - Width);
+                c = table.t[7][w >> 56] ^ table.t[6][(w >> 48) & 0xff] ^
+                    table.t[5][(w >> 40) & 0xff] ^ table.t[4][(w >> 32) & 0xff] ^
+                    table.t[3][(w >> 24) & 0xff] ^ table.t[2][(w >> 16) & 0xff] ^
+                    table.t[1][(w >> 8) & 0xff] ^ table.t[0][w & 0xff];
+            }
+            p += 8;
+            size -= 8;
+        }
+        while (size--)
+        {
+            if (Reflect)
+                c = (c >> 8) ^ table.t[0][(c ^ *p++) & 0xff];
+            else
+                c = ((c << 8) & mask) ^ table.t[0][((c >> (Width - 8)) ^ *p++) & 0xff];
+        }
+        return (value_type)c;
+    }
+    /**
+     * @brief Checksum of a buffer
+     */
+    static inline value_type compute(const void *buf, size_t size)
+    {
+        return finalize(update(init(), buf, size));
+    }
+};
+
+template <int Width, uint64_t Poly, bool Reflect, uint64_t Init, uint64_t XorOut>
+constexpr typename crc<Width, Poly, Reflect, Init, XorOut>::tables crc<Width, Poly, Reflect, Init, XorOut>::table;
+
+/**
+ * @brief CRC-16/X-25, the CCITT polynomial used for frame checksums
+ */
+typedef crc<16, 0x1021, true, 0xffff, 0xffff> crc16_x25;
+/**
+ * @brief CRC-32 (IEEE 802.3), same as crc32() in txrx_packdef.h
+ */
+typedef crc<32, 0x04c11db7, true, 0xffffffff, 0xffffffff> crc32_ieee;
+
+/**
+ * @brief Frame checksum, same as crc16() in txrx_packdef.h: CRC-16/X-25
+ * stored byte swapped.
+ */
+struct crc16_frame : crc16_x25
+{
+    static constexpr value_type finalize(value_type reg)
+    {
+        return (value_type)(((crc16_x25::finalize(reg) << 8) | (crc16_x25::finalize(reg) >> 8)) & 0xffff);
+    }
+    static inline value_type compute(const void *buf, size_t size)
+    {
+        return finalize(update(init(), buf, size));
+    }
+};
+
+static_assert(crc32_ieee::table.t[0][1] == 0x77073096, "CRC32 table generation error");
+static_assert(crc16_x25::table.t[0][1] == 0x1189, "CRC16 table generation error");
+} // namespace modem
+
+#endif // _LIB_CRC_HPP
@@ -0,0 +1,122 @@
+/**
+ * @file libfec.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Systematic Reed-Solomon erasure code over GF(2^8) used to protect
+ * multi-frame packets against lost frames.
+ * @version 0.1
+ * @date 2021-06-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _LIB_FEC_H
+#define _LIB_FEC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Maximum number of data + parity shards in a block. Parity rows use
+ * the Cauchy matrix 1 / (x_r + y_j) with x_r = 255 - r and y_j = j, which
+ * requires n + k <= 255.
+ */
+#define FEC_MAX_SHARDS 255
+
+/**
+ * @brief Generator polynomial of GF(2^8), x^8 + x^4 + x^3 + x^2 + 1
+ */
+#define FEC_GF_POLY 0x11d
+
+/**
+ * @brief Multiply a GF(2^8) element
+ *
+ * @param a Element
+ * @param b Element
+ * @return uint8_t a * b
+ */
+uint8_t gf_mul(uint8_t a, uint8_t b);
+/**
+ * @brief Multiplicative inverse of a non-zero GF(2^8) element
+ */
+uint8_t gf_inv(uint8_t a);
+/**
+ * @brief dst ^= c * src over a region. Uses split nibble tables with PSHUFB
+ * (SSSE3) or TBL (NEON) where the CPU has them, a 256-byte multiplication
+ * table row otherwise.
+ *
+ * @param dst Destination region
+ * @param src Source region
+ * @param c Coefficient
+ * @param len Length of both regions in bytes
+ */
+void gf_mul_add_region(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+/**
+ * @brief Scalar reference of gf_mul_add_region(). Kept for self-check and
+ * benchmarking only.
+ */
+void gf_mul_add_region_ref(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+/**
+ * @brief Coefficient of data shard j in parity shard r
+ */
+uint8_t fec_coef(int r, int j);
+/**
+ * @brief Add the contribution of data shard j to the k parity shards of its
+ * block. Parity shards must be zeroed before the first data shard. Data
+ * shards can be fed in pieces, a shard shorter than the parity shards is
+ * treated as zero padded.
+ *
+ * @param k Number of parity shards
+ * @param j Index of the data shard in the block
+ * @param src Data shard (or piece of it)
+ * @param len Length of src in bytes
+ * @param parity Array of k parity shard pointers, offset to the position of src in the shard
+ * @return int Positive on success, negative on invalid arguments
+ */
+int fec_encode_update(int k, int j, const uint8_t *src, size_t len, uint8_t **parity);
+/**
+ * @brief Systematic encode of a whole block.
+ *
+ * @param n Number of data shards
+ * @param k Number of parity shards
+ * @param data Array of n data shard pointers
+ * @param parity Array of k parity shard pointers, overwritten
+ * @param len Shard length in bytes
+ * @return int Positive on success, negative on invalid arguments
+ */
+int fec_encode(int n, int k, const uint8_t *const *data, uint8_t **parity, size_t len);
+/**
+ * @brief Rebuild missing data shards of a block from the surviving data and
+ * parity shards. Any n of the n + k shards are enough.
+ *
+ * @param n Number of data shards
+ * @param data Array of n data shard pointers, missing shards must point to writable output buffers
+ * @param data_ok Array of n flags, 0 for missing data shards
+ * @param parity Array of num_parity surviving parity shard pointers
+ * @param parity_idx Row index (0 to k - 1) of each surviving parity shard
+ * @param num_parity Number of surviving parity shards
+ * @param len Shard length in bytes
+ * @return int Number of data shards rebuilt, negative if too many shards are missing
+ */
+int fec_decode(int n, uint8_t **data, const int *data_ok, const uint8_t *const *parity, const int *parity_idx, int num_parity, size_t len);
+/**
+ * @brief Name of the region multiply implementation selected at runtime.
+ */
+const char *fec_impl_name(void);
+/**
+ * @brief Check the region multiply against the reference, and round trip
+ * encode / decode over random erasure patterns.
+ *
+ * @return int Positive on success, negative on mismatch
+ */
+int fec_self_check(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIB_FEC_H
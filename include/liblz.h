@@ -0,0 +1,176 @@
+/**
+ * @file liblz.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Fast LZ77 compression in the LZ4 block format, with a streaming
+ * block framing used to compress packets ahead of the modem framing.
+ * @version 0.1
+ * @date 2021-06-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _LIB_LZ_H
+#define _LIB_LZ_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * @brief Input block size. Blocks are compressed independently, the stream
+ * encoder and decoder only ever hold one block.
+ */
+#define LZ_BLOCK_SZ 65536
+
+/**
+ * @brief Worst case size of a compressed block of n bytes
+ */
+#define LZ_BLOCK_BOUND(n) ((n) + ((n) / 255) + 16)
+
+/**
+ * @brief Block header of the stream format: payload size, with LZ_BLOCK_RAW
+ * set if the block is stored uncompressed. A zero header ends the stream.
+ */
+#define LZ_BLOCK_RAW 0x80000000
+
+/**
+ * @brief Worst case size of the block stream of n bytes of input
+ */
+#define LZ_STREAM_BOUND(n) ((n) + (((n) / LZ_BLOCK_SZ) + 1) * sizeof(uint32_t) + sizeof(uint32_t))
+
+/**
+ * @brief Per-packet compression statistics
+ */
+typedef struct
+{
+    uint64_t in_sz;  /// Bytes consumed
+    uint64_t out_sz; /// Bytes produced
+    uint64_t ns;     /// Time spent in the codec, in ns
+} lz_stats_t;
+
+/**
+ * @brief Compress a block of at most LZ_BLOCK_SZ bytes in the LZ4 block format
+ *
+ * @param src Input
+ * @param src_sz Input size in bytes
+ * @param dst Output
+ * @param dst_cap Output capacity, LZ_BLOCK_BOUND(src_sz) always fits
+ * @return int Compressed size, 0 if the output does not fit
+ */
+int lz_compress_block(const uint8_t *src, int src_sz, uint8_t *dst, int dst_cap);
+/**
+ * @brief Decompress an LZ4 format block. Malformed input is detected, the
+ * decoder never reads or writes out of bounds.
+ *
+ * @param src Compressed block
+ * @param src_sz Compressed size in bytes
+ * @param dst Output
+ * @param dst_cap Output capacity
+ * @return int Decompressed size, negative on malformed input
+ */
+int lz_decompress_block(const uint8_t *src, int src_sz, uint8_t *dst, int dst_cap);
+
+/**
+ * @brief Streaming encoder, produces the block stream of a buffer, or of a
+ * list of buffers, one block at a time.
+ */
+typedef struct
+{
+    const struct iovec *iov; /// Input fragments
+    int iovcnt;              /// Number of input fragments
+    int iov_idx;             /// Fragment being read
+    size_t iov_ofst;         /// Read offset in the fragment
+    struct iovec iov1[1];    /// Fragment list of a single input buffer
+    size_t src_sz;           /// Input size
+    size_t src_ofst;         /// Input consumed so far
+    uint8_t *in;             /// Input block gathered from fragments, NULL for a single buffer
+    uint8_t *blk;            /// Current block header and payload
+    size_t blk_sz;           /// Bytes in blk
+    size_t blk_ofst;         /// Bytes of blk handed out
+    int done;                /// End of stream header has been produced
+    lz_stats_t stats;        /// Statistics
+} lz_enc_t;
+
+/**
+ * @brief Initialize a streaming encoder over a buffer
+ *
+ * @return int Positive on success, negative on allocation failure
+ */
+int lz_enc_init(lz_enc_t *enc, const uint8_t *src, size_t src_sz);
+/**
+ * @brief Initialize a streaming encoder over a list of buffers, compressed as
+ * if they were one. A block that spans fragments is gathered into a block
+ * sized buffer first, allocated if there is more than one fragment. The list
+ * has to stay valid while the encoder is in use.
+ *
+ * @return int Positive on success, negative on allocation failure
+ */
+int lz_enc_init_iov(lz_enc_t *enc, const struct iovec *iov, int iovcnt);
+/**
+ * @brief Get the next piece of the block stream. The pointer stays valid until
+ * the next call.
+ *
+ * @param enc Encoder
+ * @param ptr Set to the next bytes of the stream
+ * @param max Maximum number of bytes wanted
+ * @return size_t Number of bytes at ptr, 0 at the end of the stream
+ */
+size_t lz_enc_next(lz_enc_t *enc, const uint8_t **ptr, size_t max);
+/**
+ * @brief Check if the whole block stream, end of stream header included, has
+ * been handed out.
+ */
+static inline int lz_enc_eof(const lz_enc_t *enc)
+{
+    return enc->done && (enc->blk_ofst == enc->blk_sz);
+}
+/**
+ * @brief Release the encoder block buffers
+ */
+void lz_enc_free(lz_enc_t *enc);
+
+/**
+ * @brief Streaming decoder, consumes the block stream in pieces of any size
+ * and writes the output in place.
+ */
+typedef struct
+{
+    uint8_t *dst;      /// Output buffer
+    size_t dst_cap;    /// Output capacity
+    size_t dst_ofst;   /// Output produced so far
+    uint8_t *blk;      /// Current block payload
+    uint8_t hdr[4];    /// Current block header
+    size_t have;       /// Bytes of the current header or payload received
+    uint32_t need;     /// Payload size of the current block
+    int state;         /// 0: header, 1: payload, 2: end of stream, negative on error
+    lz_stats_t stats;  /// Statistics
+} lz_dec_t;
+
+/**
+ * @brief Initialize a streaming decoder
+ *
+ * @return int Positive on success, negative on allocation failure
+ */
+int lz_dec_init(lz_dec_t *dec, uint8_t *dst, size_t dst_cap);
+/**
+ * @brief Feed bytes of the block stream. Bytes after the end of stream are ignored.
+ *
+ * @return int 1 if more input is expected, 0 at the end of stream, negative on malformed input
+ */
+int lz_dec_write(lz_dec_t *dec, const uint8_t *src, size_t len);
+/**
+ * @brief Release the decoder block buffer
+ */
+void lz_dec_free(lz_dec_t *dec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIB_LZ_H
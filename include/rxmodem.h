@@ -22,6 +22,7 @@ extern "C" {
 #include <stdint.h>
 #include <stdio.h>
 #include "txrx_packdef.h"
+#include "liblz.h"
 
 #define NUM_IRQ_RETRIES 1
 
@@ -71,9 +72,18 @@ typedef enum
     RX_THREAD_SPAWN,
     RX_FRAME_CRC_FAILED,
     RX_MALLOC_FAILED,
+    RX_FRAME_HDR_CRC_MISMATCH,
+    RX_PACK_CRC_FAILED,
+    RX_DECOMPRESS_FAILED,
+    RX_AGG_TRUNCATED,
+    RX_PACK_COMPRESSED,
 } RXMODEM_ERROR;
 
 #define RXMODEM_TIMEOUT 60000 // 60 seconds in ms
+#define RXMODEM_RUN_QUEUE 16        // Packets the RX engine holds for the consumer, the oldest one is dropped when full
+#define RXMODEM_RUN_POLL_MS 100     // IRQ wait of the RX engine between checks for rxmodem_halt, in ms
+#define RXMODEM_PACK_TIMEOUT 1000   // An incomplete packet is handed over after this long without frames, in ms
+#define RXMODEM_REASM_SLOTS 8       // Packets the RX engine reassembles at once, the least recently updated one is evicted for a new one
 
 typedef struct
 {
@@ -88,18 +98,135 @@ typedef struct
     int ext_fr_gain;
 } rxmodem_conf_t;
 
+/**
+ * @brief Per-frame result of rxmodem_read_frames
+ */
+typedef struct
+{
+    ssize_t ofst; /// Offset of the frame payload in the output buffer (of its decompressed output for compressed packets)
+    ssize_t len;  /// Length of the frame payload in bytes (of its decompressed output for compressed packets)
+    int frame_id; /// Frame ID from the frame header
+    int status;   /// 1 if buf[ofst, ofst + len) is valid, RX_FRAME_CRC_FAILED, RX_FRAME_HDR_CRC_MISMATCH or RX_DECOMPRESS_FAILED on error, 0 if the frame was not read
+} rxmodem_frame_status;
+
+/**
+ * @brief Packet data of a frame in the DMA buffer, see rxmodem_read_views
+ */
+typedef struct
+{
+    const uint8_t *ptr; /// Packet data carried by the frame, in the DMA buffer
+    ssize_t len;        /// Bytes at ptr
+    ssize_t ofst;       /// Offset of the data in the packet
+    int frame_id;       /// Frame ID from the frame header
+    int crc_ok;         /// 1 if the frame CRC is valid, 0 otherwise
+} rxmodem_frame_view;
+
+/**
+ * @brief rxmodem_read_frames flag: do not copy out frames whose two header CRC
+ * copies (frame_crc, frame_crc2) disagree. The corresponding byte range of the
+ * output buffer is left untouched.
+ */
+#define RXMODEM_READ_SKIP_BAD_HDR 0x1
+
+struct rx_pack_crc;
+
+/**
+ * @brief Packet reassembled by the RX engine: the frames received for one
+ * packet ID, data frames by frame ID followed by the parity frames, in the RX
+ * ring in the DMA buffer. Duplicate frames are dropped.
+ */
+typedef struct
+{
+    ssize_t *frame_ofst;     /// DMA buffer offset of each frame
+    uint32_t *frame_id;      /// Frame ID of each frame
+    int frame_num;           /// Frames received
+    int max_frames;          /// Size of frame_ofst and frame_id
+    uint8_t *data_map;       /// Data frames received, bit frame_id
+    size_t data_map_sz;      /// Bytes in data_map
+    uint8_t *parity_map;     /// Parity frames received, bit block * FEC_MAX_SHARDS + parity index
+    size_t parity_map_sz;    /// Bytes in parity_map
+    uint64_t pack_id;        /// Packet ID of the frames
+    int num_frames;          /// Frames of the packet from its descriptor, 0 if unknown (ends with the frame flagged MODEM_FLAG_LAST)
+    int last_seen;           /// A frame flagged MODEM_FLAG_LAST has been received
+    int pack_crc_status;     /// Packet CRC32 check of the frames as they landed, see rxmodem
+    uint64_t start;          /// RX ring position of the first frame to arrive
+    uint64_t bytes;          /// RX ring bytes taken by the frames
+    uint64_t last_ns;        /// Time the last frame arrived
+    struct rx_pack_crc *crc; /// Packet CRC32 check state
+} rxmodem_pack_t;
+
+/**
+ * @brief Packet or frame passed to the handler set with rxmodem_set_handler
+ */
+typedef struct
+{
+    const uint8_t *data; /// Packet data read by rxmodem_read, or the frame payload in the DMA buffer (RXMODEM_HANDLER_FRAMES), valid until the handler returns
+    ssize_t size;        /// Bytes in data, or a negative error from rxmodem_read
+    ssize_t pack_sz;     /// Packet size, 0 for frames that do not carry it, negative error from rxmodem_receive if no packet was received (data is NULL)
+    uint64_t pack_id;    /// Packet ID
+    int frame_id;        /// Frame ID of the frame, -1 for packets
+    int flags;           /// MODEM_FLAG_* of the packet or the frame
+    int status;          /// Packets: pack_crc_status. Frames: 1 if the frame CRC is valid, RX_FRAME_CRC_FAILED or RX_FRAME_HDR_CRC_MISMATCH (data is NULL) on error
+} rxmodem_event_t;
+
+/**
+ * @brief Packet or frame handler, see rxmodem_set_handler
+ */
+typedef void (*rxmodem_handler_t)(const rxmodem_event_t *ev, void *user);
+
+/**
+ * @brief rxmodem_set_handler flag: call the handler with every frame as it
+ * lands instead of with each packet
+ */
+#define RXMODEM_HANDLER_FRAMES 0x1
+
 typedef struct
 {
     uio_dev bus[1];                    /// Pointer to uio device struct for the modem
     adidma dma[1];                     /// Pointer to ADI DMA struct
     rxmodem_conf_t conf[1];            /// RX modem configuration
     ssize_t *frame_ofst;               /// RX frame offset
-    pthread_t thr[1];                  /// Pointer to RX thread
-    int retcode;                       /// Return code from the irq thread, check on each wakeup
+    int max_frames;                    /// Size of frame_ofst
+    pthread_t thr[1];                  /// RX engine thread
+    int retcode;                       /// Return code from the RX engine, negative once it stopped on an error
     int read_done;                     /// indicate read has been done
     int rx_done;                       /// Indicates thr to finish
+    int running;                       /// The RX engine is running, see rxmodem_run
+    pthread_mutex_t run_m;             /// Protects the RX ring and the packet queue
+    pthread_cond_t run_cond;           /// Wakes up rxmodem_receive (packet queued) and the RX engine (packet released)
+    uint64_t ring_head;                /// RX ring position the next frame is received at, the DMA buffer offset is ring_head % dma->mem_sz
+    rxmodem_pack_t table[RXMODEM_REASM_SLOTS]; /// Packets being reassembled, free if frame_num is 0
+    size_t reasm_budget;               /// RX ring bytes the packets being reassembled may take, the least recently updated ones are evicted beyond it. Set to half the DMA buffer by rxmodem_init
+    uint64_t reasm_done[RXMODEM_REASM_SLOTS]; /// Packet IDs last handed over, their late frames are dropped as duplicates for RXMODEM_PACK_TIMEOUT or until a new frame 0
+    uint64_t reasm_done_ns[RXMODEM_REASM_SLOTS]; /// Time each packet of reasm_done was handed over
+    int reasm_done_head;               /// Next entry of reasm_done to be written
+    rxmodem_pack_t *queue;             /// Packets received and not yet returned by rxmodem_receive, oldest at queue_head
+    int queue_head;                    /// Oldest packet in the queue
+    int queue_cnt;                     /// Packets in the queue
+    int loaned;                        /// The frames of the packet returned by rxmodem_receive are in use until the next call
+    uint64_t loan_start;               /// RX ring position of the first frame of that packet
+    uint64_t num_packs;                /// Packets returned by rxmodem_receive
+    uint64_t num_dropped;              /// Packets dropped because the consumer fell behind
+    uint64_t num_evicted;              /// Incomplete packets evicted from the reassembly table
+    uint64_t num_timeouts;             /// Incomplete packets handed over after RXMODEM_PACK_TIMEOUT, or RXMODEM_RUN_POLL_MS once the last frame is in
+    uint64_t num_dups;                 /// Duplicate frames dropped
+    uint64_t num_overflows;            /// Frames that found the RX ring full, packets were dropped or the engine waited for rxmodem_release to make room
+    uint64_t ring_hwm;                 /// Most RX ring bytes in use at once, frames of released packets excluded
+    uint64_t pack_id;                  /// Packet ID of the packet received
+    int fd;                            /// eventfd readable while packets are queued, see rxmodem_fd
+    int fd_ready;                      /// fd is readable
+    rxmodem_handler_t handler;         /// Called with each packet or frame, see rxmodem_set_handler
+    void *handler_user;                /// Passed to handler
+    int handler_flags;                 /// RXMODEM_HANDLER_FRAMES, or 0
+    int handler_done;                  /// Stops handler_thr
+    int handler_busy;                  /// The RX engine is calling a RXMODEM_HANDLER_FRAMES handler
+    pthread_t handler_thr[1];          /// Reads each packet and calls handler
     int frame_num;                     /// Length of frames on buffer (read up to this offset)
-    size_t max_pack_sz;
+    int last_seen;                     /// A frame flagged MODEM_FLAG_LAST has been received
+    int pack_flags;                    /// MODEM_FLAG_* of the packet received (0 for v1 headers), MODEM_FLAG_AGG packets are split with rxmodem_agg_next
+    size_t max_pack_sz;                /// Largest packet accepted, uncompressed packets also have to fit in the DMA buffer. Set to UINT32_MAX by rxmodem_init
+    int pack_crc_status;               /// Packet CRC32 trailer check: 1 if valid, RX_PACK_CRC_FAILED on error, 0 if the packet has no trailer or is incomplete
+    lz_stats_t lz_stats;               /// Decompression of the last compressed packet read: block stream size, data size and CPU time
 } rxmodem;
 
 /**
@@ -112,7 +239,8 @@ typedef struct
  */
 int rxmodem_init(rxmodem *dev, int rxmodem_id, int rxdma_id);
 /**
- * @brief Restore default configuration of the modem
+ * @brief Restore default configuration of the modem. The modem is armed
+ * again if the RX engine is running.
  * 
  * @param dev rxmodem struct to describe the device
  * @param conf Configuration to write, unused
@@ -134,15 +262,75 @@ int rxmodem_start(rxmodem *dev);
  */
 int rxmodem_stop(rxmodem *dev);
 /**
- * @brief Arm the radio and wait to receive data. Blocks until all frames have been received 
- * (i.e. all expected interrupts are addressed) for a valid frame header, or returns immediately.
+ * @brief Start the RX engine. The modem and its FIFO are reset and armed once,
+ * then a thread keeps it armed and receives frames back to back into a ring
+ * in the DMA buffer. Frames are sorted into a table of up to
+ * RXMODEM_REASM_SLOTS packets by packet ID, so the frames of several packets
+ * may be interleaved. A packet is handed to rxmodem_receive through a queue of
+ * RXMODEM_RUN_QUEUE packets once all its frames are in, its last frame arrives
+ * or RXMODEM_PACK_TIMEOUT passes without frames. Started by the first
+ * rxmodem_receive if not called.
+ *
+ * @param dev rxmodem struct to describe the device
+ * @return int Positive on success, negative on error
+ */
+int rxmodem_run(rxmodem *dev);
+/**
+ * @brief Stop the RX engine and disarm the modem. Packets still queued are dropped.
+ *
+ * @param dev rxmodem struct to describe the device
+ */
+void rxmodem_halt(rxmodem *dev);
+/**
+ * @brief Wait for the next packet of the RX engine, starting it if needed.
+ * Blocks for up to RXMODEM_TIMEOUT. The frames of the previous packet are
+ * released to the engine, the ones returned stay in the DMA buffer for
+ * rxmodem_read until rxmodem_release or the next call.
  * 
  * @param dev rxmodem struct to describe the device
  * @return ssize_t Size of the packet to be received, to be used to allocate buffer for rxmodem_read.
  */
 ssize_t rxmodem_receive(rxmodem *dev);
 /**
- * @brief Read N bytes from the internal buffer of the rxmodem after receiving
+ * @brief Release the frames of the packet returned by rxmodem_receive to the
+ * RX engine once it has been read. The RX ring wraps around the DMA buffer,
+ * so streams of any length are received as long as packets are released
+ * before the ring fills up; see num_overflows and ring_hwm. rxmodem_read
+ * returns nothing until the next rxmodem_receive.
+ *
+ * @param dev rxmodem struct to describe the device
+ */
+void rxmodem_release(rxmodem *dev);
+/**
+ * @brief Get a descriptor to wait for packets with poll, select or epoll,
+ * starting the RX engine if needed. The eventfd is readable (POLLIN) while
+ * packets are queued, rxmodem_receive then returns without blocking.
+ *
+ * @param dev rxmodem struct to describe the device
+ * @return int File descriptor, negative on error
+ */
+int rxmodem_fd(rxmodem *dev);
+/**
+ * @brief Set a handler to be called with each packet as soon as its last frame
+ * is in, starting the RX engine if needed. A thread waits for the packets,
+ * reads them into a buffer valid for the duration of the call and calls the
+ * handler, with errors of rxmodem_receive as well. With RXMODEM_HANDLER_FRAMES
+ * the handler is called by the RX engine with the payload of every frame as it
+ * lands, and the frames are not kept for rxmodem_receive; the handler must
+ * then return quickly. While a handler is set, rxmodem_receive must not be
+ * called. Returns once the previous handler is no longer running, so it must
+ * not be called from a handler.
+ *
+ * @param dev rxmodem struct to describe the device
+ * @param cb Handler, NULL to remove the current one
+ * @param user Passed to the handler
+ * @param flags RXMODEM_HANDLER_FRAMES, or 0
+ * @return int Positive on success, negative on error
+ */
+int rxmodem_set_handler(rxmodem *dev, rxmodem_handler_t cb, void *user, int flags);
+/**
+ * @brief Read N bytes from the internal buffer of the rxmodem after receiving.
+ * Compressed packets are decompressed into buf.
  * TODO: Better error management on read
  * 
  * @param dev rxmodem struct to describe the device
@@ -152,7 +340,52 @@ ssize_t rxmodem_receive(rxmodem *dev);
  */
 ssize_t rxmodem_read(rxmodem *dev, uint8_t *buf, ssize_t size);
 /**
- * @brief Reset and close an rxmodem device
+ * @brief Read N bytes from the internal buffer of the rxmodem after receiving,
+ * reporting the outcome of each frame. Each frame is copied out of the DMA
+ * buffer and checked against its CRC in a single pass. If the packet carries
+ * erasure code parity frames, data frames are placed by frame ID, lost or
+ * corrupted ones are rebuilt from the parity frames, and status is indexed by
+ * data frame ID instead of arrival order. Compressed packets (MODEM_FLAG_LZ)
+ * are decompressed into buf as the frames are read, holding one compressed
+ * block at a time; decoding stops at the first frame that can not be
+ * recovered.
+ *
+ * @param dev rxmodem struct to describe the device
+ * @param buf Pointer to N-byte buffer to store the received data
+ * @param size Size of the buffer in bytes
+ * @param status Array to store per-frame results in, can be NULL
+ * @param max_status Number of elements in status, frames beyond this are not reported
+ * @param flags RXMODEM_READ_SKIP_BAD_HDR, or 0
+ * @return ssize_t Number of bytes recovered with a valid CRC, if ret != N, check status
+ */
+ssize_t rxmodem_read_frames(rxmodem *dev, uint8_t *buf, ssize_t size, rxmodem_frame_status *status, int max_status, int flags);
+/**
+ * @brief Get the packet data returned by rxmodem_receive where it landed in
+ * the DMA buffer, without copying it. Views are sorted by packet offset, one
+ * per data frame with a valid header; lost frames leave gaps and are not
+ * rebuilt from parity frames. Views are valid until rxmodem_release or the
+ * next rxmodem_receive. Compressed packets have to be read with rxmodem_read.
+ *
+ * @param dev rxmodem struct to describe the device
+ * @param views Array to store the views in
+ * @param max_views Number of elements in views, frame_num is enough
+ * @return int Number of views, RX_PACK_COMPRESSED if the packet is compressed
+ */
+int rxmodem_read_views(rxmodem *dev, rxmodem_frame_view *views, int max_views);
+/**
+ * @brief Get the next message of an aggregated packet (MODEM_FLAG_AGG in
+ * pack_flags) read into buf. Messages point into buf, nothing is copied.
+ *
+ * @param buf Packet read by rxmodem_read
+ * @param size Number of valid bytes in buf
+ * @param ofst Offset of the next message, set to 0 before the first call
+ * @param msg Set to the start of the message
+ * @param len Set to the message size in bytes
+ * @return int 1 if a message is returned, 0 at the end of the packet, RX_AGG_TRUNCATED if the rest of buf does not hold a whole message
+ */
+int rxmodem_agg_next(const uint8_t *buf, ssize_t size, ssize_t *ofst, const uint8_t **msg, ssize_t *len);
+/**
+ * @brief Reset and close an rxmodem device, removing the handler and stopping the RX engine
  * 
  * @param dev rxmodem struct to describe the device
  */
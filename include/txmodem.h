@@ -25,6 +25,9 @@ extern "C" {
 #include "adidma.h"
 #include <pthread.h>
 #include <stdint.h>
+#include <sys/uio.h>
+#include "txrx_packdef.h"
+#include "liblz.h"
 
 typedef enum
 {
@@ -35,12 +38,83 @@ typedef enum
     TXMODEM_SRC_SEL = 0x124,                 /// 0 == DMA, 1 == Internal packet gen
 } TXMODEM_REGS;
 
+/**
+ * @brief Default number of framed bytes the writer hands to the TX ring drain
+ * thread at once. The thread queues them while the next ones are framed.
+ */
+#define TXMODEM_TX_BATCH 16384
+
+/**
+ * @brief Time in us the drain thread sleeps between completion polls while
+ * transfers are in flight and no frames are ready
+ */
+#define TXMODEM_RING_POLL_US 200
+
+/**
+ * @brief Time in us the TX ring stays idle before the beacon loops again
+ */
+#define TXMODEM_BEACON_IDLE_US 1000
+
+/**
+ * @brief TX ring in the DMA buffer. The writer frames packets at the head,
+ * the drain thread queues the framed bytes to the DMA in contiguous spans,
+ * and the space behind the transfers that are out is free again. A frame that
+ * does not fit before the end of the buffer starts over at offset 0, and the
+ * span in flight at that point is split. Positions count bytes since
+ * txmodem_init, the DMA buffer offset of a position is position % size.
+ * While a beacon is set, its frame sits past the end of the ring, and the
+ * drain thread loops it with a cyclic transfer whenever the ring is idle.
+ */
+typedef struct
+{
+    uint64_t size;                       // Ring size, the DMA buffer size
+    uint64_t head;                       // Position the next frame is written at
+    uint64_t ready;                      // Frames before this position may be sent
+    uint64_t sent;                       // Frames before this position are queued to the DMA
+    uint64_t tail;                       // Frames before this position are out
+    uint64_t gap;                        // Position of the unused end of the buffer the head skipped last, 0 if none
+    int64_t xfer[ADIDMA_MAX_XFERS];      // DMA transfers in flight, oldest at xfer_head
+    uint64_t xfer_end[ADIDMA_MAX_XFERS]; // Position each transfer in flight ends at
+    int xfer_head;                       // Oldest transfer in flight
+    int xfer_cnt;                        // Transfers in flight
+    uint64_t wait_pos;                   // Largest position a writer waits for the tail to reach, for space or for its frames to go out
+    int held;                            // A writer is framing at the head (an acquired zero-copy frame until it is committed), other writers wait
+    int error;                           // DMA error, returned to the next writer that waits
+    int done;                            // Stops the drain thread
+    pthread_t thr[1];                    // Drain thread
+    pthread_mutex_t m;                   // Protects the positions
+    pthread_cond_t cond;                 // Wakes up the drain thread
+    pthread_cond_t space;                // Wakes up writers
+    uint64_t num_xfers;                  // DMA transfers issued
+    uint64_t num_splits;                 // Spans split at the end of the buffer
+    int beacon;                          // A beacon is set
+    int beacon_on;                       // The beacon cyclic transfer is running
+    uint64_t beacon_ofst;                // DMA buffer offset of the beacon frame
+    uint64_t beacon_sz;                  // Size of the beacon frame in the DMA buffer
+    uint64_t idle_ns;                    // Time the last transfer completed
+    uint64_t num_beacons;                // Times the beacon started looping
+    uint64_t num_takeovers;              // Times frames took the channel over from the beacon
+} txmodem_ring_t;
+
 typedef struct
 {
     uio_dev bus[1];
     adidma dma[1];
     size_t mtu;         // MTU of a frame (data size only, TX header size and frame header size has to be accounted for in TX, and frame header size and 8 byte padding has to be accounted for in RX)
-    size_t max_pack_sz; // Maximum packet size
+    size_t max_pack_sz; // Maximum packet size, set by the packet size field as frames stream through the TX ring
+    int pack_crc;       // Set to append a CRC32 of the whole packet after the data (carried in the final frame), cleared by txmodem_init. Receivers without trailer support drop the frames of v1 packets that carry it, as they run past the packet size
+    int fec_n;          // Data frames per erasure code block, 0 to disable, cleared by txmodem_init
+    int fec_k;          // Parity frames appended to each block of fec_n data frames, fec_n + fec_k <= FEC_MAX_SHARDS
+    int hdr_version;    // Frame header format, MODEM_HDR_V1 (set by txmodem_init) or MODEM_HDR_V2
+    int compress;       // Set to compress the packet data (liblz, sent with MODEM_HDR_V2 headers), cleared by txmodem_init
+    lz_stats_t lz_stats; // Compression of the last packet: data size, compressed stream size and CPU time
+    uint64_t frames_tx;  // Frames handed to the DMA since txmodem_init
+    size_t tx_batch;     // Framed bytes handed to the TX ring drain thread at once (the last ones of a packet may be fewer), 0 for every frame, set to TXMODEM_TX_BATCH by txmodem_init
+    txmodem_ring_t ring[1]; // TX ring in the DMA buffer
+    uint64_t frame_pos;  // TX ring position of the acquired zero-copy frame
+    int frame_acquired;  // A zero-copy frame is acquired
+    size_t frame_cap;    // Payload capacity of the acquired frame
+    int frame_v2;        // The acquired frame has a v2 header
 } txmodem;
 /**
  * @brief Initialize TX Modem IP
@@ -60,7 +134,8 @@ int txmodem_init(txmodem *dev, int txmodem_id, int txdma_id);
  */
 int txmodem_reset(txmodem *dev, int src_sel);
 /**
- * @brief Take supplied data, split into packets and transmit them through the TX path, blocks until transfer is completed
+ * @brief Take supplied data, split into packets and transmit them through the TX path, blocks until transfer is completed.
+ * The frames stream through the TX ring, so the packet size is not limited by the DMA buffer size.
  * 
  * @param dev Pointer to txmodem struct
  * @param buf Pointer to source buffer
@@ -68,6 +143,404 @@ int txmodem_reset(txmodem *dev, int src_sel);
  * @return int positive on success, negative on failure
  */
 int txmodem_write(txmodem *dev, uint8_t *buf, ssize_t size);
+/**
+ * @brief Transmit the fragments of iov as one packet, as txmodem_write would
+ * their concatenation. Frames are filled straight from the fragments, and may
+ * span fragment boundaries.
+ *
+ * @param dev Pointer to txmodem struct
+ * @param iov Fragments of the packet
+ * @param iovcnt Number of fragments
+ * @return int positive on success, negative on failure
+ */
+int txmodem_writev(txmodem *dev, const struct iovec *iov, int iovcnt);
+/**
+ * @brief Get the payload area of the next frame at the head of the TX ring,
+ * in the DMA buffer. The producer writes up to capacity bytes there and sends
+ * them with txmodem_frame_commit, the library fills in the frame size,
+ * header, packet descriptor, CRCs and padding around them. Each frame goes on
+ * air as a single frame packet (MTU, header version and packet CRC as for
+ * txmodem_write, without compression or erasure coding). Waits for space in
+ * the ring. The head of the ring is held until txmodem_frame_commit: the
+ * writer threads of txmodem_async_t, txmodem_sched_t and txmodem_agg_t wait,
+ * and txmodem_write and txmodem_writev fail.
+ *
+ * @param dev Pointer to txmodem struct
+ * @param payload Set to the start of the payload area
+ * @param capacity Set to the size of the payload area
+ * @return int Positive on success, negative on failure
+ */
+int txmodem_frame_acquire(txmodem *dev, uint8_t **payload, size_t *capacity);
+/**
+ * @brief Send the first len bytes of the acquired frame. Returns once the
+ * frame is handed to the drain thread, the payload area must not be touched
+ * afterwards.
+ *
+ * @param dev Pointer to txmodem struct
+ * @param len Payload size, up to the capacity. 0 releases the frame without sending.
+ * @return int Positive on success, 0 if nothing was sent, negative on failure
+ */
+int txmodem_frame_commit(txmodem *dev, size_t len);
+/**
+ * @brief Block until the committed frames are out
+ *
+ * @param dev Pointer to txmodem struct
+ * @return int Positive on success, negative on failure
+ */
+int txmodem_frame_flush(txmodem *dev);
+/**
+ * @brief Frame a beacon once and loop it in hardware with a cyclic DMA
+ * transfer whenever nothing else is on air, e.g. to keep the carrier tracking
+ * of the receiver locked. The beacon is a single frame packet, as a
+ * zero-copy frame, and every repeat carries the same packet ID. Frames
+ * written afterwards take the channel over at the end of the beacon repeat
+ * on air, and the beacon loops again once the TX ring has been idle for
+ * TXMODEM_BEACON_IDLE_US. Replaces the beacon that is set, and waits for the
+ * frames in flight. Not to be called while a packet or zero-copy frame is
+ * being written.
+ *
+ * @param dev Pointer to txmodem struct
+ * @param buf Beacon payload
+ * @param len Payload size, up to the payload capacity of a zero-copy frame
+ * @return int Positive on success, negative on failure
+ */
+int txmodem_beacon_start(txmodem *dev, const uint8_t *buf, size_t len);
+/**
+ * @brief Stop looping the beacon, at the end of the repeat on air, and give
+ * its memory back to the TX ring
+ *
+ * @param dev Pointer to txmodem struct
+ * @return int Positive on success, 0 if no beacon was set, negative on failure
+ */
+int txmodem_beacon_stop(txmodem *dev);
+/**
+ * @brief Default size at which txmodem_agg_write sends the pending messages
+ */
+#define TXMODEM_AGG_THRESHOLD 4000
+/**
+ * @brief Default time in ms the oldest pending message waits for more to aggregate
+ */
+#define TXMODEM_AGG_MAX_DELAY 50
+
+/**
+ * @brief Packs small messages into one packet (MODEM_FLAG_AGG) to save the
+ * per-packet framing and DMA setup. The pending messages are sent once they
+ * reach the size threshold, or once the oldest has waited max_delay_ms.
+ * While in use, the aggregator is the only writer of the txmodem.
+ */
+typedef struct
+{
+    txmodem *dev;          // TX modem the packets are written to
+    size_t threshold;      // Size of the pending messages that triggers a send
+    int max_delay_ms;      // Time the oldest pending message may wait
+    uint8_t *buf[2];       // Fill buffer, and the buffer on air
+    size_t cap;            // Size of each buffer
+    int fill;              // Index of the fill buffer
+    size_t sz;             // Bytes pending in the fill buffer
+    int pend_msgs;         // Messages pending in the fill buffer
+    uint64_t first_ns;     // Time the oldest pending message was queued
+    int done;              // Stops the timer thread
+    pthread_t thr[1];      // Timer thread
+    pthread_mutex_t m;     // Protects the fill buffer
+    pthread_mutex_t tx_m;  // Serializes sends
+    pthread_cond_t cond;   // Wakes up the timer thread
+    pthread_cond_t swap;   // Wakes up producers waiting for room once the fill buffer is swapped out
+    uint64_t num_msgs;     // Messages sent
+    uint64_t num_packs;    // Packets sent
+    uint64_t num_bytes;    // Aggregated bytes sent, length prefixes included
+} txmodem_agg_t;
+
+/**
+ * @brief Initialize an aggregator and start its timer thread
+ *
+ * @param agg Pointer to txmodem_agg_t struct
+ * @param dev Initialized txmodem to send through
+ * @param threshold Pending bytes that trigger a send, 0 for TXMODEM_AGG_THRESHOLD
+ * @param max_delay_ms Maximum wait of a message in ms, 0 for TXMODEM_AGG_MAX_DELAY
+ * @return int Positive on success, negative on failure
+ */
+int txmodem_agg_init(txmodem_agg_t *agg, txmodem *dev, size_t threshold, int max_delay_ms);
+/**
+ * @brief Queue a message, up to MODEM_AGG_MAX_MSG bytes. Sends the pending
+ * messages, blocking until they are out, if the threshold is reached. Safe to
+ * call from several threads; a message that does not fit in the fill buffer
+ * waits until the pending messages are swapped out.
+ *
+ * @param agg Pointer to txmodem_agg_t struct
+ * @param msg Message
+ * @param len Message size in bytes
+ * @return int Positive on success, negative on failure
+ */
+int txmodem_agg_write(txmodem_agg_t *agg, const uint8_t *msg, size_t len);
+/**
+ * @brief Queue a message made of the fragments of iov, as txmodem_agg_write
+ * would their concatenation
+ *
+ * @param agg Pointer to txmodem_agg_t struct
+ * @param iov Fragments of the message
+ * @param iovcnt Number of fragments
+ * @return int Positive on success, negative on failure
+ */
+int txmodem_agg_writev(txmodem_agg_t *agg, const struct iovec *iov, int iovcnt);
+/**
+ * @brief Send the pending messages now
+ *
+ * @param agg Pointer to txmodem_agg_t struct
+ * @return int Positive on success, 0 if nothing was pending, negative on failure
+ */
+int txmodem_agg_flush(txmodem_agg_t *agg);
+/**
+ * @brief Send the pending messages, stop the timer thread and free the buffers
+ *
+ * @param agg Pointer to txmodem_agg_t struct
+ */
+void txmodem_agg_destroy(txmodem_agg_t *agg);
+/**
+ * @brief Default number of packets txmodem_async_t keeps in flight
+ */
+#define TXMODEM_ASYNC_DEPTH 16
+
+/**
+ * @brief Completion of an asynchronous write
+ */
+typedef struct
+{
+    uint64_t id; // Write ID returned by txmodem_write_async
+    void *tag;   // Tag passed to txmodem_write_async
+    int ret;     // Return value of the write, as for txmodem_write
+} txmodem_async_cpl_t;
+
+/**
+ * @brief Completion callback, called from the TX worker thread
+ */
+typedef void (*txmodem_async_cb_t)(const txmodem_async_cpl_t *cpl, void *user);
+
+/**
+ * @brief Queued asynchronous write
+ */
+typedef struct
+{
+    const uint8_t *buf;
+    ssize_t size;
+    void *tag;
+    uint64_t id;
+} txmodem_async_req_t;
+
+/**
+ * @brief TX worker thread that owns the txmodem DMA channel. Producers queue
+ * packets with txmodem_write_async and return immediately, the worker frames
+ * and transmits them in order. Completions are delivered through the
+ * callback if one is set, otherwise they are queued for txmodem_async_poll and
+ * signalled on the pollable completion fd. While in use, the worker is the
+ * only writer of the txmodem.
+ */
+typedef struct
+{
+    txmodem *dev;              // TX modem the packets are written to
+    int depth;                 // Packets queued or on air, and completions waiting to be polled
+    txmodem_async_req_t *req;  // Request ring
+    int req_head;              // Next request to transmit
+    int req_cnt;               // Requests queued
+    txmodem_async_cpl_t *cpl;  // Completion ring, unused with a callback
+    int cpl_head;              // Next completion to poll
+    int cpl_cnt;               // Completions queued
+    int busy;                  // A packet is on air
+    uint64_t next_id;          // ID of the next write
+    txmodem_async_cb_t cb;     // Completion callback, NULL to queue completions
+    void *user;                // Completion callback argument
+    int efd;                   // Completion eventfd, readable while completions are queued
+    int done;                  // Stops the worker thread
+    pthread_t thr[1];          // Worker thread
+    pthread_mutex_t m;         // Protects the rings
+    pthread_cond_t cond;       // Wakes up the worker thread
+    pthread_cond_t space;      // Wakes up producers and txmodem_async_drain
+    uint64_t num_packs;        // Packets transmitted
+    uint64_t num_bytes;        // Bytes transmitted
+    uint64_t num_errors;       // Writes that failed
+} txmodem_async_t;
+
+/**
+ * @brief Initialize the asynchronous writer and start its worker thread
+ *
+ * @param q Pointer to txmodem_async_t struct
+ * @param dev Initialized txmodem to send through
+ * @param depth Maximum packets in flight, 0 for TXMODEM_ASYNC_DEPTH
+ * @param cb Completion callback, NULL to poll completions with txmodem_async_poll
+ * @param user Argument passed to the callback
+ * @return int Positive on success, negative on failure
+ */
+int txmodem_async_init(txmodem_async_t *q, txmodem *dev, int depth, txmodem_async_cb_t cb, void *user);
+/**
+ * @brief Queue a packet for transmission. The buffer is read by the worker
+ * thread, and has to stay valid until the write completes. Blocks only while
+ * depth packets are queued or on air. Without a callback, completions have to
+ * be polled: the worker pauses once depth completions are waiting.
+ *
+ * @param q Pointer to txmodem_async_t struct
+ * @param buf Pointer to source buffer
+ * @param size Size of source buffer
+ * @param tag Returned with the completion
+ * @return int64_t Write ID (positive) on success, negative on failure
+ */
+int64_t txmodem_write_async(txmodem_async_t *q, const uint8_t *buf, ssize_t size, void *tag);
+/**
+ * @brief File descriptor that polls readable while completions are queued
+ *
+ * @param q Pointer to txmodem_async_t struct
+ * @return int eventfd, negative if a callback is used
+ */
+int txmodem_async_fd(txmodem_async_t *q);
+/**
+ * @brief Collect queued completions without blocking
+ *
+ * @param q Pointer to txmodem_async_t struct
+ * @param cpl Array to fill
+ * @param max Size of the array
+ * @return int Number of completions collected
+ */
+int txmodem_async_poll(txmodem_async_t *q, txmodem_async_cpl_t *cpl, int max);
+/**
+ * @brief Block until every queued packet is out
+ *
+ * @param q Pointer to txmodem_async_t struct
+ */
+void txmodem_async_drain(txmodem_async_t *q);
+/**
+ * @brief Transmit the queued packets, stop the worker thread and free memory.
+ * Completions that were not polled are dropped.
+ *
+ * @param q Pointer to txmodem_async_t struct
+ */
+void txmodem_async_destroy(txmodem_async_t *q);
+/**
+ * @brief Number of priority classes of txmodem_sched_t, class 0 is the most urgent
+ */
+#define TXMODEM_SCHED_CLASSES 4
+/**
+ * @brief Class of latency critical packets: telemetry, commands
+ */
+#define TXMODEM_PRIO_URGENT 0
+/**
+ * @brief Class of bulk data: images, files
+ */
+#define TXMODEM_PRIO_BULK (TXMODEM_SCHED_CLASSES - 1)
+/**
+ * @brief Default number of frames in the TX ring, the one on air included,
+ * once the scheduler has framed the next one. A newly queued urgent packet
+ * waits for at most this many frames to go out: with 1 it goes on air as soon
+ * as the frame on air is out, within a frame time, but the link idles while
+ * the next frame is framed. With 2 the next frame is framed while the one on
+ * air goes out, and an urgent packet may wait for both.
+ */
+#define TXMODEM_SCHED_LOOKAHEAD 1
+/**
+ * @brief Largest lookahead of txmodem_sched_t
+ */
+#define TXMODEM_SCHED_LOOKAHEAD_MAX 8
+
+/**
+ * @brief Counters of a priority class of txmodem_sched_t
+ */
+typedef struct
+{
+    int queued;           // Packets waiting for their first frame
+    int max_queued;       // Most packets ever waiting at once
+    uint64_t num_packs;   // Packets framed
+    uint64_t num_frames;  // Frames written
+    uint64_t num_bytes;   // Packet bytes framed
+    uint64_t num_preempt; // Times a packet of the class was paused for a more urgent one
+    uint64_t num_errors;  // Packets that could not be framed
+    uint64_t lat_ns;      // Sum of the times from queueing to the first frame handed to the DMA
+    uint64_t max_lat_ns;  // Longest time from queueing to the first frame handed to the DMA
+} txmodem_sched_stats_t;
+
+/**
+ * @brief Packet queued on txmodem_sched_t, lives on the stack of the writer
+ */
+typedef struct txmodem_sched_req
+{
+    const struct iovec *iov;        // Fragments of the packet
+    int iovcnt;                     // Number of fragments
+    uint64_t queued_ns;             // Time the packet was queued
+    uint64_t end;                   // TX ring position the frames of the packet end at
+    int ret;                        // Negative if the packet could not be framed
+    int framed;                     // Every frame of the packet is in the TX ring
+    struct txmodem_sched_req *next; // Next packet of the class
+} txmodem_sched_req_t;
+
+/**
+ * @brief TX scheduler that owns the txmodem DMA channel, for several writer
+ * threads with different latency needs. Packets are queued per priority
+ * class and framed one frame at a time by the scheduler thread, which always
+ * frames the next frame of the most urgent class with data: a bulk packet is
+ * preempted between two frames and resumes once the urgent packets are out.
+ * The next frame is only framed once at most lookahead - 1 frames are
+ * left in the TX ring, and each frame is handed to the DMA on its own rather
+ * than in tx_batch batches, so an urgent packet goes on air within lookahead
+ * frame times, one with TXMODEM_SCHED_LOOKAHEAD. The frames of preempted packets are
+ * interleaved on air with the urgent ones, the receiver sorts them by packet
+ * ID. While in use, the scheduler is the only writer of the txmodem.
+ */
+typedef struct
+{
+    txmodem *dev;                                      // TX modem the packets are written to
+    int lookahead;                                     // Frames in the TX ring once the next one is framed
+    txmodem_sched_req_t *head[TXMODEM_SCHED_CLASSES];  // Oldest packet of each class
+    txmodem_sched_req_t *tail[TXMODEM_SCHED_CLASSES];  // Newest packet of each class
+    txmodem_sched_stats_t stats[TXMODEM_SCHED_CLASSES]; // Counters of each class
+    int done;                                          // Stops the scheduler thread once the queues are empty
+    pthread_t thr[1];                                  // Scheduler thread
+    pthread_mutex_t m;                                 // Protects the queues and counters
+    pthread_cond_t cond;                               // Wakes up the scheduler thread
+    pthread_cond_t framed;                             // Wakes up writers
+} txmodem_sched_t;
+
+/**
+ * @brief Initialize the scheduler and start its thread
+ *
+ * @param s Pointer to txmodem_sched_t struct
+ * @param dev Initialized txmodem to send through
+ * @param lookahead Frames in the TX ring once the next one is framed, 0 for TXMODEM_SCHED_LOOKAHEAD, at most TXMODEM_SCHED_LOOKAHEAD_MAX. More keep the link busy while the next frame is framed, at the cost of a frame time of urgent packet latency each.
+ * @return int Positive on success, negative on failure
+ */
+int txmodem_sched_init(txmodem_sched_t *s, txmodem *dev, int lookahead);
+/**
+ * @brief Queue a packet in a priority class and block until it is out, as
+ * txmodem_write would. Packets of a class go out in order.
+ *
+ * @param s Pointer to txmodem_sched_t struct
+ * @param prio Priority class, 0 (TXMODEM_PRIO_URGENT) to TXMODEM_PRIO_BULK
+ * @param buf Pointer to source buffer
+ * @param size Size of source buffer
+ * @return int Positive on success, negative on failure
+ */
+int txmodem_sched_write(txmodem_sched_t *s, int prio, const uint8_t *buf, ssize_t size);
+/**
+ * @brief Queue the fragments of iov as one packet in a priority class, as
+ * txmodem_sched_write would their concatenation
+ *
+ * @param s Pointer to txmodem_sched_t struct
+ * @param prio Priority class, 0 (TXMODEM_PRIO_URGENT) to TXMODEM_PRIO_BULK
+ * @param iov Fragments of the packet
+ * @param iovcnt Number of fragments
+ * @return int Positive on success, negative on failure
+ */
+int txmodem_sched_writev(txmodem_sched_t *s, int prio, const struct iovec *iov, int iovcnt);
+/**
+ * @brief Copy the counters of a priority class
+ *
+ * @param s Pointer to txmodem_sched_t struct
+ * @param prio Priority class
+ * @param stats Filled with the counters
+ * @return int Positive on success, negative on failure
+ */
+int txmodem_sched_stats(txmodem_sched_t *s, int prio, txmodem_sched_stats_t *stats);
+/**
+ * @brief Transmit the queued packets and stop the scheduler thread
+ *
+ * @param s Pointer to txmodem_sched_t struct
+ */
+void txmodem_sched_destroy(txmodem_sched_t *s);
 /**
  * @brief Close device handles and free up memory
  * 
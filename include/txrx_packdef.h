@@ -14,6 +14,8 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include "libcrc.h"
 
 // The packets are 32-bit aligned, little endian ordered.
 
@@ -84,145 +86,188 @@ typedef struct
     uint32_t *payload;              // Payload of a frame
 } modem_frame_t;
 
-#define CRC16_POLY 0x8408
-/*
- * this is the CCITT CRC 16 polynomial X^16  + X^12  + X^5  + 1.
- * This works out to be 0x1021, but the way the algorithm works
- * lets us use 0x8408 (the reverse of the bit pattern).  The high
- * bit is always assumed to be set, thus we only use 16 bits to
- * represent the 17 bit value.
+/**
+ * @brief MODEM_FRAME_PARITY is set in frame_id of erasure code parity frames.
+ * The rest of frame_id holds the block index, data frames are numbered
+ * separately starting at 0.
  */
-static inline uint16_t crc16(unsigned char *data_p, uint16_t length)
+#define MODEM_FRAME_PARITY 0x80000000
+
+/**
+ * @brief Header at the start of the payload of a parity frame, followed by an
+ * MTU sized parity shard. Block b covers data frames b * n to b * n + n - 1,
+ * the last block may have fewer, and the last data frame is zero padded to
+ * the MTU for encoding.
+ */
+typedef struct __attribute__((packed))
 {
-    unsigned char i;
-    unsigned int data;
-    unsigned int crc = 0xffff;
+    uint32_t stream_sz; // Packet data (+ CRC32 trailer) size, stream size up to the end of this block for MODEM_FLAG_LZ
+    uint8_t n;          // Data frames per block
+    uint8_t k;          // Parity frames per block
+    uint8_t idx;        // Parity frame index in block
+    uint8_t rsvd;       // Reserved, 0
+} modem_fec_header_t;   // 8 bytes long
 
-    if (length == 0)
-        return (~crc);
+/**
+ * @brief Frame header formats, selected per packet on TX. The RX side accepts both.
+ */
+#define MODEM_HDR_V1 1 // modem_frame_header_t, every frame carries the packet fields
+#define MODEM_HDR_V2 2 // modem_frame_header_v2_t, packet fields in the descriptor at the start of frame 0
 
-    do
-    {
-        for (i = 0, data = (unsigned int)0xff & *data_p++;
-             i < 8;
-             i++, data >>= 1)
-        {
-            if ((crc & 0x0001) ^ (data & 0x0001))
-                crc = (crc >> 1) ^ CRC16_POLY;
-            else
-                crc >>= 1;
-        }
-    } while (--length);
+/**
+ * @brief PACKET_GUID_V2 is the ident of a v2 frame header. It differs from the
+ * low 16 bits of PACKET_GUID, so the first bytes of a frame tell the formats apart.
+ */
+#define PACKET_GUID_V2 0xb7e2
 
-    crc = ~crc;
-    data = crc;
-    crc = (crc << 8) | (data >> 8 & 0xff);
+/**
+ * @brief v2 frame header flags
+ */
+#define MODEM_FLAG_DESC 0x01     // Payload starts with modem_packet_desc_t (frame 0)
+#define MODEM_FLAG_LAST 0x02     // Last frame of the packet
+#define MODEM_FLAG_PACK_CRC 0x04 // Packet data is followed by a CRC32 trailer
+#define MODEM_FLAG_FEC 0x08      // Packet carries erasure code parity frames
+#define MODEM_FLAG_LZ 0x10       // Packet data is the liblz block stream of the packet, num_frames is 0 and MODEM_FLAG_LAST ends the packet
+#define MODEM_FLAG_AGG 0x20      // Packet data is a sequence of aggregated messages
 
-    return (crc);
-}
+/**
+ * @brief Each message of an aggregated packet is its little endian length
+ * followed by the message bytes.
+ */
+typedef uint16_t modem_agg_len_t;
+#define MODEM_AGG_MAX_MSG 0xffff // Largest aggregated message
 
-/*-
- *  COPYRIGHT (C) 1986 Gary S. Brown.  You may use this program, or
- *  code or tables extracted from it, as desired without restriction.
+/**
+ * @brief Compact frame header. Packet constant fields are sent once, in the
+ * packet descriptor at the start of the payload of frame 0.
  */
+typedef struct __attribute__((packed))
+{
+    uint16_t ident;     // PACKET_GUID_V2
+    uint8_t version;    // MODEM_HDR_V2
+    uint8_t flags;      // MODEM_FLAG_*
+    uint16_t pack_id;   // Packet ID, low 16 bits
+    uint16_t frame_sz;  // Frame Size (Payload only)
+    uint32_t frame_id;  // Frame ID
+    uint16_t frame_crc; // CRC of the frame
+    uint16_t hdr_crc;   // CRC of the preceding 14 bytes of the header
+} modem_frame_header_v2_t; // 16 bytes long
 
-/*
- *  First, the polynomial itself and its table of feedback terms.  The
- *  polynomial is
- *  X^32+X^26+X^23+X^22+X^16+X^12+X^11+X^10+X^8+X^7+X^5+X^4+X^2+X^1+X^0
- *
- *  Note that we take it "backwards" and put the highest-order term in
- *  the lowest-order bit.  The X^32 term is "implied"; the LSB is the
- *  X^31 term, etc.  The X^0 term (usually shown as "+1") results in
- *  the MSB being 1
- *
- *  Note that the usual hardware shift register implementation, which
- *  is what we're using (we're merely optimizing it by doing eight-bit
- *  chunks at a time) shifts bits into the lowest-order term.  In our
- *  implementation, that means shifting towards the right.  Why do we
- *  do it this way?  Because the calculated CRC must be transmitted in
- *  order from highest-order term to lowest-order term.  UARTs transmit
- *  characters in order from LSB to MSB.  By storing the CRC this way
- *  we hand it to the UART in the order low-byte to high-byte; the UART
- *  sends each low-bit to hight-bit; and the result is transmission bit
- *  by bit from highest- to lowest-order term without requiring any bit
- *  shuffling on our part.  Reception works similarly
- *
- *  The feedback terms table consists of 256, 32-bit entries.  Notes
- *
- *      The table can be generated at runtime if desired; code to do so
- *      is shown later.  It might not be obvious, but the feedback
- *      terms simply represent the results of eight shift/xor opera
- *      tions for all combinations of data and CRC register values
- *
- *      The values must be right-shifted by eight bits by the "updcrc
- *      logic; the shift must be unsigned (bring in zeroes).  On some
- *      hardware you could probably optimize the shift in assembler by
- *      using byte-swap instructions
- *      polynomial $edb88320
+/**
+ * @brief Packet descriptor, the first bytes of the packet stream (and of the
+ * payload of frame 0) of a v2 packet. The packet stream is the descriptor, the
+ * packet data and the optional CRC32 trailer, cut into MTU sized frames.
+ */
+typedef struct __attribute__((packed))
+{
+    uint32_t pack_sz;    // Packet Size (before compression)
+    uint32_t num_frames; // number of frames in packet, 0 if not known up front (MODEM_FLAG_LZ)
+    uint16_t mtu;        // Frame MTU
+    uint16_t rsvd;       // Reserved, 0
+    uint32_t rsvd2;      // Reserved, 0
+} modem_packet_desc_t;   // 16 bytes long
+
+/**
+ * @brief Frame header fields in a format independent form
+ */
+typedef struct
+{
+    int version;         // MODEM_HDR_V1 or MODEM_HDR_V2
+    int hdr_sz;          // Size of the frame header in bytes
+    int hdr_ok;          // Header integrity check passed (frame_crc == frame_crc2 for v1, hdr_crc for v2)
+    int flags;           // MODEM_FLAG_* (0 for v1)
+    uint64_t pack_id;    // Packet ID (low 16 bits for v2)
+    uint32_t frame_id;   // Frame ID
+    uint16_t frame_sz;   // Frame Size (Payload only, including the descriptor)
+    uint16_t frame_crc;  // CRC of the frame
+    int has_desc;        // pack_sz, num_frames and mtu are valid
+    uint32_t pack_sz;    // Packet Size
+    uint32_t num_frames; // number of frames in packet
+    uint16_t mtu;        // Frame MTU
+    uint16_t prefix;     // Bytes of the packet stream ahead of the data (the v2 descriptor)
+} modem_frame_info_t;
+
+/**
+ * @brief Parse a v1 or v2 frame header. For v2 frame 0 the packet descriptor
+ * is read from the payload, its contents are covered by the frame CRC and not
+ * the header CRC.
  *
+ * @param frame Pointer to the start of the frame header
+ * @param info Parsed header
+ * @return int Header version, negative if the frame is not a modem frame
+ */
+static inline int modem_parse_frame_hdr(const uint8_t *frame, modem_frame_info_t *info)
+{
+    uint32_t ident;
+    memcpy(&ident, frame, sizeof(uint32_t));
+    memset(info, 0x0, sizeof(modem_frame_info_t));
+    if (ident == PACKET_GUID)
+    {
+        modem_frame_header_t hdr[1];
+        memcpy(hdr, frame, sizeof(modem_frame_header_t));
+        info->version = MODEM_HDR_V1;
+        info->hdr_sz = sizeof(modem_frame_header_t);
+        info->hdr_ok = hdr->frame_crc == hdr->frame_crc2;
+        info->pack_id = hdr->pack_id;
+        info->frame_id = hdr->frame_id;
+        info->frame_sz = hdr->frame_sz;
+        info->frame_crc = hdr->frame_crc;
+        info->has_desc = 1;
+        info->pack_sz = hdr->pack_sz;
+        info->num_frames = hdr->num_frames;
+        info->mtu = hdr->mtu;
+        return MODEM_HDR_V1;
+    }
+    else if (((ident & 0xffff) == PACKET_GUID_V2) && (((ident >> 16) & 0xff) == MODEM_HDR_V2))
+    {
+        modem_frame_header_v2_t hdr[1];
+        memcpy(hdr, frame, sizeof(modem_frame_header_v2_t));
+        info->version = MODEM_HDR_V2;
+        info->hdr_sz = sizeof(modem_frame_header_v2_t);
+        info->hdr_ok = crc16_final(crc16_update(CRC16_INIT, hdr, sizeof(modem_frame_header_v2_t) - sizeof(uint16_t))) == hdr->hdr_crc;
+        info->flags = hdr->flags;
+        info->pack_id = hdr->pack_id;
+        info->frame_id = hdr->frame_id;
+        info->frame_sz = hdr->frame_sz;
+        info->frame_crc = hdr->frame_crc;
+        info->prefix = sizeof(modem_packet_desc_t);
+        if ((hdr->flags & MODEM_FLAG_DESC) && (hdr->frame_sz >= sizeof(modem_packet_desc_t)))
+        {
+            modem_packet_desc_t desc[1];
+            memcpy(desc, frame + sizeof(modem_frame_header_v2_t), sizeof(modem_packet_desc_t));
+            info->has_desc = 1;
+            info->pack_sz = desc->pack_sz;
+            info->num_frames = desc->num_frames;
+            info->mtu = desc->mtu;
+        }
+        return MODEM_HDR_V2;
+    }
+    return -1;
+}
+
+/**
+ * @brief CRC16 of a frame payload, as stored in the frame header. Uses the
+ * slicing-by-8 engine in libcrc.
  *
- * CRC32 code derived from work by Gary S. Brown.
- */
-
-static const uint32_t crc32_tab[] = {
-    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
-    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
-    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
-    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
-    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
-    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
-    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
-    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
-    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
-    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
-    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
-    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
-    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
-    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
-    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
-    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
-    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
-    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
-    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
-    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
-    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
-    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
-    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
-    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
-    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
-    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
-    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
-    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
-    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
-    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
-    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d};
-
-/*
- * A function that calculates the CRC-32 based on the table above is
- * given below for documentation purposes. An equivalent implementation
- * of this function that's actually used in the kernel can be found
- * in sys/libkern.h, where it can be inlined.
+ * @param data_p Pointer to data
+ * @param length Length of data in bytes
+ * @return uint16_t Checksum
+ */
+static inline uint16_t crc16(unsigned char *data_p, uint16_t length)
+{
+    return crc16_final(crc16_update(CRC16_INIT, data_p, length));
+}
+
+/**
+ * @brief CRC32 (IEEE 802.3) of a buffer. Dispatches at runtime to the fastest
+ * implementation available in libcrc.
  *
+ * @param buf Pointer to data
+ * @param size Length of data in bytes
+ * @return uint32_t Checksum
  */
 static inline uint32_t crc32(const void *buf, size_t size)
 {
-    const uint8_t *p = (const uint8_t *)buf;
-    uint32_t crc = ~0U;
-    while (size--)
-        crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
-    return crc ^ ~0U;
+    return crc32_update(0, buf, size);
 }
 #endif
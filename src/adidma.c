@@ -96,6 +96,8 @@ int adidma_init(adidma *dev, int uio_id, unsigned char ext_buffer_enb)
 #endif
 
     dev->mem_sz = size;
+    dev->xfer_submitted = 0;
+    dev->xfer_completed = 0;
 
     uint32_t mem_addr;
 
@@ -162,7 +164,8 @@ int adidma_init(adidma *dev, int uio_id, unsigned char ext_buffer_enb)
 #ifdef ADIDMA_DEBUG
     fprintf(stderr, "%s: Physical address 0x%08x, mmap address %p, virtual adderss %p\n", __func__, dev->mem_addr, dev->mapping_addr, dev->mem_virt_addr);
 #endif
-    return 1;
+    dev->state = ADIDMA_STATE_RESET;
+    return adidma_reset(dev);
 }
 
 void adidma_destroy(adidma *dev)
@@ -182,6 +185,26 @@ void adidma_destroy(adidma *dev)
     uio_destroy(dev->bus);
 }
 
+int adidma_reset(adidma *dev)
+{
+#ifdef ADIDMA_DEBUG
+    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Resetting DMA channel...\n");
+#endif
+    uio_write(dev->bus, DMAC_REG_CTRL, 0x0);
+    dev->xfer_completed = dev->xfer_submitted; // the reset drops submitted transfers
+    uio_write(dev->bus, DMAC_REG_CTRL, DMAC_CTRL_ENABLE);
+    // completion is read from XFER_DONE, only EOT wakes up adidma_wait
+    uio_write(dev->bus, DMAC_REG_IRQ_MASK, DMAC_IRQ_SOT);
+    uio_write(dev->bus, DMAC_REG_IRQ_PENDING, DMAC_IRQ_SOT | DMAC_IRQ_EOT);
+    uio_write(dev->bus, DMAC_REG_FLAGS, 0x0);
+    uio_write(dev->bus, DMAC_REG_SRC_STRIDE, 0x0);
+    uio_write(dev->bus, DMAC_REG_DEST_STRIDE, 0x0);
+    uio_write(dev->bus, DMAC_REG_Y_LEN, 0x0);
+    dev->flags = 0x0;
+    dev->state = ADIDMA_STATE_ENABLED;
+    return 1;
+}
+
 int adidma_write(adidma *dev, unsigned int offset, ssize_t size, unsigned char cyclic)
 {
     if (size < 0 || size + offset > dev->mem_sz)
@@ -192,264 +215,165 @@ int adidma_write(adidma *dev, unsigned int offset, ssize_t size, unsigned char c
         return ADIDMA_XFER_SZ_ERR;
     }
 
-    uint32_t reg_val, xfer_id;
+    if (!cyclic)
+    {
+        int64_t xfer = adidma_submit(dev, offset, size, ADIDMA_DIR_TX);
+        if (xfer < 0)
+            return xfer;
+        int ret = adidma_wait(dev, xfer);
+        return ret < 0 ? ret : size;
+    }
 
-#ifdef ADIDMA_DEBUG
-    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Resetting DMA for TX...\n");
-#endif
-    uio_write(dev->bus, DMAC_REG_CTRL, 0x0);
-#ifdef ADIDMA_DEBUG
-    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Enabling DMA for TX...\n");
-#endif
-    uio_write(dev->bus, DMAC_REG_CTRL, DMAC_CTRL_ENABLE);
-#ifdef ADIDMA_DEBUG
-    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Unmasking IRQ for TX...\n");
-#endif
-    uio_write(dev->bus, DMAC_REG_IRQ_MASK, 0x0);
-#ifdef ADIDMA_DEBUG
-    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Getting Xfer ID for TX...\n");
-#endif
+    // a cyclic transfer repeats until the cyclic flag is cleared, and takes the channel over
+    adidma_reset(dev);
+    uint32_t xfer_id;
     uio_read(dev->bus, DMAC_REG_XFER_ID, &xfer_id);
 #ifdef ADIDMA_DEBUG
-    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Setting cyclic/non cyclic flag...\n");
+    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Setting cyclic flag...\n");
 #endif
     uio_write(dev->bus, DMAC_REG_FLAGS, cyclic);
 #ifdef ADIDMA_DEBUG
     fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Setting TX address...\n");
 #endif
     uio_write(dev->bus, DMAC_REG_SRC_ADDR, dev->mem_addr + offset);
-#ifdef ADIDMA_DEBUG
-    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Setting TX stride...\n");
-#endif
-    uio_write(dev->bus, DMAC_REG_SRC_STRIDE, 0x0);
 #ifdef ADIDMA_DEBUG
     fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Setting TX length...\n");
 #endif
     uio_write(dev->bus, DMAC_REG_X_LEN, size - 1);
-    uio_write(dev->bus, DMAC_REG_Y_LEN, 0x0);
 #ifdef ADIDMA_DEBUG
     fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Starting TX transfer...\n");
 #endif
     uio_write(dev->bus, DMAC_REG_START_XFER, 0x1);
-
-    if (!cyclic)
-    {
-#ifdef ADIDMA_DEBUG
-        uint64_t start_irq, end_irq;
-        uint32_t counter = 1;
-        start_irq = get_nsec();
-#endif
-        // prepare to get interrupt from start_xfer and loop until we do
-#ifndef ADIDMA_NOIRQ
-        do
-        {
-            if (uio_unmask_irq(dev->bus) > 0)
-            {
-                uio_wait_irq(dev->bus, ADIDMA_RX_DMA_TIMEOUT);
-            }
-            uio_read(dev->bus, DMAC_REG_IRQ_PENDING, &reg_val);
-#ifdef ADIDMA_DEBUG
-            fprintf(stderr, "%s Line %d: ", __func__, __LINE__);
-            fprintf(stderr, "After %u IRQ return: 0x%01x\n", counter++, reg_val);
-#endif
-            // attempt to clear the interrupt
-            uio_write(dev->bus, DMAC_REG_IRQ_PENDING, DMAC_IRQ_SOT);
-        } while (reg_val & DMAC_IRQ_SOT != DMAC_IRQ_SOT);
-#ifdef ADIDMA_DEBUG
-        end_irq = get_nsec();
-        fprintf(stderr, "%s Line %d: ", __func__, __LINE__);
-        fprintf(stderr, "Looped: %d times, time taken to start transfer: %lf usec\n", counter, (end_irq - start_irq) * 1e-3);
-        counter = 1; // reset counter
-        start_irq = get_nsec();
-#endif
-        if (!dev->tx_check_completion)
-            goto write_eot;
-        // Get end of transfer interrupt
-        do
-        {
-            if (reg_val & DMAC_IRQ_EOT) // already finished
-                break;
-            if (uio_unmask_irq(dev->bus) > 0)
-            {
-                uio_wait_irq(dev->bus, ADIDMA_RX_DMA_TIMEOUT);
-            }
-            uio_read(dev->bus, DMAC_REG_IRQ_PENDING, &reg_val);
-#ifdef ADIDMA_DEBUG
-            fprintf(stderr, "%s Line %d: ", __func__, __LINE__);
-            fprintf(stderr, "After %u IRQ return: 0x%01x\n", counter++, reg_val);
-#endif
-            // attempt to clear the interrupt
-            uio_write(dev->bus, DMAC_REG_IRQ_PENDING, DMAC_IRQ_EOT);
-        } while (reg_val & DMAC_IRQ_EOT != DMAC_IRQ_EOT);
-#else
-        do
-        {
-            uio_read(dev->bus, DMAC_REG_IRQ_PENDING, &reg_val);
-#ifdef ADIDMA_DEBUG
-            counter++;
-#endif
-        } while ((reg_val & 0x3) != 0x3); // keep reading on busy-wait until you hit both SOT and EOT
-        uio_write(dev->bus, DMAC_REG_IRQ_PENDING, 0x3);
-#endif // ADIDMA_NOIRQ
-#ifdef ADIDMA_DEBUG
-        end_irq = get_nsec();
-        fprintf(stderr, "%s Line %d: ", __func__, __LINE__);
-        fprintf(stderr, "Looped: %d times, time taken to complete transfer: %lf usec\n", counter, (end_irq - start_irq) * 1e-3);
-        start_irq = get_nsec();
-#endif
-        do
-        {
-            uio_read(dev->bus, DMAC_REG_XFER_DONE, &reg_val);
-        } while ((reg_val & (1 << xfer_id)) != (uint32_t)(1 << xfer_id));
-#ifdef ADIDMA_DEBUG
-        end_irq = get_nsec();
-        fprintf(stderr, "%s Line %d: ", __func__, __LINE__);
-        fprintf(stderr, "Time taken to confirm transfer completion: %lf usec\n", (end_irq - start_irq) * 1e-3);
-#endif
-    }
-#ifndef ADIDMA_NOIRQ
-write_eot:
-#endif // ADIDMA_NOIRQ
+    dev->xfer_ids[dev->xfer_submitted++ % ADIDMA_MAX_XFERS] = xfer_id & 0x3; // completes once adidma_stop clears the flag
+    dev->state = ADIDMA_STATE_CYCLIC;
     return size;
 }
 
-int adidma_read(adidma *dev, unsigned int offset, ssize_t size)
+/*
+ * Retire the outstanding transfers that have completed. They complete in
+ * submission order, and at most ADIDMA_MAX_XFERS are outstanding, so each DMAC
+ * transfer ID maps to a single outstanding transfer.
+ */
+static void adidma_retire(adidma *dev)
 {
-    uint32_t reg_val, xfer_id;
+    if (dev->xfer_completed == dev->xfer_submitted)
+        return;
+    uint32_t reg_val;
+    uio_read(dev->bus, DMAC_REG_XFER_DONE, &reg_val);
+    while ((dev->xfer_completed < dev->xfer_submitted) && (reg_val & (1 << dev->xfer_ids[dev->xfer_completed % ADIDMA_MAX_XFERS])))
+        dev->xfer_completed++;
+}
 
-    if (size < 0 || offset + size > dev->mem_sz)
+int64_t adidma_submit(adidma *dev, unsigned int offset, ssize_t size, unsigned char dir)
+{
+    if (size <= 0 || size + offset > dev->mem_sz)
     {
 #ifdef ADIDMA_DEBUG
-        fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Error doing transfer, size or memory access violation error...\n");
+        fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Error doing transfer, size error...\n");
 #endif
         return ADIDMA_XFER_SZ_ERR;
     }
-#ifdef ADIDMA_DEBUG
-    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Resetting DMA for RX...\n");
-    printf("Executing UIO write\n");
-    fflush(stdout);
-#endif
-    uio_write(dev->bus, DMAC_REG_CTRL, 0x0);
-#ifdef ADIDMA_DEBUG
-    printf("Executed UIO write\n");
-    fflush(stdout);
-    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Enabling DMA for RX...\n");
-#endif
-    uio_write(dev->bus, DMAC_REG_CTRL, DMAC_CTRL_ENABLE);
-#ifdef ADIDMA_DEBUG
-    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Unmasking IRQ for RX...\n");
-#endif
-    uio_write(dev->bus, DMAC_REG_IRQ_MASK, 0x0);
-#ifdef ADIDMA_DEBUG
-    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Getting Xfer ID for RX...\n");
-#endif
-    uio_read(dev->bus, DMAC_REG_XFER_ID, &xfer_id);
-#ifdef ADIDMA_DEBUG
-    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Clearing any pending interrupts...\n");
-#endif
-    uio_read(dev->bus, DMAC_REG_IRQ_PENDING, &reg_val);
-    uio_write(dev->bus, DMAC_REG_IRQ_PENDING, reg_val);
+    if (dev->xfer_submitted - dev->xfer_completed >= ADIDMA_MAX_XFERS) // DMAC queue full, wait for the oldest
+        adidma_wait(dev, dev->xfer_completed);
 
-#ifdef ADIDMA_DEBUG
-    fprintf(stderr, "%s Line %d: %s 0x%lx\n", __func__, __LINE__, "Setting RX address...", dev->mem_addr);
-#endif
-    uio_write(dev->bus, DMAC_REG_DEST_ADDR, dev->mem_addr + offset);
-#ifdef ADIDMA_DEBUG
-    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Setting RX stride...\n");
-#endif
-    uio_write(dev->bus, DMAC_REG_DEST_STRIDE, 0x0);
-#ifdef ADIDMA_DEBUG
-    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Setting RX length...\n");
-#endif
-    uio_write(dev->bus, DMAC_REG_X_LEN, size - 1);
-    uio_write(dev->bus, DMAC_REG_Y_LEN, 0x0);
+    uint32_t reg_val, xfer_id;
 
-#ifdef ADIDMA_DEBUG
-    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Starting RX transfer...\n");
-#endif
+    if (dev->state != ADIDMA_STATE_ENABLED) // stops a cyclic transfer
+        adidma_reset(dev);
+    // strides, Y length and the IRQ mask stay as adidma_reset left them
+    uio_read(dev->bus, DMAC_REG_XFER_ID, &xfer_id);
+    if (dev->flags != 0x0)
+    {
+        uio_write(dev->bus, DMAC_REG_FLAGS, 0x0);
+        dev->flags = 0x0;
+    }
+    uio_write(dev->bus, dir == ADIDMA_DIR_TX ? DMAC_REG_SRC_ADDR : DMAC_REG_DEST_ADDR, dev->mem_addr + offset);
+    uio_write(dev->bus, DMAC_REG_X_LEN, size - 1);
     uio_write(dev->bus, DMAC_REG_START_XFER, 0x1);
-
-#ifdef ADIDMA_DEBUG
-    uint64_t start_irq, end_irq;
-    uint32_t counter = 1;
-    start_irq = get_nsec();
-#endif
-    // prepare to get interrupt from start_xfer and loop until we do
-#ifndef ADIDMA_NOIRQ
-    do
+    do // the bit clears once the DMAC has queued the transfer
     {
-        if (uio_unmask_irq(dev->bus) > 0)
-        {
-            uio_wait_irq(dev->bus, ADIDMA_RX_DMA_TIMEOUT);
-        }
-        uio_read(dev->bus, DMAC_REG_IRQ_PENDING, &reg_val);
-#ifdef ADIDMA_DEBUG
-        fprintf(stderr, "%s Line %d: ", __func__, __LINE__);
-        fprintf(stderr, "After %u IRQ return: 0x%01x\n", counter++, reg_val);
-#endif
-        // attempt to clear the interrupt
-        uio_write(dev->bus, DMAC_REG_IRQ_PENDING, DMAC_IRQ_SOT);
-    } while (!(reg_val & DMAC_IRQ_SOT));
-#ifdef ADIDMA_DEBUG
-    end_irq = get_nsec();
-    fprintf(stderr, "%s Line %d: ", __func__, __LINE__);
-    fprintf(stderr, "Looped: %d times, time taken to start transfer: %lf usec\n", counter, (end_irq - start_irq) * 1e-3);
-    counter = 1; // reset counter
-    start_irq = get_nsec();
-#endif
-    // Get end of transfer interrupt
-    do
+        uio_read(dev->bus, DMAC_REG_START_XFER, &reg_val);
+    } while (reg_val & 0x1);
+
+    dev->xfer_ids[dev->xfer_submitted % ADIDMA_MAX_XFERS] = xfer_id & 0x3;
+    return dev->xfer_submitted++;
+}
+
+int adidma_poll(adidma *dev, int64_t xfer)
+{
+    if ((xfer < 0) || ((uint64_t)xfer >= dev->xfer_submitted))
+        return ADIDMA_XFER_HANDLE_ERR;
+    if ((uint64_t)xfer < dev->xfer_completed)
+        return 1;
+    adidma_retire(dev);
+    return (uint64_t)xfer < dev->xfer_completed;
+}
+
+/*
+ * Block until a submitted transfer has completed, or for about tout_ms if
+ * tout_ms is not negative. Returns 0 on timeout.
+ */
+static int adidma_wait_tout(adidma *dev, int64_t xfer, int tout_ms)
+{
+    int ret;
+    uint64_t until = get_nsec() + tout_ms * 1000000ULL;
+    while ((ret = adidma_poll(dev, xfer)) == 0)
     {
-        if (reg_val & DMAC_IRQ_EOT) // in case transfer was already completed
+        if ((tout_ms >= 0) && (get_nsec() >= until))
             break;
-        if (uio_unmask_irq(dev->bus) > 0)
+#ifndef ADIDMA_NOIRQ
+        uint32_t reg_val;
+        uio_read(dev->bus, DMAC_REG_IRQ_PENDING, &reg_val);
+        if (!(reg_val & DMAC_IRQ_EOT) && (uio_unmask_irq(dev->bus) > 0))
         {
-            uio_wait_irq(dev->bus, ADIDMA_RX_DMA_TIMEOUT);
+            uio_wait_irq(dev->bus, tout_ms < 0 ? ADIDMA_RX_DMA_TIMEOUT : tout_ms);
         }
-        uio_read(dev->bus, DMAC_REG_IRQ_PENDING, &reg_val);
+        uio_write(dev->bus, DMAC_REG_IRQ_PENDING, DMAC_IRQ_EOT);
+#endif // ADIDMA_NOIRQ
+    }
+    return ret;
+}
+
+int adidma_wait(adidma *dev, int64_t xfer)
+{
+    return adidma_wait_tout(dev, xfer, -1);
+}
+
+int adidma_stop(adidma *dev)
+{
+    if (dev->state != ADIDMA_STATE_CYCLIC)
+        return 1;
+    // without the flag the cycle in progress is the last one, and ends with EOT
+    uio_write(dev->bus, DMAC_REG_FLAGS, 0x0);
+    dev->state = ADIDMA_STATE_ENABLED;
+    int ret = adidma_wait_tout(dev, dev->xfer_submitted - 1, ADIDMA_STOP_TIMEOUT_MS);
+    if (ret > 0)
+        return ret;
 #ifdef ADIDMA_DEBUG
-        fprintf(stderr, "%s Line %d: ", __func__, __LINE__);
-        fprintf(stderr, "After %u IRQ return: 0x%01x\n", counter++, reg_val);
+    fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Cyclic transfer did not end, resetting...\n");
 #endif
-        // attempt to clear the interrupt
-        uio_write(dev->bus, DMAC_REG_IRQ_PENDING, DMAC_IRQ_EOT);
-        // check if we are already at end of transfer
-        uio_read(dev->bus, DMAC_REG_XFER_DONE, &reg_val);
-        if ((reg_val & (1 << xfer_id)) == (uint32_t)(1 << xfer_id))
-            goto read_eot;
-    } while (reg_val & DMAC_IRQ_EOT != DMAC_IRQ_EOT);
-#else
-    do
+    return adidma_reset(dev);
+}
+
+int adidma_read(adidma *dev, unsigned int offset, ssize_t size)
+{
+    if (size < 0 || offset + size > dev->mem_sz)
     {
-        uio_read(dev->bus, DMAC_REG_IRQ_PENDING, &reg_val);
 #ifdef ADIDMA_DEBUG
-        counter++;
+        fprintf(stderr, "%s Line %d: %s", __func__, __LINE__, "Error doing transfer, size or memory access violation error...\n");
 #endif
-    } while ((reg_val & 0x3) != 0x3); // keep reading on busy-wait until you hit both SOT and EOT
-    uio_write(dev->bus, DMAC_REG_IRQ_PENDING, 0x3);
-#endif // ADIDMA_NOIRQ
+        return ADIDMA_XFER_SZ_ERR;
+    }
 #ifdef ADIDMA_DEBUG
-    end_irq = get_nsec();
-    fprintf(stderr, "%s Line %d: ", __func__, __LINE__);
-    fprintf(stderr, "Looped: %d times, time taken to complete transfer: %lf usec\n", counter, (end_irq - start_irq) * 1e-3);
-    start_irq = get_nsec();
+    uint64_t start_irq = get_nsec();
 #endif
-    do
-    {
-        uio_read(dev->bus, DMAC_REG_XFER_DONE, &reg_val);
-    } while ((reg_val & (1 << xfer_id)) != (uint32_t)(1 << xfer_id));
-#ifndef ADIDMA_NOIRQ
-read_eot:
-#endif // ADIDMA_NOIRQ
+    int64_t xfer = adidma_submit(dev, offset, size, ADIDMA_DIR_RX);
+    if (xfer < 0)
+        return xfer;
+    int ret = adidma_wait(dev, xfer);
 #ifdef ADIDMA_DEBUG
-    end_irq = get_nsec();
     fprintf(stderr, "%s Line %d: ", __func__, __LINE__);
-    fprintf(stderr, "Time taken to confirm transfer completion: %lf usec\n", (end_irq - start_irq) * 1e-3);
-    start_irq = get_nsec();
-#ifdef ADIDMA_ENABLING_UIO_DEBUG
-#undef UIO_DEBUG
-#undef ADIDMA_ENABLING_UIO_DEBUG
+    fprintf(stderr, "Time taken to complete transfer: %lf usec\n", (get_nsec() - start_irq) * 1e-3);
 #endif
-#endif
-    return 1;
+    return ret < 0 ? ret : 1;
 }
@@ -0,0 +1,161 @@
+/**
+ * @file crcbench.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Self-check and throughput comparison of the frame checksum routines.
+ * @version 0.1
+ * @date 2021-06-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "txrx_packdef.h"
+
+#define BENCH_BYTES (64 << 20) // bytes checksummed per measurement
+#define BENCH_CRC32_MAX (64 << 20)
+
+static inline uint64_t get_nsec()
+{
+    struct timespec mac_ts;
+    timespec_get(&mac_ts, TIME_UTC);
+    return (uint64_t)mac_ts.tv_sec * 1000000000L + ((uint64_t)mac_ts.tv_nsec);
+}
+
+static volatile uint32_t sink; // keeps the compiler from dropping the loops
+
+static double bench_crc16_bitwise(const uint8_t *buf, size_t len)
+{
+    size_t iters = BENCH_BYTES / len + 1;
+    uint64_t start = get_nsec();
+    for (size_t i = 0; i < iters; i++)
+        sink += crc16_bitwise(buf, len);
+    return iters * len * 1e9 / (get_nsec() - start);
+}
+
+static double bench_crc16(uint8_t *buf, size_t len)
+{
+    size_t iters = BENCH_BYTES / len + 1;
+    uint64_t start = get_nsec();
+    for (size_t i = 0; i < iters; i++)
+        sink += crc16(buf, len);
+    return iters * len * 1e9 / (get_nsec() - start);
+}
+
+/*
+ * Two pass TX framing (checksum, then copy into the DMA window) versus the
+ * fused copy and checksum kernel. dst stands in for the DMA window, on the
+ * target it is mapped uncached through /dev/mem.
+ */
+static double bench_two_pass(uint8_t *dst, uint8_t *src, size_t len)
+{
+    size_t iters = BENCH_BYTES / len + 1;
+    uint64_t start = get_nsec();
+    for (size_t i = 0; i < iters; i++)
+    {
+        sink += crc16(src, len);
+        memcpy(dst, src, len);
+    }
+    return iters * len * 1e9 / (get_nsec() - start);
+}
+
+static double bench_fused(uint8_t *dst, uint8_t *src, size_t len)
+{
+    size_t iters = BENCH_BYTES / len + 1;
+    uint64_t start = get_nsec();
+    for (size_t i = 0; i < iters; i++)
+        sink += crc16_final(crc16_copy_update(CRC16_INIT, dst, src, len));
+    return iters * len * 1e9 / (get_nsec() - start);
+}
+
+static double bench_crc32(uint32_t (*fn)(uint32_t, const void *, size_t), const uint8_t *buf, size_t len)
+{
+    size_t iters = 4 * BENCH_BYTES / len + 1;
+    uint64_t start = get_nsec();
+    for (size_t i = 0; i < iters; i++)
+        sink += fn(0, buf, len);
+    return iters * len * 1.0 / (get_nsec() - start); // bytes per ns == GB/s
+}
+
+static uint32_t crc32_bytewise_update(uint32_t crc, const void *buf, size_t size)
+{
+    return crc32_bytewise(buf, size); // crc == 0 in the benchmark
+}
+
+int main(int argc, char *argv[])
+{
+    printf("Running self check... ");
+    fflush(stdout);
+    if (crc_self_check() < 0)
+    {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n\n");
+
+    uint8_t *buf = (uint8_t *)malloc(TXRX_MTU_MAX);
+    if (buf == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < (TXRX_MTU_MAX); i++)
+        buf[i] = rand();
+
+    printf("CRC16 throughput (MB/s)\n");
+    printf("%8s %12s %12s %8s\n", "MTU", "Bitwise", "Slice-by-8", "Speedup");
+    for (size_t mtu = (TXRX_MTU_MIN);; mtu *= 2)
+    {
+        if (mtu > (TXRX_MTU_MAX))
+            mtu = (TXRX_MTU_MAX);
+        double ref = bench_crc16_bitwise(buf, mtu);
+        double val = bench_crc16(buf, mtu);
+        printf("%8zu %12.1f %12.1f %8.2f\n", mtu, ref * 1e-6, val * 1e-6, val / ref);
+        if (mtu == (TXRX_MTU_MAX))
+            break;
+    }
+
+    uint8_t *dst = (uint8_t *)malloc(TXRX_MTU_MAX);
+    if (dst == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    printf("\nTX frame copy + CRC16 throughput (MB/s)\n");
+    printf("%8s %12s %12s %8s\n", "MTU", "Two pass", "Fused", "Speedup");
+    for (size_t mtu = (TXRX_MTU_MIN);; mtu *= 2)
+    {
+        if (mtu > (TXRX_MTU_MAX))
+            mtu = (TXRX_MTU_MAX);
+        double ref = bench_two_pass(dst, buf, mtu);
+        double val = bench_fused(dst, buf, mtu);
+        printf("%8zu %12.1f %12.1f %8.2f\n", mtu, ref * 1e-6, val * 1e-6, val / ref);
+        if (mtu == (TXRX_MTU_MAX))
+            break;
+    }
+    free(dst);
+    free(buf);
+
+    buf = (uint8_t *)malloc(BENCH_CRC32_MAX);
+    if (buf == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < BENCH_CRC32_MAX; i++)
+        buf[i] = rand();
+    printf("\nCRC32 throughput (GB/s), dispatched implementation: %s\n", crc32_impl_name());
+    printf("%10s %12s %12s %12s\n", "Size", "Bytewise", "Slice-by-8", "Dispatched");
+    for (size_t len = 64; len <= BENCH_CRC32_MAX; len *= 4)
+    {
+        double ref = bench_crc32(&crc32_bytewise_update, buf, len);
+        double s8 = bench_crc32(&crc32_slice8_update, buf, len);
+        double val = bench_crc32(&crc32_update, buf, len);
+        printf("%10zu %12.3f %12.3f %12.3f\n", len, ref, s8, val);
+    }
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,302 @@
+/**
+ * @file dmabench.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Inter-frame gap, setup latency and register accesses per frame on the
+ * TX stream: blocking transfers with a channel reset per frame, blocking
+ * transfers on the persistently enabled channel, and pipelined adidma_submit.
+ * Runs on a register level model of the ADI DMAC behind the UIO interface.
+ * @version 0.1
+ * @date 2021-06-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "adidma.h"
+#include "libcrc.h"
+
+#define BENCH_FRAMES 2000     // frames per measurement
+#define BENCH_FRAME_SZ 4120   // frame size in DMA memory, 4064 byte MTU
+#define BENCH_RATE 10e6       // bytes per second the TX IP drains
+#define BENCH_REG_NS 150      // AXI-Lite register access round trip
+#define BENCH_DMA_MEM 1 << 20 // DMA buffer size
+
+static inline uint64_t get_nsec()
+{
+    struct timespec mac_ts;
+    timespec_get(&mac_ts, TIME_UTC);
+    return (uint64_t)mac_ts.tv_sec * 1000000000L + ((uint64_t)mac_ts.tv_nsec);
+}
+
+/*
+ * DMAC model: up to ADIDMA_MAX_XFERS transfers queued or active, each one
+ * streams its bytes at the drain rate once the previous one is out.
+ */
+typedef struct
+{
+    uint32_t start;          // START_XFER register
+    uint32_t len;            // X_LEN register
+    uint32_t ctrl;           // CTRL register
+    uint32_t irq;            // IRQ_PENDING register
+    uint32_t mask;           // IRQ_MASK register
+    uint32_t done;           // XFER_DONE register
+    uint32_t next_id;        // XFER_ID register
+    uint32_t ids[ADIDMA_MAX_XFERS];
+    uint64_t end[ADIDMA_MAX_XFERS];
+    int head, cnt;           // transfers queued or active
+    uint64_t link_free;      // time the stream is done with the transfers queued so far
+    int busy;                // the stream has carried a transfer of this burst
+    uint64_t gap_ns, gaps;   // idle stream time between transfers
+    uint64_t call_ns;        // time the bench started the current transfer
+    uint64_t slot_ns;        // time the queue last had a free slot again
+    uint64_t setup_ns;       // time from call (or free slot) to the transfer being queued
+    uint64_t reads, writes;  // register accesses
+} dmac_model;
+
+static dmac_model dmac[1];
+static double rate = BENCH_RATE;
+static int reg_ns = BENCH_REG_NS;
+
+static void dmac_update(uint64_t now)
+{
+    for (; (dmac->cnt > 0) && (dmac->end[dmac->head] <= now); dmac->cnt--) // retire
+    {
+        if (dmac->cnt == ADIDMA_MAX_XFERS)
+            dmac->slot_ns = dmac->end[dmac->head];
+        dmac->done |= 1 << dmac->ids[dmac->head];
+        dmac->irq |= DMAC_IRQ_EOT & ~dmac->mask;
+        dmac->head = (dmac->head + 1) % ADIDMA_MAX_XFERS;
+    }
+    if (dmac->start && (dmac->ctrl & DMAC_CTRL_ENABLE) && (dmac->cnt < ADIDMA_MAX_XFERS)) // queue
+    {
+        uint64_t start = now > dmac->link_free ? now : dmac->link_free;
+        if (dmac->busy && (start > dmac->link_free))
+        {
+            dmac->gap_ns += start - dmac->link_free;
+            dmac->gaps++;
+        }
+        dmac->busy = 1;
+        dmac->setup_ns += now - (dmac->call_ns > dmac->slot_ns ? dmac->call_ns : dmac->slot_ns);
+        dmac->link_free = start + (uint64_t)((dmac->len + 1) * 1e9 / rate);
+        int idx = (dmac->head + dmac->cnt++) % ADIDMA_MAX_XFERS;
+        dmac->ids[idx] = dmac->next_id;
+        dmac->end[idx] = dmac->link_free;
+        dmac->done &= ~(1 << dmac->next_id);
+        dmac->next_id = (dmac->next_id + 1) % ADIDMA_MAX_XFERS;
+        dmac->start = 0;
+        dmac->irq |= DMAC_IRQ_SOT & ~dmac->mask;
+    }
+}
+
+static uint64_t reg_access()
+{
+    uint64_t now = get_nsec(), until = now + reg_ns;
+    while ((now = get_nsec()) < until)
+        ;
+    dmac_update(now);
+    return now;
+}
+
+int uio_write(uio_dev *dev, int offset, uint32_t data)
+{
+    uint64_t now = reg_access();
+    dmac->writes++;
+    switch (offset)
+    {
+    case DMAC_REG_CTRL:
+        if (!(data & DMAC_CTRL_ENABLE)) // reset drops the queue
+        {
+            dmac->cnt = 0;
+            dmac->start = 0;
+            dmac->link_free = now < dmac->link_free ? now : dmac->link_free;
+        }
+        dmac->ctrl = data;
+        break;
+    case DMAC_REG_IRQ_MASK:
+        dmac->mask = data;
+        break;
+    case DMAC_REG_IRQ_PENDING:
+        dmac->irq &= ~data;
+        break;
+    case DMAC_REG_X_LEN:
+        dmac->len = data;
+        break;
+    case DMAC_REG_START_XFER:
+        dmac->start = data & 0x1;
+        dmac_update(now);
+        break;
+    default:
+        break;
+    }
+    return 1;
+}
+
+int uio_read(uio_dev *dev, int offset, uint32_t *data)
+{
+    reg_access();
+    dmac->reads++;
+    switch (offset)
+    {
+    case DMAC_REG_CTRL:
+        *data = dmac->ctrl;
+        break;
+    case DMAC_REG_IRQ_PENDING:
+        *data = dmac->irq;
+        break;
+    case DMAC_REG_XFER_ID:
+        *data = dmac->next_id;
+        break;
+    case DMAC_REG_START_XFER:
+        *data = dmac->start;
+        break;
+    case DMAC_REG_XFER_DONE:
+        *data = dmac->done;
+        break;
+    case DMAC_REG_ACTIVE_XFER_ID:
+        *data = dmac->cnt > 0 ? dmac->ids[dmac->head] : dmac->next_id;
+        break;
+    default:
+        *data = 0;
+        break;
+    }
+    return 1;
+}
+
+int uio_init(uio_dev *dev, int uio_id)
+{
+    return 1;
+}
+
+void uio_destroy(uio_dev *dev)
+{
+}
+
+int uio_unmask_irq(uio_dev *dev)
+{
+    return 1;
+}
+
+int uio_wait_irq(uio_dev *dev, int32_t tout_ms)
+{
+    return 1;
+}
+
+static void bench_reset()
+{
+    memset(dmac, 0x0, sizeof(dmac_model));
+}
+
+static void print_result(const char *name, uint64_t ns)
+{
+    printf("%-12s %8llu %10.2f %10.2f %12.2f %10.1f%% %10.1f %10.1f\n", name, (unsigned long long)dmac->gaps, dmac->gap_ns * 1e-3 / (BENCH_FRAMES - 1),
+           dmac->setup_ns * 1e-3 / BENCH_FRAMES, ns * 1e-6,
+           100.0 * BENCH_FRAMES * BENCH_FRAME_SZ / rate * 1e9 / ns, (double)dmac->reads / BENCH_FRAMES, (double)dmac->writes / BENCH_FRAMES);
+}
+
+/*
+ * Register sequence of a blocking transfer that resets the channel every time:
+ * reset, enable, unmask and clear the IRQs, program every transfer register,
+ * then wait for SOT and EOT and for XFER_DONE (ADIDMA_NOIRQ).
+ */
+static void write_reset(adidma *dev, unsigned int ofst, ssize_t size)
+{
+    uint32_t reg_val, xfer_id;
+    uio_write(dev->bus, DMAC_REG_CTRL, 0x0);
+    uio_write(dev->bus, DMAC_REG_CTRL, DMAC_CTRL_ENABLE);
+    uio_write(dev->bus, DMAC_REG_IRQ_MASK, 0x0);
+    uio_read(dev->bus, DMAC_REG_XFER_ID, &xfer_id);
+    uio_write(dev->bus, DMAC_REG_FLAGS, 0x0);
+    uio_write(dev->bus, DMAC_REG_SRC_ADDR, dev->mem_addr + ofst);
+    uio_write(dev->bus, DMAC_REG_SRC_STRIDE, 0x0);
+    uio_write(dev->bus, DMAC_REG_X_LEN, size - 1);
+    uio_write(dev->bus, DMAC_REG_Y_LEN, 0x0);
+    uio_write(dev->bus, DMAC_REG_START_XFER, 0x1);
+    do
+    {
+        uio_read(dev->bus, DMAC_REG_IRQ_PENDING, &reg_val);
+    } while ((reg_val & 0x3) != 0x3);
+    uio_write(dev->bus, DMAC_REG_IRQ_PENDING, 0x3);
+    do
+    {
+        uio_read(dev->bus, DMAC_REG_XFER_DONE, &reg_val);
+    } while (!(reg_val & (1 << xfer_id)));
+}
+
+/* Frames are filled with a CRC pass over the payload, as txmodem does */
+static uint16_t frame(adidma *dev, unsigned int ofst, const uint8_t *src)
+{
+    return crc16_copy_update(CRC16_INIT, dev->mem_virt_addr + ofst, src, BENCH_FRAME_SZ);
+}
+
+int main(int argc, char *argv[])
+{
+    rate = argc > 1 ? atof(argv[1]) * 1e6 : BENCH_RATE;
+    reg_ns = argc > 2 ? atoi(argv[2]) : BENCH_REG_NS;
+    if ((rate <= 0) || (reg_ns < 0))
+    {
+        printf("Invocation: %s [Drain rate, MB/s] [Register access, ns]\n", argv[0]);
+        return 0;
+    }
+    adidma dev[1];
+    memset(dev, 0x0, sizeof(adidma));
+    dev->mem_sz = BENCH_DMA_MEM;
+    dev->mem_virt_addr = (uint8_t *)malloc(BENCH_DMA_MEM);
+    uint8_t *src = (uint8_t *)malloc(BENCH_FRAME_SZ);
+    for (int i = 0; i < BENCH_FRAME_SZ; i++)
+        src[i] = rand();
+    unsigned int slots = BENCH_DMA_MEM / BENCH_FRAME_SZ;
+    printf("%d frames of %d bytes, %.1f MB/s drain rate (%.1f us per frame), %d ns per register access\n",
+           BENCH_FRAMES, BENCH_FRAME_SZ, rate * 1e-6, BENCH_FRAME_SZ * 1e6 / rate, reg_ns);
+    printf("%-12s %8s %10s %10s %12s %11s %10s %10s\n", "Mode", "Gaps", "Gap (us)", "Setup (us)", "Total (ms)", "Link use", "Reads", "Writes");
+
+    // one blocking transfer per frame, resetting the channel every time
+    bench_reset();
+    uint64_t start = get_nsec();
+    for (int i = 0; i < BENCH_FRAMES; i++)
+    {
+        frame(dev, 0, src);
+        dmac->call_ns = get_nsec();
+        write_reset(dev, 0, BENCH_FRAME_SZ);
+    }
+    print_result("reset", get_nsec() - start);
+
+    // one blocking transfer per frame on the enabled channel
+    bench_reset();
+    dev->state = ADIDMA_STATE_RESET;
+    start = get_nsec();
+    for (int i = 0; i < BENCH_FRAMES; i++)
+    {
+        frame(dev, 0, src);
+        dmac->call_ns = get_nsec();
+        adidma_write(dev, 0, BENCH_FRAME_SZ, 0);
+    }
+    print_result("blocking", get_nsec() - start);
+
+    // frame N + 1 is framed and queued while frame N streams
+    bench_reset();
+    dev->state = ADIDMA_STATE_RESET;
+    start = get_nsec();
+    int64_t xfer = -1;
+    for (int i = 0; i < BENCH_FRAMES; i++)
+    {
+        unsigned int ofst = (i % slots) * BENCH_FRAME_SZ;
+        frame(dev, ofst, src);
+        dmac->call_ns = get_nsec();
+        if ((xfer = adidma_submit(dev, ofst, BENCH_FRAME_SZ, ADIDMA_DIR_TX)) < 0)
+        {
+            printf("Submit %d failed: %d\n", i, (int)xfer);
+            break;
+        }
+    }
+    if (xfer >= 0)
+        adidma_wait(dev, xfer);
+    print_result("pipelined", get_nsec() - start);
+
+    free(src);
+    free(dev->mem_virt_addr);
+    return 0;
+}
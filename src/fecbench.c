@@ -0,0 +1,121 @@
+/**
+ * @file fecbench.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Self-check and encode / decode throughput of the frame erasure code.
+ * @version 0.1
+ * @date 2021-06-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "libfec.h"
+#include "txrx_packdef.h"
+
+#define BENCH_BYTES (64 << 20) // data bytes encoded / decoded per measurement
+#define BENCH_SHARD 4064       // default MTU
+
+static inline uint64_t get_nsec()
+{
+    struct timespec mac_ts;
+    timespec_get(&mac_ts, TIME_UTC);
+    return (uint64_t)mac_ts.tv_sec * 1000000000L + ((uint64_t)mac_ts.tv_nsec);
+}
+
+static double bench_region(void (*fn)(uint8_t *, const uint8_t *, uint8_t, size_t), uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t iters = BENCH_BYTES / len + 1;
+    uint64_t start = get_nsec();
+    for (size_t i = 0; i < iters; i++)
+        fn(dst, src, 0x53 + (i & 0x7f), len);
+    return iters * len * 1e3 / (get_nsec() - start); // MB/s
+}
+
+/*
+ * Throughput is reported in data bytes per second: bytes of the n data
+ * shards processed per block.
+ */
+static double bench_encode(int n, int k, uint8_t **data, uint8_t **parity, size_t len)
+{
+    size_t iters = BENCH_BYTES / (n * len) + 1;
+    uint64_t start = get_nsec();
+    for (size_t i = 0; i < iters; i++)
+        fec_encode(n, k, (const uint8_t *const *)data, parity, len);
+    return iters * n * len * 1e3 / (get_nsec() - start);
+}
+
+static double bench_decode(int n, int k, int lost, uint8_t **data, uint8_t **parity, size_t len)
+{
+    int ok[FEC_MAX_SHARDS], pidx[FEC_MAX_SHARDS];
+    const uint8_t *pptr[FEC_MAX_SHARDS];
+    for (int j = 0; j < n; j++)
+        ok[j] = j >= lost; // worst case: the first data frames of the block are lost
+    for (int r = 0; r < k; r++)
+    {
+        pidx[r] = r;
+        pptr[r] = parity[r];
+    }
+    size_t iters = BENCH_BYTES / (n * len) + 1;
+    uint64_t start = get_nsec();
+    for (size_t i = 0; i < iters; i++)
+        fec_decode(n, data, ok, pptr, pidx, k, len);
+    return iters * n * len * 1e3 / (get_nsec() - start);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t len = BENCH_SHARD;
+    if (argc > 1)
+        len = strtoul(argv[1], NULL, 0);
+    if ((len < (TXRX_MTU_MIN)) || (len > (TXRX_MTU_MAX)))
+        len = BENCH_SHARD;
+    printf("Running self check... ");
+    fflush(stdout);
+    if (fec_self_check() < 0)
+    {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n\n");
+
+    const int max_n = 64, max_k = 16;
+    uint8_t *mem = (uint8_t *)malloc((max_n + max_k) * len);
+    if (mem == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < (max_n + max_k) * len; i++)
+        mem[i] = rand();
+    uint8_t *data[64], *parity[16];
+    for (int j = 0; j < max_n; j++)
+        data[j] = mem + j * len;
+    for (int r = 0; r < max_k; r++)
+        parity[r] = mem + (max_n + r) * len;
+
+    printf("GF(2^8) region multiply-add throughput (MB/s), dispatched implementation: %s\n", fec_impl_name());
+    printf("%8s %12s %12s %8s\n", "Size", "Reference", "Dispatched", "Speedup");
+    {
+        double ref = bench_region(&gf_mul_add_region_ref, parity[0], data[0], len);
+        double val = bench_region(&gf_mul_add_region, parity[0], data[0], len);
+        printf("%8zu %12.1f %12.1f %8.2f\n\n", len, ref, val, val / ref);
+    }
+
+    static const int shapes[][2] = {{4, 1}, {8, 1}, {8, 2}, {16, 1}, {16, 2}, {16, 4}, {32, 2}, {32, 4}, {32, 8}, {64, 4}, {64, 8}, {64, 16}};
+    printf("Erasure code throughput (MB/s of data), shard size %zu bytes\n", len);
+    printf("%4s %4s %8s %12s %12s %12s\n", "N", "K", "Overhead", "Encode", "Decode (1)", "Decode (K)");
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++)
+    {
+        int n = shapes[s][0], k = shapes[s][1];
+        double enc = bench_encode(n, k, data, parity, len);
+        double dec1 = bench_decode(n, k, 1, data, parity, len);
+        double deck = bench_decode(n, k, k, data, parity, len);
+        printf("%4d %4d %7.1f%% %12.1f %12.1f %12.1f\n", n, k, 100.0 * k / n, enc, dec1, deck);
+    }
+    free(mem);
+    return 0;
+}
@@ -61,6 +61,45 @@ ssize_t rx_buf_sz = 1;
 pthread_mutex_t rx_buf_access[1];
 
 rxmodem rxdev[1];
+void rx_handler(const rxmodem_event_t *ev, void *user)
+{
+    if (ev->pack_sz <= 0)
+    {
+        pthread_mutex_lock(rx_buf_access);
+        memset(rx_buf, 0x0, RX_BUF_SIZE);
+        snprintf(rx_buf, RX_BUF_SIZE, "Receive size invalid: %d", (int)ev->pack_sz);
+        pthread_mutex_unlock(rx_buf_access);
+        return;
+    }
+    const char *buf = (const char *)ev->data;
+    ssize_t rd_sz = ev->size, rcv_sz = ev->pack_sz;
+    ssize_t len = rd_sz < 0 ? 0 : (rd_sz < RX_BUF_SIZE - 1 ? rd_sz : RX_BUF_SIZE - 1); // the packet is not NUL terminated, and rx_buf keeps one
+    pthread_mutex_lock(rx_buf_access);
+    memset(rx_buf, 0x0, RX_BUF_SIZE);
+    if ((ev->flags & MODEM_FLAG_AGG) && (rd_sz == rcv_sz)) // one message per line
+    {
+        ssize_t ofst = 0, len = 0;
+        const uint8_t *msg;
+        rx_buf_sz = 0;
+        while ((rxmodem_agg_next((const uint8_t *)buf, rd_sz, &ofst, &msg, &len) > 0) && (rx_buf_sz < RX_BUF_SIZE))
+            rx_buf_sz += snprintf(rx_buf + rx_buf_sz, RX_BUF_SIZE - rx_buf_sz, "%.*s\n", (int)len, (const char *)msg);
+        rx_buf_sz = rx_buf_sz < RX_BUF_SIZE ? rx_buf_sz : RX_BUF_SIZE - 1;
+    }
+    else
+    {
+        snprintf(rx_buf, RX_BUF_SIZE, "%.*s", (int)len, buf);
+        rx_buf_sz = len;
+    }
+    if ((rd_sz != rcv_sz) && (len < RX_BUF_SIZE - 1))
+    {
+        rx_buf[len] = '\n';
+        rx_buf_sz = len + 1;
+        rx_buf_sz += snprintf(rx_buf + len + 1, RX_BUF_SIZE - len - 1, "Invalid read: %d out of %d", (int)rd_sz, (int)rcv_sz);
+        rx_buf_sz++;
+    }
+    pthread_mutex_unlock(rx_buf_access);
+}
+
 void *rx_thread_fcn(void *tid)
 {
     static int retval;
@@ -72,46 +111,22 @@ void *rx_thread_fcn(void *tid)
         retval = -1;
         goto err;
     }
-    while (!done)
+    // packets are delivered to rx_handler by the RX modem as they complete
+    if (rxmodem_set_handler(rxdev, &rx_handler, NULL, 0) < 0)
     {
-        if (show_chat_win)
-        {
-            ssize_t rcv_sz = rxmodem_receive(rxdev);
-            if (rcv_sz <= 0)
-            {
-                pthread_mutex_lock(rx_buf_access);
-                memset(rx_buf, 0x0, RX_BUF_SIZE);
-                snprintf(rx_buf, RX_BUF_SIZE, "Receive size invalid: %d", rcv_sz);
-                pthread_mutex_unlock(rx_buf_access);
-                continue;
-            }
-            char *buf = (char *)malloc(rcv_sz);
-            memset(buf, 0x0, rcv_sz);
-            ssize_t rd_sz = rxmodem_read(rxdev, (uint8_t *) buf, rcv_sz);
-            pthread_mutex_lock(rx_buf_access);
-            memset(rx_buf, 0x0, RX_BUF_SIZE);
-            snprintf(rx_buf, rd_sz, "%s", buf);
-            rx_buf_sz = rd_sz;
-            if (rd_sz != rcv_sz)
-            {
-                rx_buf[rd_sz] = '\n';
-                rx_buf_sz++;
-                rx_buf_sz += snprintf(rx_buf + rd_sz + 1, RX_BUF_SIZE - rd_sz - 1, "Invalid read: %d out of %d", rd_sz, rcv_sz);
-                rx_buf_sz++;
-            }
-            pthread_mutex_unlock(rx_buf_access);
-            free(buf);
-        }
-        else
-        {
-            usleep(16000); // 60 Hz
-        }
+        pthread_mutex_lock(rx_buf_access);
+        memset(rx_buf, 0x0, RX_BUF_SIZE);
+        rx_buf_sz = snprintf(rx_buf, RX_BUF_SIZE, "%s: Could not start the RX Modem", __func__);
+        rx_buf_sz++;
+        pthread_mutex_unlock(rx_buf_access);
+        retval = -1;
     }
 err:
     return &retval;
 }
 
 static txmodem txdev[1];
+static txmodem_agg_t txagg[1]; // chat messages typed in quick succession share a packet
 #define TX_BUF_SIZE 4096
 static char tx_buf[TX_BUF_SIZE];
 static char tmptxbuf[4000];
@@ -172,9 +187,12 @@ void ChatWin(bool *active)
     {
         time(&rawtime);
         timeinfo = localtime(&rawtime);
-        ssize_t sz = snprintf(tx_buf, TX_BUF_SIZE, "%s (%04d-%02d-%02d %02d:%02d:%02d) > %s", hostname, timeinfo->tm_year + 1900, timeinfo->tm_mon + 1, timeinfo->tm_mday, timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec, tmptxbuf);
-        sz++;
-        txmodem_write(txdev, (uint8_t *)tx_buf, sz);
+        struct iovec iov[2]; // header, then the message straight from the input box
+        iov[0].iov_base = tx_buf;
+        iov[0].iov_len = snprintf(tx_buf, TX_BUF_SIZE, "%s (%04d-%02d-%02d %02d:%02d:%02d) > ", hostname, timeinfo->tm_year + 1900, timeinfo->tm_mon + 1, timeinfo->tm_mday, timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec);
+        iov[1].iov_base = tmptxbuf;
+        iov[1].iov_len = strlen(tmptxbuf) + 1; // with the terminating NUL
+        txmodem_agg_writev(txagg, iov, 2);
         if (strlen(tmptxbuf) < 2)
         {
             snprintf(tmptxbuf, 4000, "Testing...");
@@ -389,11 +407,19 @@ int main(int, char **)
         adradio_destroy(phy);
         return 2;
     }
+    if (txmodem_agg_init(txagg, txdev, 0, 0) < 0)
+    {
+        eprintf("Could not initialize TX message aggregation\n");
+        txmodem_destroy(txdev);
+        adradio_destroy(phy);
+        return 2;
+    }
     // Set up RX modem
     pthread_t rxthread;
     if (pthread_create(&rxthread, NULL, &rx_thread_fcn, NULL) != 0)
     {
         eprintf("Could not initialize RX thread\n");
+        txmodem_agg_destroy(txagg);
         txmodem_destroy(txdev);
         adradio_destroy(phy);
         return 3;
@@ -507,7 +533,8 @@ int main(int, char **)
 #ifdef ENABLE_MODEM
     show_chat_win = false;
     done = 1;
-    pthread_cancel(rxthread);
+    pthread_join(rxthread, NULL);
+    txmodem_agg_destroy(txagg);
     txmodem_destroy(txdev);
     rxmodem_destroy(rxdev);
 #endif
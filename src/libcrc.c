@@ -0,0 +1,611 @@
+/**
+ * @file libcrc.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Table driven checksum routines used by the modem framing code.
+ * @version 0.1
+ * @date 2021-06-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <libcrc.h>
+
+/*
+ * crc16_tab[0] holds the feedback terms for one byte, crc16_tab[k] holds the
+ * feedback terms for one byte followed by k zero bytes. This lets us consume
+ * 8 bytes per iteration with 8 independent table lookups.
+ */
+static uint16_t crc16_tab[8][256];
+
+__attribute__((constructor)) static void crc_tab_init(void)
+{
+    for (int n = 0; n < 256; n++)
+    {
+        uint16_t crc = n;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 0x0001) ? (crc >> 1) ^ CRC16_POLY : crc >> 1;
+        crc16_tab[0][n] = crc;
+    }
+    for (int n = 0; n < 256; n++)
+        for (int k = 1; k < 8; k++)
+            crc16_tab[k][n] = (crc16_tab[k - 1][n] >> 8) ^ crc16_tab[0][crc16_tab[k - 1][n] & 0xff];
+}
+
+uint16_t crc16_update(uint16_t crc, const void *buf, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    while (size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(uint64_t)); // frames are little endian
+        word ^= crc;
+        crc = crc16_tab[7][word & 0xff] ^
+              crc16_tab[6][(word >> 8) & 0xff] ^
+              crc16_tab[5][(word >> 16) & 0xff] ^
+              crc16_tab[4][(word >> 24) & 0xff] ^
+              crc16_tab[3][(word >> 32) & 0xff] ^
+              crc16_tab[2][(word >> 40) & 0xff] ^
+              crc16_tab[1][(word >> 48) & 0xff] ^
+              crc16_tab[0][word >> 56];
+        p += sizeof(uint64_t);
+        size -= sizeof(uint64_t);
+    }
+    while (size--)
+        crc = (crc >> 8) ^ crc16_tab[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+uint16_t crc16_copy_update(uint16_t crc, void *dst, const void *src, size_t size)
+{
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *p = (const uint8_t *)src;
+    while (size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(uint64_t));
+        memcpy(d, &word, sizeof(uint64_t)); // one 64-bit store into the DMA window
+        word ^= crc;
+        crc = crc16_tab[7][word & 0xff] ^
+              crc16_tab[6][(word >> 8) & 0xff] ^
+              crc16_tab[5][(word >> 16) & 0xff] ^
+              crc16_tab[4][(word >> 24) & 0xff] ^
+              crc16_tab[3][(word >> 32) & 0xff] ^
+              crc16_tab[2][(word >> 40) & 0xff] ^
+              crc16_tab[1][(word >> 48) & 0xff] ^
+              crc16_tab[0][word >> 56];
+        p += sizeof(uint64_t);
+        d += sizeof(uint64_t);
+        size -= sizeof(uint64_t);
+    }
+    while (size--)
+    {
+        *d++ = *p;
+        crc = (crc >> 8) ^ crc16_tab[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+uint16_t crc16_bitwise(const void *buf, size_t size)
+{
+    const unsigned char *data_p = (const unsigned char *)buf;
+    unsigned char i;
+    unsigned int data;
+    unsigned int crc = 0xffff;
+
+    if (size == 0)
+        return (~crc);
+
+    do
+    {
+        for (i = 0, data = (unsigned int)0xff & *data_p++;
+             i < 8;
+             i++, data >>= 1)
+        {
+            if ((crc & 0x0001) ^ (data & 0x0001))
+                crc = (crc >> 1) ^ CRC16_POLY;
+            else
+                crc >>= 1;
+        }
+    } while (--size);
+
+    crc = ~crc;
+    data = crc;
+    crc = (crc << 8) | (data >> 8 & 0xff);
+
+    return (crc);
+}
+
+/*-
+ *  COPYRIGHT (C) 1986 Gary S. Brown.  You may use this program, or
+ *  code or tables extracted from it, as desired without restriction.
+ */
+
+/*
+ *  First, the polynomial itself and its table of feedback terms.  The
+ *  polynomial is
+ *  X^32+X^26+X^23+X^22+X^16+X^12+X^11+X^10+X^8+X^7+X^5+X^4+X^2+X^1+X^0
+ *
+ *  Note that we take it "backwards" and put the highest-order term in
+ *  the lowest-order bit.  The X^32 term is "implied"; the LSB is the
+ *  X^31 term, etc.  The X^0 term (usually shown as "+1") results in
+ *  the MSB being 1
+ *
+ *  Note that the usual hardware shift register implementation, which
+ *  is what we're using (we're merely optimizing it by doing eight-bit
+ *  chunks at a time) shifts bits into the lowest-order term.  In our
+ *  implementation, that means shifting towards the right.  Why do we
+ *  do it this way?  Because the calculated CRC must be transmitted in
+ *  order from highest-order term to lowest-order term.  UARTs transmit
+ *  characters in order from LSB to MSB.  By storing the CRC this way
+ *  we hand it to the UART in the order low-byte to high-byte; the UART
+ *  sends each low-bit to hight-bit; and the result is transmission bit
+ *  by bit from highest- to lowest-order term without requiring any bit
+ *  shuffling on our part.  Reception works similarly
+ *
+ *  The feedback terms table consists of 256, 32-bit entries.  Notes
+ *
+ *      The table can be generated at runtime if desired; code to do so
+ *      is shown later.  It might not be obvious, but the feedback
+ *      terms simply represent the results of eight shift/xor opera
+ *      tions for all combinations of data and CRC register values
+ *
+ *      The values must be right-shifted by eight bits by the "updcrc
+ *      logic; the shift must be unsigned (bring in zeroes).  On some
+ *      hardware you could probably optimize the shift in assembler by
+ *      using byte-swap instructions
+ *      polynomial $edb88320
+ *
+ *
+ * CRC32 code derived from work by Gary S. Brown.
+ */
+
+static const uint32_t crc32_tab[] = {
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d};
+
+/*
+ * A function that calculates the CRC-32 based on the table above is
+ * given below. It is kept as the reference implementation, the
+ * dispatched routines below must return exactly what it returns.
+ *
+ */
+uint32_t crc32_bytewise(const void *buf, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    uint32_t crc = ~0U;
+    while (size--)
+        crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc ^ ~0U;
+}
+
+/*
+ * crc32_tab8[k] holds the feedback terms for one byte followed by k zero
+ * bytes, same construction as crc16_tab.
+ */
+static uint32_t crc32_tab8[8][256];
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *p, size_t size)
+{
+    while (size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(uint64_t));
+        word ^= crc;
+        crc = crc32_tab8[7][word & 0xff] ^
+              crc32_tab8[6][(word >> 8) & 0xff] ^
+              crc32_tab8[5][(word >> 16) & 0xff] ^
+              crc32_tab8[4][(word >> 24) & 0xff] ^
+              crc32_tab8[3][(word >> 32) & 0xff] ^
+              crc32_tab8[2][(word >> 40) & 0xff] ^
+              crc32_tab8[1][(word >> 48) & 0xff] ^
+              crc32_tab8[0][word >> 56];
+        p += sizeof(uint64_t);
+        size -= sizeof(uint64_t);
+    }
+    while (size--)
+        crc = crc32_tab8[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+/*
+ * Carry-less multiplication folding, after "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction" (Intel, 2009). The constants are
+ * x^(4*128+32) mod P, x^(4*128-32) mod P (fold by 4), x^(128+32) mod P,
+ * x^(128-32) mod P (fold by 1), x^64 mod P and the Barrett constants for the
+ * bit-reflected IEEE polynomial.
+ *
+ * The fold routines take and return the raw (non-inverted) register, and
+ * consume a multiple of 16 bytes, at least 64.
+ */
+#define CRC32_FOLD_MIN 64
+static const uint64_t crc32_k1k2[2] __attribute__((aligned(16))) = {0x0154442bd4, 0x01c6e41596};
+static const uint64_t crc32_k3k4[2] __attribute__((aligned(16))) = {0x01751997d0, 0x00ccaa009e};
+static const uint64_t crc32_k5k0[2] __attribute__((aligned(16))) = {0x0163cd6124, 0x0000000000};
+static const uint64_t crc32_poly[2] __attribute__((aligned(16))) = {0x01db710641, 0x01f7011641};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse4.1,pclmul"))) static uint32_t crc32_fold_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)crc32_k1k2);
+    buf += 64;
+    len -= 64;
+    // fold 4 x 128 bits in parallel
+    while (len >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+    // fold the 4 lanes into one
+    x0 = _mm_load_si128((const __m128i *)crc32_k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+    // fold remaining 128 bit blocks
+    while (len >= 16)
+    {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+    // 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)crc32_k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i *)crc32_poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *p, size_t size)
+{
+    if (size >= CRC32_FOLD_MIN)
+    {
+        size_t chunk = size & ~(size_t)15;
+        crc = crc32_fold_pclmul(crc, p, chunk);
+        p += chunk;
+        size -= chunk;
+    }
+    return crc32_slice8(crc, p, size);
+}
+#endif // x86
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+__attribute__((target("+crc"))) static uint32_t crc32_armv8(uint32_t crc, const uint8_t *p, size_t size)
+{
+    while (size && ((uintptr_t)p & 7))
+    {
+        crc = __crc32b(crc, *p++);
+        size--;
+    }
+    while (size >= 32)
+    {
+        uint64_t w0, w1, w2, w3;
+        memcpy(&w0, p, 8);
+        memcpy(&w1, p + 8, 8);
+        memcpy(&w2, p + 16, 8);
+        memcpy(&w3, p + 24, 8);
+        crc = __crc32d(crc, w0);
+        crc = __crc32d(crc, w1);
+        crc = __crc32d(crc, w2);
+        crc = __crc32d(crc, w3);
+        p += 32;
+        size -= 32;
+    }
+    while (size >= 8)
+    {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        crc = __crc32d(crc, w);
+        p += 8;
+        size -= 8;
+    }
+    while (size--)
+        crc = __crc32b(crc, *p++);
+    return crc;
+}
+
+/*
+ * PMULL versions of the PCLMULQDQ selectors: lo_lo == 0x00, hi_hi == 0x11,
+ * lo_hi == 0x10 (low half of a, high half of b).
+ */
+#define CRC32_PMULL_TARGET __attribute__((target("+crc+crypto")))
+
+CRC32_PMULL_TARGET static inline uint64x2_t clmul_lo_lo(uint64x2_t a, uint64x2_t b)
+{
+    return vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(a, 0), (poly64_t)vgetq_lane_u64(b, 0)));
+}
+
+CRC32_PMULL_TARGET static inline uint64x2_t clmul_hi_hi(uint64x2_t a, uint64x2_t b)
+{
+    return vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(a, 1), (poly64_t)vgetq_lane_u64(b, 1)));
+}
+
+CRC32_PMULL_TARGET static inline uint64x2_t clmul_lo_hi(uint64x2_t a, uint64x2_t b)
+{
+    return vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(a, 0), (poly64_t)vgetq_lane_u64(b, 1)));
+}
+
+CRC32_PMULL_TARGET static inline uint64x2_t fold128(uint64x2_t x, uint64x2_t k, uint64x2_t y)
+{
+    return veorq_u64(veorq_u64(clmul_hi_hi(x, k), clmul_lo_lo(x, k)), y);
+}
+
+CRC32_PMULL_TARGET static uint32_t crc32_fold_pmull(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint64x2_t x0, x1, x2, x3, x4;
+    const uint64x2_t zero = vdupq_n_u64(0);
+    const uint64x2_t mask32 = vdupq_n_u64(0xffffffff);
+
+    x1 = vld1q_u64((const uint64_t *)(buf + 0x00));
+    x2 = vld1q_u64((const uint64_t *)(buf + 0x10));
+    x3 = vld1q_u64((const uint64_t *)(buf + 0x20));
+    x4 = vld1q_u64((const uint64_t *)(buf + 0x30));
+    x1 = veorq_u64(x1, vcombine_u64(vcreate_u64(crc), vcreate_u64(0)));
+    x0 = vld1q_u64(crc32_k1k2);
+    buf += 64;
+    len -= 64;
+    // fold 4 x 128 bits in parallel
+    while (len >= 64)
+    {
+        x1 = fold128(x1, x0, vld1q_u64((const uint64_t *)(buf + 0x00)));
+        x2 = fold128(x2, x0, vld1q_u64((const uint64_t *)(buf + 0x10)));
+        x3 = fold128(x3, x0, vld1q_u64((const uint64_t *)(buf + 0x20)));
+        x4 = fold128(x4, x0, vld1q_u64((const uint64_t *)(buf + 0x30)));
+        buf += 64;
+        len -= 64;
+    }
+    // fold the 4 lanes into one
+    x0 = vld1q_u64(crc32_k3k4);
+    x1 = fold128(x1, x0, x2);
+    x1 = fold128(x1, x0, x3);
+    x1 = fold128(x1, x0, x4);
+    // fold remaining 128 bit blocks
+    while (len >= 16)
+    {
+        x1 = fold128(x1, x0, vld1q_u64((const uint64_t *)buf));
+        buf += 16;
+        len -= 16;
+    }
+    // 128 -> 64 bits
+    x2 = clmul_lo_hi(x1, x0);
+    x1 = vreinterpretq_u64_u8(vextq_u8(vreinterpretq_u8_u64(x1), vreinterpretq_u8_u64(zero), 8));
+    x1 = veorq_u64(x1, x2);
+    x0 = vld1q_u64(crc32_k5k0);
+    x2 = vreinterpretq_u64_u8(vextq_u8(vreinterpretq_u8_u64(x1), vreinterpretq_u8_u64(zero), 4));
+    x1 = vandq_u64(x1, mask32);
+    x1 = clmul_lo_lo(x1, x0);
+    x1 = veorq_u64(x1, x2);
+    // Barrett reduction to 32 bits
+    x0 = vld1q_u64(crc32_poly);
+    x2 = vandq_u64(x1, mask32);
+    x2 = clmul_lo_hi(x2, x0);
+    x2 = vandq_u64(x2, mask32);
+    x2 = clmul_lo_lo(x2, x0);
+    x1 = veorq_u64(x1, x2);
+    return vgetq_lane_u32(vreinterpretq_u32_u64(x1), 1);
+}
+
+static uint32_t crc32_pmull(uint32_t crc, const uint8_t *p, size_t size)
+{
+    if (size >= CRC32_FOLD_MIN)
+    {
+        size_t chunk = size & ~(size_t)15;
+        crc = crc32_fold_pmull(crc, p, chunk);
+        p += chunk;
+        size -= chunk;
+    }
+    return crc32_armv8(crc, p, size);
+}
+#endif // aarch64
+
+typedef uint32_t (*crc32_impl_t)(uint32_t crc, const uint8_t *p, size_t size);
+static crc32_impl_t crc32_impl = &crc32_slice8;
+static const char *crc32_impl_str = "slice-by-8";
+
+__attribute__((constructor)) static void crc32_dispatch_init(void)
+{
+    for (int n = 0; n < 256; n++)
+        crc32_tab8[0][n] = crc32_tab[n];
+    for (int n = 0; n < 256; n++)
+        for (int k = 1; k < 8; k++)
+            crc32_tab8[k][n] = (crc32_tab8[k - 1][n] >> 8) ^ crc32_tab8[0][crc32_tab8[k - 1][n] & 0xff];
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+    {
+        crc32_impl = &crc32_pclmul;
+        crc32_impl_str = "pclmulqdq";
+    }
+#elif defined(__aarch64__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    if ((hwcap & HWCAP_CRC32) && (hwcap & HWCAP_PMULL))
+    {
+        crc32_impl = &crc32_pmull;
+        crc32_impl_str = "pmull";
+    }
+    else if (hwcap & HWCAP_CRC32)
+    {
+        crc32_impl = &crc32_armv8;
+        crc32_impl_str = "armv8-crc32";
+    }
+#endif
+}
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t size)
+{
+    return ~crc32_impl(~crc, (const uint8_t *)buf, size);
+}
+
+uint32_t crc32_slice8_update(uint32_t crc, const void *buf, size_t size)
+{
+    return ~crc32_slice8(~crc, (const uint8_t *)buf, size);
+}
+
+const char *crc32_impl_name(void)
+{
+    return crc32_impl_str;
+}
+
+#define CRC_SELF_CHECK_SZ 8192
+
+int crc_self_check(void)
+{
+    static const char check_str[] = "123456789";
+    // CRC-16/X-25 of the check string is 0x906e, the frame checksum is byte swapped
+    if (crc16_final(crc16_update(CRC16_INIT, check_str, 9)) != 0x6e90)
+    {
+        fprintf(stderr, "%s: CRC16 check value mismatch\n", __func__);
+        return -1;
+    }
+    if (crc32_update(0, check_str, 9) != 0xcbf43926)
+    {
+        fprintf(stderr, "%s: CRC32 (%s) check value mismatch\n", __func__, crc32_impl_name());
+        return -1;
+    }
+    uint8_t *buf = (uint8_t *)malloc(CRC_SELF_CHECK_SZ);
+    if (buf == NULL)
+        return -1;
+    srand(CRC_SELF_CHECK_SZ);
+    for (int i = 0; i < CRC_SELF_CHECK_SZ; i++)
+        buf[i] = rand();
+    int ret = 1;
+    // every length up to 64 bytes at every alignment, then sparse lengths
+    for (size_t len = 0; len < CRC_SELF_CHECK_SZ - 8; len = len < 64 ? len + 1 : len * 3 / 2)
+    {
+        for (int ofst = 0; ofst < 8; ofst++)
+        {
+            uint16_t ref = crc16_bitwise(buf + ofst, len);
+            uint16_t val = crc16_final(crc16_update(CRC16_INIT, buf + ofst, len));
+            if (ref != val)
+            {
+                fprintf(stderr, "%s: CRC16 mismatch at length %zu offset %d: 0x%04x != 0x%04x\n", __func__, len, ofst, val, ref);
+                ret = -1;
+                goto end;
+            }
+            // chunked updates must match a single pass
+            uint16_t crc = crc16_update(CRC16_INIT, buf + ofst, len / 3);
+            crc = crc16_update(crc, buf + ofst + len / 3, len - len / 3);
+            if (crc16_final(crc) != ref)
+            {
+                fprintf(stderr, "%s: Chunked CRC16 mismatch at length %zu offset %d\n", __func__, len, ofst);
+                ret = -1;
+                goto end;
+            }
+            static uint8_t cpy[CRC_SELF_CHECK_SZ];
+            crc = crc16_copy_update(CRC16_INIT, cpy, buf + ofst, len);
+            if ((crc16_final(crc) != ref) || memcmp(cpy, buf + ofst, len))
+            {
+                fprintf(stderr, "%s: Copy and CRC16 mismatch at length %zu offset %d\n", __func__, len, ofst);
+                ret = -1;
+                goto end;
+            }
+            uint32_t ref32 = crc32_bytewise(buf + ofst, len);
+            if ((crc32_update(0, buf + ofst, len) != ref32) ||
+                (crc32_slice8_update(0, buf + ofst, len) != ref32) ||
+                (crc32_update(crc32_update(0, buf + ofst, len / 3), buf + ofst + len / 3, len - len / 3) != ref32))
+            {
+                fprintf(stderr, "%s: CRC32 (%s) mismatch at length %zu offset %d\n", __func__, crc32_impl_name(), len, ofst);
+                ret = -1;
+                goto end;
+            }
+        }
+    }
+end:
+    free(buf);
+    return ret;
+}
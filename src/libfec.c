@@ -0,0 +1,458 @@
+/**
+ * @file libfec.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Systematic Reed-Solomon erasure code over GF(2^8) used to protect
+ * multi-frame packets against lost frames.
+ * @version 0.1
+ * @date 2021-06-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <libfec.h>
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+/*
+ * gf_mul_tab[c] is the 256-byte multiplication table row for coefficient c.
+ * gf_nib_lo[c][i] = c * i and gf_nib_hi[c][i] = c * (i << 4) are the split
+ * nibble tables used by the shuffle based region multiply, since
+ * c * x = c * (x & 0xf) + c * (x & 0xf0).
+ */
+static uint8_t gf_mul_tab[256][256];
+static uint8_t gf_nib_lo[256][16] __attribute__((aligned(16)));
+static uint8_t gf_nib_hi[256][16] __attribute__((aligned(16)));
+
+static void gf_tab_init(void)
+{
+    int x = 1;
+    for (int i = 0; i < 255; i++)
+    {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= FEC_GF_POLY;
+    }
+    for (int i = 255; i < 512; i++) // no modulo on log sums
+        gf_exp[i] = gf_exp[i - 255];
+    gf_log[0] = 0; // unused
+    for (int a = 0; a < 256; a++)
+        for (int b = 0; b < 256; b++)
+            gf_mul_tab[a][b] = (a == 0 || b == 0) ? 0 : gf_exp[gf_log[a] + gf_log[b]];
+    for (int c = 0; c < 256; c++)
+        for (int i = 0; i < 16; i++)
+        {
+            gf_nib_lo[c][i] = gf_mul_tab[c][i];
+            gf_nib_hi[c][i] = gf_mul_tab[c][i << 4];
+        }
+}
+
+uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    return gf_mul_tab[a][b];
+}
+
+uint8_t gf_inv(uint8_t a)
+{
+    return a == 0 ? 0 : gf_exp[255 - gf_log[a]];
+}
+
+void gf_mul_add_region_ref(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    if (c == 0)
+        return;
+    const uint8_t *row = gf_mul_tab[c];
+    for (size_t i = 0; i < len; i++)
+        dst[i] ^= row[src[i]];
+}
+
+static void gf_mul_add_table(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    if (c == 0)
+        return;
+    if (c == 1)
+    {
+        for (; len >= 8; len -= 8, dst += 8, src += 8)
+        {
+            uint64_t a, b;
+            memcpy(&a, dst, 8);
+            memcpy(&b, src, 8);
+            a ^= b;
+            memcpy(dst, &a, 8);
+        }
+    }
+    const uint8_t *row = gf_mul_tab[c];
+    for (; len >= 8; len -= 8, dst += 8, src += 8)
+    {
+        dst[0] ^= row[src[0]];
+        dst[1] ^= row[src[1]];
+        dst[2] ^= row[src[2]];
+        dst[3] ^= row[src[3]];
+        dst[4] ^= row[src[4]];
+        dst[5] ^= row[src[5]];
+        dst[6] ^= row[src[6]];
+        dst[7] ^= row[src[7]];
+    }
+    while (len--)
+        *dst++ ^= row[*src++];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+ * 16 bytes per iteration: PSHUFB looks up the products of the low and high
+ * nibbles of each source byte in the split tables.
+ */
+__attribute__((target("ssse3"))) static void gf_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    if (c == 0)
+        return;
+    const __m128i tlo = _mm_load_si128((const __m128i *)gf_nib_lo[c]);
+    const __m128i thi = _mm_load_si128((const __m128i *)gf_nib_hi[c]);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    for (; len >= 32; len -= 32, dst += 32, src += 32)
+    {
+        __m128i s0 = _mm_loadu_si128((const __m128i *)src);
+        __m128i s1 = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i p0 = _mm_xor_si128(_mm_shuffle_epi8(tlo, _mm_and_si128(s0, mask)), _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s0, 4), mask)));
+        __m128i p1 = _mm_xor_si128(_mm_shuffle_epi8(tlo, _mm_and_si128(s1, mask)), _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s1, 4), mask)));
+        _mm_storeu_si128((__m128i *)dst, _mm_xor_si128(_mm_loadu_si128((const __m128i *)dst), p0));
+        _mm_storeu_si128((__m128i *)(dst + 16), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + 16)), p1));
+    }
+    if (len >= 16)
+    {
+        __m128i s0 = _mm_loadu_si128((const __m128i *)src);
+        __m128i p0 = _mm_xor_si128(_mm_shuffle_epi8(tlo, _mm_and_si128(s0, mask)), _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s0, 4), mask)));
+        _mm_storeu_si128((__m128i *)dst, _mm_xor_si128(_mm_loadu_si128((const __m128i *)dst), p0));
+        len -= 16;
+        dst += 16;
+        src += 16;
+    }
+    gf_mul_add_table(dst, src, c, len);
+}
+
+/*
+ * Same as above on 32 bytes per shuffle, the nibble tables are broadcast to
+ * both 128-bit lanes.
+ */
+__attribute__((target("avx2"))) static void gf_mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    if (c == 0)
+        return;
+    const __m256i tlo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)gf_nib_lo[c]));
+    const __m256i thi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)gf_nib_hi[c]));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    for (; len >= 32; len -= 32, dst += 32, src += 32)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i *)src);
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, _mm256_and_si256(s, mask)), _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        _mm256_storeu_si256((__m256i *)dst, _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)dst), p));
+    }
+    gf_mul_add_table(dst, src, c, len);
+}
+#endif // x86
+
+#if defined(__aarch64__) || (defined(__ARM_NEON) && defined(__ARM_ARCH_7A__))
+#include <arm_neon.h>
+
+#if defined(__aarch64__)
+#define gf_vtbl16(t, i) vqtbl1q_u8(t, i)
+#else
+static inline uint8x16_t gf_vtbl16(uint8x16_t t, uint8x16_t i)
+{
+    uint8x8x2_t t2 = {{vget_low_u8(t), vget_high_u8(t)}};
+    return vcombine_u8(vtbl2_u8(t2, vget_low_u8(i)), vtbl2_u8(t2, vget_high_u8(i)));
+}
+#endif
+
+/*
+ * 16 bytes per iteration: TBL looks up the products of the low and high
+ * nibbles of each source byte in the split tables.
+ */
+static void gf_mul_add_neon(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    if (c == 0)
+        return;
+    const uint8x16_t tlo = vld1q_u8(gf_nib_lo[c]);
+    const uint8x16_t thi = vld1q_u8(gf_nib_hi[c]);
+    const uint8x16_t mask = vdupq_n_u8(0x0f);
+    for (; len >= 16; len -= 16, dst += 16, src += 16)
+    {
+        uint8x16_t s = vld1q_u8(src);
+        uint8x16_t p = veorq_u8(gf_vtbl16(tlo, vandq_u8(s, mask)), gf_vtbl16(thi, vshrq_n_u8(s, 4)));
+        vst1q_u8(dst, veorq_u8(vld1q_u8(dst), p));
+    }
+    gf_mul_add_table(dst, src, c, len);
+}
+#endif // ARM NEON
+
+typedef void (*gf_mul_add_impl_t)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+static gf_mul_add_impl_t gf_mul_add_impl = &gf_mul_add_table;
+static const char *gf_mul_add_impl_str = "table";
+
+__attribute__((constructor)) static void fec_dispatch_init(void)
+{
+    gf_tab_init();
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        gf_mul_add_impl = &gf_mul_add_avx2;
+        gf_mul_add_impl_str = "avx2";
+    }
+    else if (__builtin_cpu_supports("ssse3"))
+    {
+        gf_mul_add_impl = &gf_mul_add_ssse3;
+        gf_mul_add_impl_str = "ssse3";
+    }
+#elif defined(__aarch64__) || (defined(__ARM_NEON) && defined(__ARM_ARCH_7A__))
+    gf_mul_add_impl = &gf_mul_add_neon;
+    gf_mul_add_impl_str = "neon";
+#endif
+}
+
+void gf_mul_add_region(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    gf_mul_add_impl(dst, src, c, len);
+}
+
+const char *fec_impl_name(void)
+{
+    return gf_mul_add_impl_str;
+}
+
+uint8_t fec_coef(int r, int j)
+{
+    return gf_inv((uint8_t)((255 - r) ^ j));
+}
+
+int fec_encode_update(int k, int j, const uint8_t *src, size_t len, uint8_t **parity)
+{
+    if ((k < 0) || (j < 0) || (j + k > FEC_MAX_SHARDS))
+        return -1;
+    for (int r = 0; r < k; r++)
+        gf_mul_add_region(parity[r], src, fec_coef(r, j), len);
+    return 1;
+}
+
+int fec_encode(int n, int k, const uint8_t *const *data, uint8_t **parity, size_t len)
+{
+    if ((n <= 0) || (k < 0) || (n + k > FEC_MAX_SHARDS))
+        return -1;
+    for (int r = 0; r < k; r++)
+        memset(parity[r], 0x0, len);
+    for (int j = 0; j < n; j++)
+        fec_encode_update(k, j, data[j], len, parity);
+    return 1;
+}
+
+/*
+ * Invert an m x m matrix over GF(2^8) in place by Gauss-Jordan elimination.
+ * Rows are FEC_MAX_SHARDS wide.
+ */
+static int gf_invert(uint8_t (*a)[FEC_MAX_SHARDS], uint8_t (*inv)[FEC_MAX_SHARDS], int m)
+{
+    for (int i = 0; i < m; i++)
+    {
+        memset(inv[i], 0x0, m);
+        inv[i][i] = 1;
+    }
+    for (int col = 0; col < m; col++)
+    {
+        int piv = col;
+        while ((piv < m) && (a[piv][col] == 0))
+            piv++;
+        if (piv == m)
+            return -1; // singular
+        if (piv != col)
+        {
+            uint8_t tmp[FEC_MAX_SHARDS];
+            memcpy(tmp, a[piv], m);
+            memcpy(a[piv], a[col], m);
+            memcpy(a[col], tmp, m);
+            memcpy(tmp, inv[piv], m);
+            memcpy(inv[piv], inv[col], m);
+            memcpy(inv[col], tmp, m);
+        }
+        uint8_t s = gf_inv(a[col][col]);
+        for (int j = 0; j < m; j++)
+        {
+            a[col][j] = gf_mul(a[col][j], s);
+            inv[col][j] = gf_mul(inv[col][j], s);
+        }
+        for (int i = 0; i < m; i++)
+        {
+            uint8_t f = a[i][col];
+            if ((i == col) || (f == 0))
+                continue;
+            for (int j = 0; j < m; j++)
+            {
+                a[i][j] ^= gf_mul(f, a[col][j]);
+                inv[i][j] ^= gf_mul(f, inv[col][j]);
+            }
+        }
+    }
+    return 1;
+}
+
+int fec_decode(int n, uint8_t **data, const int *data_ok, const uint8_t *const *parity, const int *parity_idx, int num_parity, size_t len)
+{
+    if ((n <= 0) || (n >= FEC_MAX_SHARDS))
+        return -1;
+    int missing[FEC_MAX_SHARDS];
+    int m = 0;
+    for (int j = 0; j < n; j++)
+        if (!data_ok[j])
+            missing[m++] = j;
+    if (m == 0)
+        return 0;
+    if (m > num_parity)
+        return -1;
+    /*
+     * With parity rows r_a (a < m) and missing columns j_b, parity r_a minus
+     * the contribution of the surviving data is A d_missing, with A[a][b] =
+     * C[r_a][j_b] a Cauchy matrix, hence invertible. Each missing shard is
+     * then a linear combination of the m parity shards and the surviving data
+     * shards, accumulated straight into the output without scratch space.
+     */
+    static __thread uint8_t a[FEC_MAX_SHARDS][FEC_MAX_SHARDS];
+    static __thread uint8_t inv[FEC_MAX_SHARDS][FEC_MAX_SHARDS];
+    for (int r = 0; r < m; r++)
+        for (int b = 0; b < m; b++)
+            a[r][b] = fec_coef(parity_idx[r], missing[b]);
+    if (gf_invert(a, inv, m) < 0)
+        return -1;
+    for (int b = 0; b < m; b++)
+    {
+        uint8_t *out = data[missing[b]];
+        memset(out, 0x0, len);
+        for (int r = 0; r < m; r++)
+            gf_mul_add_region(out, parity[r], inv[b][r], len);
+        for (int j = 0; j < n; j++)
+        {
+            if (!data_ok[j])
+                continue;
+            uint8_t e = 0;
+            for (int r = 0; r < m; r++)
+                e ^= gf_mul(inv[b][r], fec_coef(parity_idx[r], j));
+            gf_mul_add_region(out, data[j], e, len);
+        }
+    }
+    return m;
+}
+
+int fec_self_check(void)
+{
+    uint8_t *src = (uint8_t *)malloc(4096);
+    uint8_t *dst = (uint8_t *)malloc(4096);
+    uint8_t *ref = (uint8_t *)malloc(4096);
+    if ((src == NULL) || (dst == NULL) || (ref == NULL))
+    {
+        free(src);
+        free(dst);
+        free(ref);
+        return -1;
+    }
+    int ret = 1;
+    for (int i = 0; i < 4096; i++)
+        src[i] = rand();
+    for (int c = 0; (c < 256) && (ret > 0); c++)
+    {
+        for (size_t len = 0; len < 100; len += 7)
+        {
+            for (int i = 0; i < 4096; i++)
+                dst[i] = ref[i] = i;
+            gf_mul_add_region(dst + 1, src + 3, c, len);
+            gf_mul_add_region_ref(ref + 1, src + 3, c, len);
+            if (memcmp(dst, ref, 4096))
+            {
+                fprintf(stderr, "%s: Region multiply (%s) mismatch at coefficient %d length %zu\n", __func__, fec_impl_name(), c, len);
+                ret = -1;
+                break;
+            }
+        }
+    }
+    free(src);
+    free(dst);
+    free(ref);
+    if (ret < 0)
+        return ret;
+
+    /* round trip over random block shapes and erasure patterns */
+    enum
+    {
+        SHARD = 200,
+        MAX_N = 32,
+        MAX_K = 8
+    };
+    uint8_t *shards = (uint8_t *)malloc((2 * MAX_N + MAX_K) * SHARD);
+    if (shards == NULL)
+        return -1;
+    for (int trial = 0; (trial < 200) && (ret > 0); trial++)
+    {
+        int n = 1 + rand() % MAX_N;
+        int k = 1 + rand() % MAX_K;
+        uint8_t *data[MAX_N], *parity[MAX_K];
+        const uint8_t *pptr[MAX_K];
+        int ok[MAX_N], pidx[MAX_K];
+        for (int j = 0; j < n; j++)
+        {
+            data[j] = shards + j * SHARD;
+            for (int i = 0; i < SHARD; i++)
+                data[j][i] = rand();
+            memcpy(shards + (MAX_N + MAX_K + j) * SHARD, data[j], SHARD); // originals
+        }
+        for (int r = 0; r < k; r++)
+            parity[r] = shards + (MAX_N + r) * SHARD;
+        fec_encode(n, k, (const uint8_t *const *)data, parity, SHARD);
+        // erase up to k shards
+        int lost = rand() % (k + 1);
+        for (int j = 0; j < n; j++)
+            ok[j] = 1;
+        int np = 0;
+        for (int r = 0; r < k; r++)
+        {
+            pidx[np] = r;
+            pptr[np++] = parity[r];
+        }
+        for (int l = 0; l < lost; l++)
+        {
+            int s = rand() % (n + k);
+            if (s < n)
+            {
+                ok[s] = 0;
+                memset(data[s], 0xa5, SHARD);
+            }
+            else
+            {
+                for (int p = 0; p < np; p++) // drop parity row s - n
+                    if (pidx[p] == s - n)
+                    {
+                        pidx[p] = pidx[np - 1];
+                        pptr[p] = pptr[np - 1];
+                        np--;
+                        break;
+                    }
+            }
+        }
+        if (fec_decode(n, data, ok, pptr, pidx, np, SHARD) < 0)
+        {
+            fprintf(stderr, "%s: Decode failed, n = %d, k = %d, lost = %d\n", __func__, n, k, lost);
+            ret = -1;
+        }
+        for (int j = 0; (j < n) && (ret > 0); j++)
+            if (memcmp(data[j], shards + (MAX_N + MAX_K + j) * SHARD, SHARD))
+            {
+                fprintf(stderr, "%s: Shard %d rebuilt incorrectly, n = %d, k = %d\n", __func__, j, n, k);
+                ret = -1;
+            }
+    }
+    free(shards);
+    return ret;
+}
@@ -0,0 +1,408 @@
+/**
+ * @file liblz.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Fast LZ77 compression in the LZ4 block format, with a streaming
+ * block framing used to compress packets ahead of the modem framing.
+ * @version 0.1
+ * @date 2021-06-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <liblz.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 // the block ends with at least 5 literals
+#define LZ_MFLIMIT 12      // no match starts in the last 12 bytes
+#define LZ_HASH_LOG 12
+#define LZ_MAX_OFFSET 65535
+
+static inline uint64_t get_nsec()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000L + ((uint64_t)ts.tv_nsec);
+}
+
+static inline uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(uint32_t));
+    return v;
+}
+
+static inline uint64_t lz_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(uint64_t));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+static inline uint8_t *lz_write_len(uint8_t *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+int lz_compress_block(const uint8_t *src, int src_sz, uint8_t *dst, int dst_cap)
+{
+    uint16_t table[1 << LZ_HASH_LOG]; // positions in the block, 64 KiB blocks fit in 16 bits
+    const uint8_t *ip = src, *anchor = src;
+    const uint8_t *iend = src + src_sz;
+    const uint8_t *mflimit = iend - LZ_MFLIMIT;
+    const uint8_t *matchlimit = iend - LZ_LAST_LITERALS;
+    uint8_t *op = dst, *oend = dst + dst_cap;
+    if ((src_sz < 0) || (src_sz > LZ_BLOCK_SZ))
+        return 0;
+    memset(table, 0x0, sizeof(table));
+    if (src_sz >= LZ_MFLIMIT + 1)
+    {
+        ip++;
+        while (ip < mflimit)
+        {
+            /* find a match, skipping faster through incompressible data */
+            const uint8_t *match;
+            unsigned step = 1, attempts = 1 << 6;
+            for (;;)
+            {
+                uint32_t h = lz_hash(lz_read32(ip));
+                match = src + table[h];
+                table[h] = (uint16_t)(ip - src);
+                if ((match < ip) && (ip - match <= LZ_MAX_OFFSET) && (lz_read32(match) == lz_read32(ip)))
+                    break;
+                ip += step;
+                step = attempts++ >> 6;
+                if (ip >= mflimit)
+                    goto lz_last_literals;
+            }
+            /* extend backwards */
+            while ((ip > anchor) && (match > src) && (ip[-1] == match[-1]))
+            {
+                ip--;
+                match--;
+            }
+            /* extend forwards */
+            const uint8_t *mp = ip + LZ_MIN_MATCH, *mm = match + LZ_MIN_MATCH;
+            while (mp + sizeof(uint64_t) <= matchlimit) // 8 bytes at a time, the first differing byte is the lowest set one (little endian)
+            {
+                uint64_t diff = lz_read64(mp) ^ lz_read64(mm);
+                if (diff)
+                {
+                    mp += __builtin_ctzll(diff) >> 3;
+                    goto lz_match_end;
+                }
+                mp += sizeof(uint64_t);
+                mm += sizeof(uint64_t);
+            }
+            while ((mp < matchlimit) && (*mp == *mm))
+            {
+                mp++;
+                mm++;
+            }
+        lz_match_end:;
+            size_t lit = ip - anchor;
+            size_t mlen = mp - ip - LZ_MIN_MATCH;
+            if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > oend)
+                return 0;
+            uint8_t *token = op++;
+            *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+            if (lit >= 15)
+                op = lz_write_len(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            uint16_t offset = (uint16_t)(ip - match);
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+            if (mlen >= 15)
+                op = lz_write_len(op, mlen - 15);
+            ip = mp;
+            anchor = ip;
+            if (ip < mflimit) // the position before the next search is a likely match source
+                table[lz_hash(lz_read32(ip - 2))] = (uint16_t)(ip - 2 - src);
+        }
+    }
+lz_last_literals:;
+    size_t lit = iend - anchor;
+    if (op + 1 + lit / 255 + 1 + lit > oend)
+        return 0;
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15)
+        op = lz_write_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return (int)(op - dst);
+}
+
+int lz_decompress_block(const uint8_t *src, int src_sz, uint8_t *dst, int dst_cap)
+{
+    const uint8_t *ip = src, *iend = src + src_sz;
+    uint8_t *op = dst, *oend = dst + dst_cap;
+    while (ip < iend)
+    {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15)
+        {
+            unsigned b;
+            do
+            {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if ((lit > (size_t)(iend - ip)) || (lit > (size_t)(oend - op)))
+            return -1;
+        if ((lit <= 16) && (iend - ip >= 16) && (oend - op >= 16)) // fixed size copy, the bytes past lit are overwritten next
+            memcpy(op, ip, 16);
+        else
+            memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) // last sequence has no match
+            break;
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((offset == 0) || (offset > (size_t)(op - dst)))
+            return -1;
+        size_t mlen = token & 0xf;
+        if (mlen == 15)
+        {
+            unsigned b;
+            do
+            {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > (size_t)(oend - op))
+            return -1;
+        const uint8_t *match = op - offset;
+        if ((mlen <= 16) && (offset >= 16) && (oend - op >= 16))
+            memcpy(op, match, 16);
+        else if (offset >= mlen)
+            memcpy(op, match, mlen);
+        else // overlapping copy repeats the last offset bytes, double the copied run each time
+        {
+            memcpy(op, match, offset);
+            for (size_t done = offset; done < mlen; done *= 2)
+                memcpy(op + done, op, done < mlen - done ? done : mlen - done);
+        }
+        op += mlen;
+    }
+    return (int)(op - dst);
+}
+
+int lz_enc_init_iov(lz_enc_t *enc, const struct iovec *iov, int iovcnt)
+{
+    memset(enc, 0x0, sizeof(lz_enc_t));
+    enc->iov = iov;
+    enc->iovcnt = iovcnt;
+    for (int i = 0; i < iovcnt; i++)
+        enc->src_sz += iov[i].iov_len;
+    enc->blk = (uint8_t *)malloc(sizeof(uint32_t) + LZ_BLOCK_BOUND(LZ_BLOCK_SZ));
+    if (iovcnt > 1) // blocks may span fragments
+        enc->in = (uint8_t *)malloc(LZ_BLOCK_SZ);
+    if ((enc->blk == NULL) || ((iovcnt > 1) && (enc->in == NULL)))
+    {
+        lz_enc_free(enc);
+        return -1;
+    }
+    return 1;
+}
+
+int lz_enc_init(lz_enc_t *enc, const uint8_t *src, size_t src_sz)
+{
+    int ret = lz_enc_init_iov(enc, enc->iov1, 1);
+    enc->iov1->iov_base = (void *)src;
+    enc->iov1->iov_len = src_sz;
+    enc->src_sz = src_sz;
+    return ret;
+}
+
+/*
+ * Get the next in_sz bytes of input in one piece: in place if they are
+ * within a fragment, gathered into enc->in otherwise.
+ */
+static const uint8_t *lz_enc_input(lz_enc_t *enc, size_t in_sz)
+{
+    while (enc->iov_ofst == enc->iov[enc->iov_idx].iov_len) // skip over consumed and empty fragments
+    {
+        enc->iov_idx++;
+        enc->iov_ofst = 0;
+    }
+    const uint8_t *frag = (const uint8_t *)enc->iov[enc->iov_idx].iov_base + enc->iov_ofst;
+    if (enc->iov[enc->iov_idx].iov_len - enc->iov_ofst >= in_sz)
+    {
+        enc->iov_ofst += in_sz;
+        return frag;
+    }
+    for (size_t ofst = 0; ofst < in_sz;)
+    {
+        if (enc->iov_ofst == enc->iov[enc->iov_idx].iov_len)
+        {
+            enc->iov_idx++;
+            enc->iov_ofst = 0;
+            continue;
+        }
+        size_t sz = enc->iov[enc->iov_idx].iov_len - enc->iov_ofst;
+        sz = sz < in_sz - ofst ? sz : in_sz - ofst;
+        memcpy(enc->in + ofst, (const uint8_t *)enc->iov[enc->iov_idx].iov_base + enc->iov_ofst, sz);
+        enc->iov_ofst += sz;
+        ofst += sz;
+    }
+    return enc->in;
+}
+
+/*
+ * Compress the next block of input, stored raw if it does not shrink
+ */
+static void lz_enc_fill(lz_enc_t *enc)
+{
+    uint64_t start = get_nsec();
+    uint32_t hdr = 0;
+    size_t in_sz = enc->src_sz - enc->src_ofst;
+    in_sz = in_sz < LZ_BLOCK_SZ ? in_sz : LZ_BLOCK_SZ;
+    if (in_sz == 0)
+        enc->done = 1; // end of stream
+    else
+    {
+        const uint8_t *in = lz_enc_input(enc, in_sz);
+        int out_sz = lz_compress_block(in, in_sz, enc->blk + sizeof(uint32_t), in_sz - 1);
+        if (out_sz > 0)
+            hdr = out_sz;
+        else
+        {
+            memcpy(enc->blk + sizeof(uint32_t), in, in_sz);
+            hdr = in_sz | LZ_BLOCK_RAW;
+        }
+        enc->src_ofst += in_sz;
+        enc->stats.in_sz += in_sz;
+    }
+    memcpy(enc->blk, &hdr, sizeof(uint32_t));
+    enc->blk_sz = sizeof(uint32_t) + (hdr & ~LZ_BLOCK_RAW);
+    enc->blk_ofst = 0;
+    enc->stats.out_sz += enc->blk_sz;
+    enc->stats.ns += get_nsec() - start;
+}
+
+size_t lz_enc_next(lz_enc_t *enc, const uint8_t **ptr, size_t max)
+{
+    if (enc->blk_ofst == enc->blk_sz)
+    {
+        if (enc->done)
+            return 0;
+        lz_enc_fill(enc);
+    }
+    size_t sz = enc->blk_sz - enc->blk_ofst;
+    sz = sz < max ? sz : max;
+    *ptr = enc->blk + enc->blk_ofst;
+    enc->blk_ofst += sz;
+    return sz;
+}
+
+void lz_enc_free(lz_enc_t *enc)
+{
+    free(enc->blk);
+    free(enc->in);
+    enc->blk = NULL;
+    enc->in = NULL;
+}
+
+int lz_dec_init(lz_dec_t *dec, uint8_t *dst, size_t dst_cap)
+{
+    memset(dec, 0x0, sizeof(lz_dec_t));
+    dec->dst = dst;
+    dec->dst_cap = dst_cap;
+    dec->blk = (uint8_t *)malloc(LZ_BLOCK_BOUND(LZ_BLOCK_SZ));
+    return dec->blk == NULL ? -1 : 1;
+}
+
+int lz_dec_write(lz_dec_t *dec, const uint8_t *src, size_t len)
+{
+    uint64_t start = get_nsec();
+    while ((len > 0) && (dec->state >= 0) && (dec->state < 2))
+    {
+        if (dec->state == 0) // block header
+        {
+            size_t sz = sizeof(uint32_t) - dec->have;
+            sz = sz < len ? sz : len;
+            memcpy(dec->hdr + dec->have, src, sz);
+            dec->have += sz;
+            src += sz;
+            len -= sz;
+            if (dec->have < sizeof(uint32_t))
+                break;
+            uint32_t hdr;
+            memcpy(&hdr, dec->hdr, sizeof(uint32_t));
+            dec->need = hdr & ~LZ_BLOCK_RAW;
+            dec->have = 0;
+            if (hdr == 0)
+                dec->state = 2;
+            else if ((dec->need > LZ_BLOCK_BOUND(LZ_BLOCK_SZ)) || ((hdr & LZ_BLOCK_RAW) && (dec->need > LZ_BLOCK_SZ)))
+                dec->state = -1;
+            else
+                dec->state = 1;
+            continue;
+        }
+        uint32_t hdr;
+        memcpy(&hdr, dec->hdr, sizeof(uint32_t));
+        size_t room = dec->dst_cap - dec->dst_ofst;
+        size_t sz = dec->need - dec->have;
+        sz = sz < len ? sz : len;
+        if ((hdr & LZ_BLOCK_RAW) && (dec->have + sz > room)) // raw blocks are copied straight out
+        {
+            dec->state = -1;
+            break;
+        }
+        if (hdr & LZ_BLOCK_RAW)
+            memcpy(dec->dst + dec->dst_ofst + dec->have, src, sz);
+        else
+            memcpy(dec->blk + dec->have, src, sz);
+        dec->have += sz;
+        src += sz;
+        len -= sz;
+        dec->stats.in_sz += sz;
+        if (dec->have < dec->need)
+            break;
+        int out_sz = dec->need;
+        if (!(hdr & LZ_BLOCK_RAW))
+            out_sz = lz_decompress_block(dec->blk, dec->need, dec->dst + dec->dst_ofst, room < LZ_BLOCK_SZ ? room : LZ_BLOCK_SZ);
+        if (out_sz < 0)
+        {
+            dec->state = -1;
+            break;
+        }
+        dec->dst_ofst += out_sz;
+        dec->stats.out_sz += out_sz;
+        dec->have = 0;
+        dec->state = 0;
+    }
+    dec->stats.ns += get_nsec() - start;
+    return dec->state == 2 ? 0 : (dec->state < 0 ? -1 : 1);
+}
+
+void lz_dec_free(lz_dec_t *dec)
+{
+    free(dec->blk);
+    dec->blk = NULL;
+}
@@ -0,0 +1,135 @@
+/**
+ * @file lzbench.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Compression ratio and CPU cost per packet of the liblz stage, to
+ * decide per payload type whether compressing ahead of framing pays off.
+ * @version 0.1
+ * @date 2021-06-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "liblz.h"
+
+#define BENCH_BYTES (64 << 20) // payload bytes compressed per measurement
+#define BENCH_PACK_SZ (1 << 20) // default packet size
+
+/*
+ * Run a packet through the streaming encoder and decoder the way txmodem_write
+ * and rxmodem_read do, pulling frame sized pieces.
+ */
+static int bench_packet(const uint8_t *src, size_t size, uint8_t *out, size_t piece, lz_stats_t *enc_st, lz_stats_t *dec_st)
+{
+    lz_enc_t enc[1];
+    lz_dec_t dec[1];
+    if ((lz_enc_init(enc, src, size) < 0) || (lz_dec_init(dec, out, size) < 0))
+        return -1;
+    const uint8_t *ptr;
+    size_t sz;
+    int ret = 1;
+    while ((sz = lz_enc_next(enc, &ptr, piece)) > 0)
+        ret = lz_dec_write(dec, ptr, sz);
+    if ((ret != 0) || (dec->dst_ofst != size) || memcmp(src, out, size))
+        ret = -1;
+    enc_st->in_sz += enc->stats.in_sz;
+    enc_st->out_sz += enc->stats.out_sz;
+    enc_st->ns += enc->stats.ns;
+    dec_st->in_sz += dec->stats.in_sz;
+    dec_st->out_sz += dec->stats.out_sz;
+    dec_st->ns += dec->stats.ns;
+    lz_enc_free(enc);
+    lz_dec_free(dec);
+    return ret;
+}
+
+static int bench(const char *name, const uint8_t *buf, size_t size, size_t pack_sz)
+{
+    uint8_t *out = (uint8_t *)malloc(pack_sz);
+    if (out == NULL)
+        return -1;
+    lz_stats_t enc_st[1], dec_st[1];
+    memset(enc_st, 0x0, sizeof(lz_stats_t));
+    memset(dec_st, 0x0, sizeof(lz_stats_t));
+    size_t num_packs = 0;
+    for (size_t done = 0; done < BENCH_BYTES; num_packs++)
+    {
+        size_t ofst = (num_packs * pack_sz) % size;
+        size_t len = size - ofst < pack_sz ? size - ofst : pack_sz;
+        if (bench_packet(buf + ofst, len, out, 4064, enc_st, dec_st) < 0)
+        {
+            printf("%-12s round trip FAILED\n", name);
+            free(out);
+            return -1;
+        }
+        done += len;
+    }
+    printf("%-12s %8.2f%% %12.1f %12.1f %12.1f %12.1f\n", name, 100.0 * enc_st->out_sz / enc_st->in_sz,
+           enc_st->in_sz * 1e3 / enc_st->ns, dec_st->out_sz * 1e3 / dec_st->ns,
+           (double)enc_st->ns / num_packs / 1e3, (double)dec_st->ns / num_packs / 1e3);
+    free(out);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t pack_sz = BENCH_PACK_SZ;
+    int first = 1;
+    if ((argc > 2) && !strcmp(argv[1], "-p"))
+    {
+        pack_sz = strtoul(argv[2], NULL, 0);
+        first = 3;
+    }
+    if (pack_sz == 0)
+        pack_sz = BENCH_PACK_SZ;
+    printf("Packet size %zu bytes, stream stored in %d byte blocks\n", pack_sz, LZ_BLOCK_SZ);
+    printf("%-12s %9s %12s %12s %12s %12s\n", "Payload", "Ratio", "Comp MB/s", "Decomp MB/s", "Comp us/pk", "Decomp us/pk");
+    if (argc <= first) // synthetic payloads
+    {
+        size_t size = pack_sz;
+        uint8_t *buf = (uint8_t *)malloc(size);
+        if (buf == NULL)
+        {
+            perror("malloc");
+            return 1;
+        }
+        for (size_t i = 0; i < size; i++)
+            buf[i] = rand();
+        bench("random", buf, size, pack_sz);
+        for (size_t i = 0; i < size; i++)
+            buf[i] = 0;
+        bench("zeros", buf, size, pack_sz);
+        for (size_t i = 0; i < size; i++) // slowly varying 16 bit samples
+            ((uint16_t *)buf)[i / 2] = 2048 + (int)(512 * ((i / 64) % 16)) + (rand() % 8);
+        bench("samples", buf, size, pack_sz);
+        for (size_t i = 0; i < size; i++)
+            buf[i] = "time,lat,lon,alt,temp\n"[i % 22] ^ ((i % 22 > 4) && (rand() % 4 == 0) ? 0x1 : 0x0);
+        bench("telemetry", buf, size, pack_sz);
+        free(buf);
+        return 0;
+    }
+    for (int i = first; i < argc; i++)
+    {
+        FILE *fp = fopen(argv[i], "rb");
+        if (fp == NULL)
+        {
+            perror(argv[i]);
+            continue;
+        }
+        fseek(fp, 0L, SEEK_END);
+        ssize_t size = ftell(fp);
+        fseek(fp, 0L, SEEK_SET);
+        uint8_t *buf = (uint8_t *)malloc(size > 0 ? size : 1);
+        if ((size > 0) && (buf != NULL) && (fread(buf, size, 1, fp) == 1))
+        {
+            const char *name = strrchr(argv[i], '/');
+            bench(name == NULL ? argv[i] : name + 1, buf, size, pack_sz);
+        }
+        free(buf);
+        fclose(fp);
+    }
+    return 0;
+}
@@ -0,0 +1,296 @@
+/**
+ * @file rxfectest.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Recovery of erasure coded packets whose frame 0 (the frame carrying
+ * the packet descriptor) is lost or damaged, and the packet CRC32 check of
+ * packets whose frames arrive out of order. Packets go through txmodem_write
+ * into an in-memory stand-in for the TX DMA engine, and the frames, dropped,
+ * damaged or reordered, are handed to rxmodem through an in-memory stand-in
+ * for the RX DMA engine and interrupt.
+ * @version 0.1
+ * @date 2021-06-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "txmodem.h"
+#include "rxmodem.h"
+
+#define TEST_DMA_MEM (4 << 20) // TX and RX DMA buffer size
+#define TEST_MAX_FRAMES 1024   // frames captured from TX
+#define TEST_PACK_SZ 20000     // packet size, 20 data frames at a 1000 byte MTU
+#define TEST_MTU 1000          // frame MTU
+#define TEST_FEC_N 4           // data frames per erasure code block
+#define TEST_FEC_K 1           // parity frames per erasure code block
+
+enum
+{
+    TEST_DROP = 0,   // frame 0 is lost
+    TEST_DAMAGE = 1, // frame 0 arrives with a bad frame CRC
+    TEST_SWAP = 2,   // frames 1 and 2 arrive swapped
+    TEST_LAST = 3,   // frame 0 arrives last
+};
+
+typedef struct
+{
+    int fec;      // packet carries parity frames
+    int compress; // packet is compressed
+    int mode;     // what happens to the frames on the way
+} test_case_t;
+
+static const test_case_t cases[] = {
+    {1, 0, TEST_DROP},
+    {1, 0, TEST_DAMAGE},
+    {1, 1, TEST_DROP},
+    {1, 1, TEST_DAMAGE},
+    {0, 0, TEST_SWAP},
+    {0, 0, TEST_LAST},
+    {0, 1, TEST_SWAP},
+    {0, 1, TEST_LAST},
+};
+
+static uint8_t tx_mem[TEST_DMA_MEM];
+static uint8_t rx_mem[TEST_DMA_MEM];
+static int tx_side = 1;
+
+static uint8_t *frames[TEST_MAX_FRAMES];
+static uint32_t frame_len[TEST_MAX_FRAMES];
+static int num_frames = 0;
+static volatile int next_frame = 0;   // next frame the RX interrupt hands over
+static volatile int frames_ready = 0; // frames the RX interrupt may hand over, none while rxmodem_init clears interrupts
+static int cur_frame = -1;
+
+static void sleep_msec(int ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+}
+
+/* In-memory DMA engines: TX captures the frames of a transfer, RX lands the current frame */
+int adidma_init(adidma *dev, int uio_id, unsigned char ext_buffer_enb)
+{
+    dev->mem_sz = TEST_DMA_MEM;
+    dev->mem_virt_addr = tx_side ? tx_mem : rx_mem;
+    return 1;
+}
+
+void adidma_destroy(adidma *dev)
+{
+}
+
+int adidma_write(adidma *dev, unsigned int offset, ssize_t size, unsigned char cyclic)
+{
+    unsigned int end = offset + size;
+    while ((offset + sizeof(uint64_t) <= end) && (num_frames < TEST_MAX_FRAMES))
+    {
+        uint64_t frame_sz;
+        modem_frame_info_t info[1];
+        memcpy(&frame_sz, tx_mem + offset, sizeof(uint64_t));
+        offset += sizeof(uint64_t);
+        if ((frame_sz == 0) || (offset + frame_sz > end))
+            break;
+        if (modem_parse_frame_hdr(tx_mem + offset, info) > 0)
+        {
+            frames[num_frames] = (uint8_t *)malloc(frame_sz);
+            memcpy(frames[num_frames], tx_mem + offset, frame_sz);
+            frame_len[num_frames++] = frame_sz;
+        }
+        offset += frame_sz;
+    }
+    return 1;
+}
+
+int adidma_stop(adidma *dev)
+{
+    return 1;
+}
+
+int64_t adidma_submit(adidma *dev, unsigned int offset, ssize_t size, unsigned char dir)
+{
+    adidma_write(dev, offset, size, 0);
+    return dev->xfer_submitted++;
+}
+
+int adidma_poll(adidma *dev, int64_t xfer)
+{
+    return 1;
+}
+
+int adidma_wait(adidma *dev, int64_t xfer)
+{
+    return 1;
+}
+
+int adidma_read(adidma *dev, unsigned int offset, ssize_t size)
+{
+    if ((cur_frame < 0) || (offset + frame_len[cur_frame] > dev->mem_sz))
+        return -1;
+    memcpy(dev->mem_virt_addr + offset, frames[cur_frame], frame_len[cur_frame]);
+    return 1;
+}
+
+int uio_init(uio_dev *dev, int uio_id)
+{
+    return 1;
+}
+
+void uio_destroy(uio_dev *dev)
+{
+}
+
+int uio_write(uio_dev *dev, int offset, uint32_t data)
+{
+    return 1;
+}
+
+int uio_read(uio_dev *dev, int offset, uint32_t *data)
+{
+    *data = cur_frame < 0 ? 0 : frame_len[cur_frame];
+    return 1;
+}
+
+int uio_unmask_irq(uio_dev *dev)
+{
+    return 1;
+}
+
+int uio_mask_irq(uio_dev *dev)
+{
+    return 1;
+}
+
+int uio_wait_irq(uio_dev *dev, int32_t tout_ms)
+{
+    if (next_frame < frames_ready)
+    {
+        cur_frame = next_frame++;
+        return 1;
+    }
+    sleep_msec(tout_ms);
+    return 0;
+}
+
+/* Send one packet and keep its frames as they arrive in the test case */
+static int send_pack(uint8_t *buf, ssize_t size, const test_case_t *tc)
+{
+    txmodem dev[1];
+    tx_side = 1;
+    num_frames = 0;
+    if (txmodem_init(dev, 0, 0) < 0)
+        return -1;
+    dev->hdr_version = MODEM_HDR_V2;
+    dev->mtu = TEST_MTU;
+    dev->pack_crc = 1;
+    dev->compress = tc->compress;
+    dev->fec_n = tc->fec ? TEST_FEC_N : 0;
+    dev->fec_k = TEST_FEC_K;
+    int ret = txmodem_write(dev, buf, size);
+    txmodem_destroy(dev);
+    if ((ret <= 0) || (num_frames < 3))
+        return -1;
+    modem_frame_info_t info[1];
+    if ((modem_parse_frame_hdr(frames[0], info) <= 0) || (info->frame_id != 0))
+        return -1;
+    uint8_t *frame = frames[0];
+    uint32_t len = frame_len[0];
+    switch (tc->mode)
+    {
+    case TEST_DAMAGE:
+        frames[0][info->hdr_sz + info->frame_sz / 2] ^= 0xff;
+        return num_frames;
+    case TEST_SWAP:
+        frame = frames[1];
+        len = frame_len[1];
+        frames[1] = frames[2];
+        frame_len[1] = frame_len[2];
+        frames[2] = frame;
+        frame_len[2] = len;
+        return num_frames;
+    case TEST_LAST:
+        memmove(frames, frames + 1, (num_frames - 1) * sizeof(uint8_t *));
+        memmove(frame_len, frame_len + 1, (num_frames - 1) * sizeof(uint32_t));
+        frames[num_frames - 1] = frame;
+        frame_len[num_frames - 1] = len;
+        return num_frames;
+    default:
+        break;
+    }
+    free(frames[0]);
+    memmove(frames, frames + 1, (num_frames - 1) * sizeof(uint8_t *));
+    memmove(frame_len, frame_len + 1, (num_frames - 1) * sizeof(uint32_t));
+    return --num_frames;
+}
+
+/* Receive the packet and compare it with what was sent */
+static int recv_pack(uint8_t *buf, ssize_t size, int compress)
+{
+    rxmodem dev[1];
+    uint8_t *out = NULL;
+    int ret = 0;
+    memset(dev, 0, sizeof(rxmodem));
+    tx_side = 0;
+    next_frame = 0;
+    frames_ready = 0;
+    cur_frame = -1;
+    if (rxmodem_init(dev, 0, 0) < 0)
+        return 0;
+    frames_ready = num_frames;
+    ssize_t rcv_sz = rxmodem_receive(dev);
+    if (rcv_sz == size)
+    {
+        out = (uint8_t *)malloc(rcv_sz);
+        ret = (rxmodem_read(dev, out, rcv_sz) == size) && (memcmp(out, buf, size) == 0) &&
+              (dev->pack_crc_status == 1) && (!(dev->pack_flags & MODEM_FLAG_LZ) == !compress);
+        free(out);
+    }
+    else
+        printf("received %zd, expected %zd: ", rcv_sz, size);
+    rxmodem_destroy(dev);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *mode_name[] = {"frame 0 lost", "frame 0 damaged", "frames 1, 2 swapped", "frame 0 last"};
+    static const char *pack_name[] = {"plain", "LZ", "FEC", "FEC, LZ"};
+    uint8_t *buf = (uint8_t *)malloc(TEST_PACK_SZ);
+    int failed = 0;
+    srand(time(NULL));
+    for (int c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++)
+    {
+        const test_case_t *tc = &(cases[c]);
+        // compressible data so that MODEM_FLAG_LZ packets stay compressed
+        for (int i = 0; i < TEST_PACK_SZ; i++)
+            buf[i] = tc->compress ? "frame zero "[i % 11] ^ ((rand() % 16) == 0) : rand();
+        printf("%-8s %-20s: ", pack_name[2 * tc->fec + tc->compress], mode_name[tc->mode]);
+        fflush(stdout);
+        int nf = send_pack(buf, TEST_PACK_SZ, tc);
+        if (nf < 0)
+        {
+            printf("FAIL (send)\n");
+            failed++;
+        }
+        else if (recv_pack(buf, TEST_PACK_SZ, tc->compress))
+            printf("ok (%d frames)\n", nf);
+        else
+        {
+            printf("FAIL\n");
+            failed++;
+        }
+        for (int i = 0; i < num_frames; i++)
+            free(frames[i]);
+        num_frames = 0;
+    }
+    free(buf);
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
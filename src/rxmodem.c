@@ -13,6 +13,8 @@
 #include "adidma.h"
 #include "rxmodem.h"
 #include "txrx_packdef.h"
+#include "libfec.h"
+#include "liblz.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -20,16 +22,14 @@
 #define _POSIX_C_SOURCE 199309L
 #include <time.h>
 #include <errno.h>
+#include <sys/eventfd.h>
 
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
-static void *rx_irq_thread(void *__dev);
-static pthread_cond_t rx_rcv;
-static pthread_mutex_t rx_rcv_m;
+static void *rx_run_thread(void *__dev);
+static int rxmodem_write_conf(rxmodem *dev, rxmodem_conf_t *conf);
 static pthread_mutex_t rx_write;
-static pthread_mutex_t frame_ofst_m;
-static pthread_mutex_t rx_irq_thread_running;
 
 #define RX_FIFO_RST "960"
 #define RX_FIFO_RST_TOUT 100000 // us
@@ -112,10 +112,6 @@ int rxmodem_init(rxmodem *dev, int rxmodem_id, int rxdma_id)
 {
     if (dev == NULL)
         return -1;
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutex_init(&rx_irq_thread_running, &attr);
-    pthread_mutexattr_destroy(&attr);
 #ifdef RXDEBUG
     eprintf();
 #endif
@@ -169,109 +165,153 @@ int rxmodem_init(rxmodem *dev, int rxmodem_id, int rxdma_id)
         eprintf("Unable to mask RX interrupt");
         perror("uio_mask_irq");
     }
+    dev->running = 0;
+    dev->handler = NULL;
+    dev->handler_busy = 0;
+    dev->fd_ready = 0;
+    dev->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (dev->fd < 0)
+    {
+        eprintf("Unable to create the packet eventfd");
+        perror("eventfd");
+        return -1;
+    }
+    pthread_mutex_init(&(dev->run_m), NULL);
+    pthread_cond_init(&(dev->run_cond), NULL);
     dev->frame_ofst = NULL;
-    dev->frame_ofst = (ssize_t *)malloc(dev->dma->mem_sz / TXRX_MTU_MIN); // maximum number of frame offsets
+    dev->max_frames = dev->dma->mem_sz / (TXRX_MTU_MIN) + 1; // all frames but the last one of a packet carry at least TXRX_MTU_MIN bytes
+    dev->reasm_budget = dev->dma->mem_sz / 2;
+    dev->frame_ofst = (ssize_t *)malloc(dev->max_frames * sizeof(ssize_t));
     if (dev->frame_ofst == NULL)
     {
         eprintf("Unable to allocate memory for frame offset");
         perror("malloc");
         return -1;
     }
-    dev->max_pack_sz = dev->dma->mem_sz;
+    dev->max_pack_sz = UINT32_MAX;
     return 1;
 }
 
-static void *rx_irq_thread(void *__dev)
+/**
+ * @brief Running state of the packet CRC32 check, advanced by the IRQ thread
+ * on each frame while the DMA engine fills the next one.
+ */
+typedef struct rx_pack_crc
 {
-    int retcode = 1;
-    rxmodem *dev = (rxmodem *)__dev;
-    rxmodem_reset(dev, dev->conf);
-    // clear memory for rx
-    memset(dev->dma->mem_virt_addr, 0x0, dev->dma->mem_sz);
-    // Clear FIFO contents in the beginning by toggling the RST pin
-    int fifo_rst_count = 0;
-    while ((rxmodem_fifo_rst() == EXIT_FAILURE) && (fifo_rst_count < 10))
-        fifo_rst_count++;
-    // set up for the first interrupt
-    if ((dev->retcode = rxmodem_start(dev)) < 0)
+    uint64_t pack_id;                  /// Packet ID of frame 0
+    uint32_t pack_sz;                  /// Packet size of frame 0
+    uint32_t num_frames;               /// Number of frames of frame 0, 0 if the packet ends with the frame flagged MODEM_FLAG_LAST
+    int lz;                            /// Compressed packet, the data size is only known at the end
+    int has_trailer;                   /// Compressed packet carries a CRC32 trailer
+    ssize_t prefix;                    /// Bytes of the packet stream ahead of the data
+    uint32_t crc;                      /// CRC32 of the data seen so far
+    ssize_t stream_ofst;               /// Offset of the next frame in the packet stream
+    int next_frame;                    /// Expected frame ID
+    int broken;                        /// Set on a missing or out of order frame
+    int trailer_len;                   /// Bytes of the trailer collected
+    uint8_t trailer[sizeof(uint32_t)]; /// CRC32 trailer sent after the data, the last bytes seen so far if compressed
+    int status;                        /// Packet CRC32 check once the last frame is in, see pack_crc_status
+} rx_pack_crc_t;
+
+/*
+ * Returns 1 if the frame is flagged as the last one of the packet. late is set
+ * if a data frame with a higher ID came in first, the check is then left to
+ * rxmodem_read.
+ */
+static int rx_pack_crc_update(rxmodem *dev, rx_pack_crc_t *st, ssize_t ofst, int frame_num, int late)
+{
+    modem_frame_info_t info[1];
+    st->broken |= late;
+    if ((modem_parse_frame_hdr(dev->dma->mem_virt_addr + ofst, info) < 0) || !(info->hdr_ok) || (info->frame_sz > TXRX_MTU_MAX))
     {
-        pthread_cond_signal(&rx_rcv);
-        goto rx_irq_thread_exit;
+        st->broken = 1;
+        return 0;
     }
-    ssize_t ofst = 0;
-    uint32_t frame_sz = 0;
-    int num_irq_timeout = 0;
-    int frame_num = 0;
-#ifdef RXDEBUG
-    static int loop_id = 0;
-#endif
-    while (!(dev->rx_done))
+    int last = (info->flags & MODEM_FLAG_LAST) != 0;
+    if ((info->frame_id == 0) && info->has_desc)
     {
-        if ((dev->retcode = uio_unmask_irq(dev->bus)) < 0)
-        {
-            pthread_cond_signal(&rx_rcv);
-            goto rx_irq_thread_exit;
-        }
-        if ((dev->retcode = uio_wait_irq(dev->bus, RXMODEM_TIMEOUT)) < 0)
+        memset(st, 0x0, sizeof(rx_pack_crc_t));
+        st->pack_id = info->pack_id;
+        st->pack_sz = info->pack_sz;
+        st->num_frames = info->num_frames;
+        st->lz = (info->flags & MODEM_FLAG_LZ) != 0;
+        st->has_trailer = (info->flags & MODEM_FLAG_PACK_CRC) != 0;
+        st->prefix = info->prefix;
+        st->broken = late; // frames after it came in first
+    }
+    if (info->pack_id != st->pack_id)
+    {
+        st->broken = 1;
+        return last;
+    }
+    if (info->frame_id & MODEM_FRAME_PARITY) // parity frames are not part of the packet stream
+        goto rx_pack_crc_check;
+    if (info->frame_id != st->next_frame)
+    {
+        st->broken = 1;
+        return last;
+    }
+    st->next_frame++;
+    uint8_t *payload = dev->dma->mem_virt_addr + ofst + info->hdr_sz;
+    ssize_t skip_sz = st->stream_ofst < st->prefix ? st->prefix - st->stream_ofst : 0; // packet descriptor
+    skip_sz = skip_sz < info->frame_sz ? skip_sz : info->frame_sz;
+    if (st->lz && st->has_trailer) // the last 4 bytes seen may be the trailer, hold them back
+    {
+        ssize_t len = info->frame_sz - skip_sz;
+        if (len >= (ssize_t)sizeof(uint32_t))
         {
-            pthread_cond_signal(&rx_rcv);
-            goto rx_irq_thread_exit;
+            st->crc = crc32_update(st->crc, st->trailer, st->trailer_len);
+            st->crc = crc32_update(st->crc, payload + skip_sz, len - sizeof(uint32_t));
+            memcpy(st->trailer, payload + info->frame_sz - sizeof(uint32_t), sizeof(uint32_t));
+            st->trailer_len = sizeof(uint32_t);
         }
-        else if (dev->retcode == 0)
+        for (ssize_t i = skip_sz; (len < (ssize_t)sizeof(uint32_t)) && (i < info->frame_sz); i++)
         {
-            num_irq_timeout++;
-            if (num_irq_timeout < NUM_IRQ_RETRIES)
-                continue;
-            else
-                goto rx_irq_thread_exit;
+            if (st->trailer_len == sizeof(uint32_t))
+            {
+                st->crc = crc32_update(st->crc, st->trailer, 1);
+                memmove(st->trailer, st->trailer + 1, sizeof(uint32_t) - 1);
+                st->trailer_len--;
+            }
+            st->trailer[st->trailer_len++] = payload[i];
         }
-        num_irq_timeout = 0;
-        uio_read(dev->bus, RXMODEM_PAYLOAD_LEN, &frame_sz);
-#ifdef RXDEBUG
-        eprintf("Payload length: %u", frame_sz);
-#endif
-        if ((frame_sz == 0) || (frame_sz == 0x1ffc) || (frame_sz > TXRX_MTU_MAX))
+    }
+    else if (st->lz)
+        st->crc = crc32_update(st->crc, payload + skip_sz, info->frame_sz - skip_sz);
+    else
+    {
+        ssize_t data_sz = st->stream_ofst + skip_sz < st->prefix + st->pack_sz ? st->prefix + st->pack_sz - st->stream_ofst - skip_sz : 0;
+        data_sz = data_sz < info->frame_sz - skip_sz ? data_sz : info->frame_sz - skip_sz;
+        st->crc = crc32_update(st->crc, payload + skip_sz, data_sz);
+        for (ssize_t i = skip_sz + data_sz; (i < info->frame_sz) && (st->trailer_len < (int)sizeof(uint32_t)); i++)
+            st->trailer[st->trailer_len++] = payload[i];
+    }
+    st->stream_ofst += info->frame_sz;
+rx_pack_crc_check:
+    if ((st->broken) || (st->num_frames ? (frame_num != st->num_frames) : !last)) // not the last frame, or a frame was lost and rxmodem_read has to rebuild it first
+        return last;
+    if (st->lz && (info->frame_id & MODEM_FRAME_PARITY)) // trailing data frames lost, the parity frames of the last block carry the stream size
+    {
+        modem_fec_header_t fec_hdr[1];
+        memcpy(fec_hdr, dev->dma->mem_virt_addr + ofst + info->hdr_sz, sizeof(modem_fec_header_t));
+        if (fec_hdr->stream_sz != st->stream_ofst)
+            return last;
+    }
+    int pack_crc_status = 0; // no trailer
+    if ((st->lz && st->has_trailer) || (!(st->lz) && (st->stream_ofst > st->prefix + st->pack_sz)))
+    {
+        uint32_t crc;
+        memcpy(&crc, st->trailer, sizeof(uint32_t));
+        if ((st->lz ? (st->trailer_len == sizeof(uint32_t)) : (st->stream_ofst - st->prefix - st->pack_sz == sizeof(uint32_t))) && (crc == st->crc))
+            pack_crc_status = 1;
+        else
         {
-            pthread_cond_signal(&rx_rcv);
-            eprintf("Received invalid frame size %u", frame_sz);
-            dev->retcode = RX_FRAME_INVALID;
-            goto rx_irq_thread_exit;
+            eprintf("Packet 0x%llx: Valid CRC32 = 0x%x, Calculated CRC32 = 0x%x", (unsigned long long)st->pack_id, crc, st->crc);
+            pack_crc_status = RX_PACK_CRC_FAILED;
         }
-        pthread_mutex_lock(&frame_ofst_m);
-        (dev->frame_ofst)[frame_num] = ofst;
-        pthread_mutex_unlock(&frame_ofst_m);
-#ifdef RXDEBUG
-        eprintf();
-#endif
-        (frame_num)++;
-#ifdef RXDEBUG
-        eprintf("Frame number: %d, loop ID: %d\n", frame_num, loop_id++);
-#endif
-        if (dev->rx_done)
-            break;
-        dev->retcode = adidma_read(dev->dma, ofst, frame_sz + sizeof(uint32_t));
-#ifdef RXDEBUG
-        eprintf();
-        fprint_frame_hdr(stdout, dev->dma->mem_virt_addr + ofst);
-        // char fnamebuf[256];
-        // snprintf(fnamebuf, 256, "out%d.txt", loop_id++);
-        // FILE *fp = fopen(fnamebuf, "wb");
-        // fwrite(dev->dma->mem_virt_addr + ofst, 1, frame_sz, fp);
-        // fclose(fp);
-#endif
-        pthread_mutex_lock(&(rx_write));
-        dev->frame_num = frame_num;
-        pthread_mutex_unlock(&(rx_write));
-        pthread_cond_signal(&rx_rcv);
-        ofst += frame_sz - (FRAME_PADDING) * sizeof(uint64_t);
     }
-rx_irq_thread_exit:
-#ifdef RXDEBUG
-    eprintf();
-#endif
-    rxmodem_stop(dev);
-    // dev->retcode = retcode;
-    return NULL;
+    st->status = pack_crc_status;
+    return last;
 }
 
 int rxmodem_start(rxmodem *dev)
@@ -296,189 +336,1518 @@ int rxmodem_stop(rxmodem *dev)
     return 1;
 }
 
-static inline void getwaittime(struct timespec *ts)
+static inline uint64_t rx_nsec()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000L + ((uint64_t)ts.tv_nsec);
+}
+
+static inline void getwaittime(struct timespec *ts, int tout_ms)
 {
-    clock_gettime(0, ts);
+    timespec_get(ts, TIME_UTC);
 #ifdef RXDEBUG
     eprintf("Wait_sec: %u, wait_nsec: %u", ts->tv_sec, ts->tv_nsec);
 #endif
-    ts->tv_sec += RXMODEM_TIMEOUT / 1000;
-    ts->tv_nsec += (RXMODEM_TIMEOUT % 1000) * 1000000;
+    ts->tv_sec += tout_ms / 1000;
+    ts->tv_nsec += (tout_ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
 }
 
-ssize_t rxmodem_receive(rxmodem *dev)
+/*
+ * The RX ring is free up to the first frame of the packet on loan, of the
+ * queued packets and of the packets being reassembled. Called with run_m held.
+ */
+static uint64_t rx_run_tail(rxmodem *dev)
 {
-    // Initialize timed wait
-    static struct timespec waitts; // = {.tv_sec = RXMODEM_TIMEOUT / 1000, .tv_nsec = (RXMODEM_TIMEOUT % 1000) * 1000000};
-    getwaittime(&waitts);
-    // printf("Wait_sec: %u, wait_nsec: %u\n", waitts.tv_sec, waitts.tv_nsec);
-    // initialize the RX thread
-    pthread_attr_t rx_thr_attr[1];
-    pthread_attr_init(rx_thr_attr);
-    pthread_attr_setdetachstate(rx_thr_attr, PTHREAD_CREATE_DETACHED);
+    uint64_t tail = dev->ring_head;
+    if (dev->loaned && (dev->loan_start < tail))
+        tail = dev->loan_start;
+    for (int i = 0; i < dev->queue_cnt; i++)
+    {
+        rxmodem_pack_t *p = &(dev->queue[(dev->queue_head + i) % RXMODEM_RUN_QUEUE]);
+        tail = p->start < tail ? p->start : tail;
+    }
+    for (int i = 0; i < RXMODEM_REASM_SLOTS; i++)
+    {
+        rxmodem_pack_t *p = &(dev->table[i]);
+        if ((p->frame_num > 0) && (p->start < tail))
+            tail = p->start;
+    }
+    return tail;
+}
+
+/*
+ * Keep the eventfd readable while packets are queued. Called with run_m held.
+ */
+static void rx_run_notify(rxmodem *dev)
+{
+    eventfd_t val;
+    if ((dev->queue_cnt > 0) && !(dev->fd_ready))
+        dev->fd_ready = eventfd_write(dev->fd, 1) == 0;
+    else if ((dev->queue_cnt == 0) && dev->fd_ready)
+        dev->fd_ready = eventfd_read(dev->fd, &val) != 0;
+}
+
+/*
+ * Forget the frames of a packet, keeping its arrays
+ */
+static void rx_pack_clear(rxmodem_pack_t *p)
+{
+    p->frame_num = 0;
+    p->num_frames = 0;
+    p->last_seen = 0;
+    p->pack_crc_status = 0;
+    p->bytes = 0;
+    if (p->data_map != NULL)
+        memset(p->data_map, 0x0, p->data_map_sz);
+    if (p->parity_map != NULL)
+        memset(p->parity_map, 0x0, p->parity_map_sz);
+}
+
+static void rx_pack_free(rxmodem_pack_t *p)
+{
+    free(p->frame_ofst);
+    free(p->frame_id);
+    free(p->data_map);
+    free(p->parity_map);
+    free(p->crc);
+    memset(p, 0x0, sizeof(rxmodem_pack_t));
+}
+
+/*
+ * Drop the i-th oldest queued packet. Called with run_m held.
+ */
+static void rx_run_drop(rxmodem *dev, int i)
+{
+    rxmodem_pack_t *p = &(dev->queue[(dev->queue_head + i) % RXMODEM_RUN_QUEUE]);
+    eprintf("Packet 0x%llx dropped, %d frames", (unsigned long long)p->pack_id, p->frame_num);
+    for (; i < dev->queue_cnt - 1; i++) // the later packets move up, the slot and its arrays move past the end
+    {
+        rxmodem_pack_t *a = &(dev->queue[(dev->queue_head + i) % RXMODEM_RUN_QUEUE]);
+        rxmodem_pack_t *b = &(dev->queue[(dev->queue_head + i + 1) % RXMODEM_RUN_QUEUE]);
+        rxmodem_pack_t tmp = *a;
+        *a = *b;
+        *b = tmp;
+    }
+    dev->queue_cnt--;
+    dev->num_dropped++;
+    rx_run_notify(dev);
+}
+
+/*
+ * Hand a packet of the reassembly table over to rxmodem_receive. The queue
+ * slot and the table entry swap their arrays. Called with run_m held.
+ */
+static void rx_run_queue(rxmodem *dev, rxmodem_pack_t *p)
+{
+    if (p->frame_num == 0)
+        return;
+    if (dev->queue_cnt == RXMODEM_RUN_QUEUE)
+        rx_run_drop(dev, 0);
+    rxmodem_pack_t *q = &(dev->queue[(dev->queue_head + dev->queue_cnt) % RXMODEM_RUN_QUEUE]);
+    rxmodem_pack_t tmp = *q;
+    *q = *p;
+    *p = tmp;
+    rx_pack_clear(p);
+    dev->reasm_done[dev->reasm_done_head] = q->pack_id;
+    dev->reasm_done_ns[dev->reasm_done_head] = rx_nsec();
+    dev->reasm_done_head = (dev->reasm_done_head + 1) % RXMODEM_REASM_SLOTS;
+    dev->queue_cnt++;
+    rx_run_notify(dev);
+    pthread_cond_broadcast(&(dev->run_cond));
+}
+
+/*
+ * Hand every packet of the reassembly table over. Called with run_m held.
+ */
+static void rx_run_flush(rxmodem *dev)
+{
+    for (int i = 0; i < RXMODEM_REASM_SLOTS; i++)
+        rx_run_queue(dev, &(dev->table[i]));
+}
+
+/*
+ * Drop an incomplete packet of the reassembly table. Called with run_m held.
+ */
+static void rx_run_evict(rxmodem *dev, rxmodem_pack_t *p, const char *reason)
+{
+    eprintf("Packet 0x%llx evicted (%s), %d frames", (unsigned long long)p->pack_id, reason, p->frame_num);
+    rx_pack_clear(p);
+    dev->num_evicted++;
+}
+
+/*
+ * Least recently updated packet of the reassembly table other than keep, NULL
+ * if there is none
+ */
+static rxmodem_pack_t *rx_run_lru(rxmodem *dev, rxmodem_pack_t *keep)
+{
+    rxmodem_pack_t *lru = NULL;
+    for (int i = 0; i < RXMODEM_REASM_SLOTS; i++)
+    {
+        rxmodem_pack_t *p = &(dev->table[i]);
+        if ((p->frame_num > 0) && (p != keep) && ((lru == NULL) || (p->last_ns < lru->last_ns)))
+            lru = p;
+    }
+    return lru;
+}
+
+/*
+ * Hand over the packets of the reassembly table that timed out, then evict
+ * the least recently updated ones but keep while the rest take more than
+ * reasm_budget bytes of the RX ring. Called with run_m held.
+ */
+static void rx_run_expire(rxmodem *dev, rxmodem_pack_t *keep)
+{
+    uint64_t now = rx_nsec(), bytes = 0;
+    for (int i = 0; i < RXMODEM_REASM_SLOTS; i++)
+    {
+        rxmodem_pack_t *p = &(dev->table[i]);
+        if (p->frame_num == 0)
+            continue;
+        if (now - p->last_ns > (p->last_seen ? RXMODEM_RUN_POLL_MS : RXMODEM_PACK_TIMEOUT) * 1000000LL) // a frame before the last one is lost or late
+        {
+            eprintf("Packet 0x%llx timed out, %d frames", (unsigned long long)p->pack_id, p->frame_num);
+            dev->num_timeouts++;
+            rx_run_queue(dev, p);
+            continue;
+        }
+        bytes += p->bytes;
+    }
+    rxmodem_pack_t *p;
+    while ((bytes > dev->reasm_budget) && ((p = rx_run_lru(dev, keep)) != NULL))
+    {
+        bytes -= p->bytes;
+        rx_run_evict(dev, p, "over budget");
+    }
+}
+
+/*
+ * The last frame of a packet is in and no data frame is missing up to the last
+ * one received, or parity frames came in to rebuild the missing ones
+ */
+static inline int rx_pack_ready(rxmodem_pack_t *p)
+{
+    int n = 0;
+    while ((n < p->frame_num) && !(p->frame_id[n] & MODEM_FRAME_PARITY))
+        n++;
+    return p->last_seen && ((n == 0) || (n < p->frame_num) || (p->frame_id[n - 1] == (uint32_t)(n - 1)));
+}
+
+/*
+ * Reserve room for a frame of frame_sz bytes at the head of the RX ring. A
+ * frame does not wrap around the end of the DMA buffer. If the consumer fell
+ * behind, the queued packets or the packets being reassembled that hold the
+ * oldest frames are dropped, and if that is the one on loan the engine waits
+ * for it to be released. Called with run_m held. Returns 1 with the ring
+ * position of the frame in pos, 0 if the engine is stopped.
+ */
+static int rx_run_alloc(rxmodem *dev, uint32_t frame_sz, uint64_t *pos)
+{
+    uint64_t size = dev->dma->mem_sz;
+    uint64_t need = frame_sz + sizeof(uint32_t); // frames are read with 4 bytes past their end
+    uint64_t adv = (need + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    int full = 0;
+    while (!(dev->rx_done))
+    {
+        uint64_t ofst = dev->ring_head % size;
+        uint64_t skip = ofst + need > size ? size - ofst : 0;
+        uint64_t tail = rx_run_tail(dev);
+        if (dev->ring_head + skip + adv - tail <= size)
+        {
+            *pos = dev->ring_head + skip;
+            dev->ring_head = *pos + adv;
+            if (dev->ring_head - tail > dev->ring_hwm)
+                dev->ring_hwm = dev->ring_head - tail;
+            return 1;
+        }
+        if (!full)
+        {
+            full = 1;
+            dev->num_overflows++;
+        }
+        int i;
+        for (i = 0; (i < dev->queue_cnt) && (dev->queue[(dev->queue_head + i) % RXMODEM_RUN_QUEUE].start != tail); i++)
+            ;
+        if (i < dev->queue_cnt)
+        {
+            rx_run_drop(dev, i);
+            continue;
+        }
+        for (i = 0; (i < RXMODEM_REASM_SLOTS) && ((dev->table[i].frame_num == 0) || (dev->table[i].start != tail)); i++)
+            ;
+        if (i < RXMODEM_REASM_SLOTS)
+        {
+            rx_run_evict(dev, &(dev->table[i]), "RX ring full");
+            continue;
+        }
+        struct timespec waitts;
+        getwaittime(&waitts, RXMODEM_RUN_POLL_MS);
+        pthread_cond_timedwait(&(dev->run_cond), &(dev->run_m), &waitts);
+    }
+    return 0;
+}
+
+/*
+ * Set a bit of a bitmap, growing it as needed. Returns 1 if the bit was clear,
+ * 0 if it was set already, negative on error.
+ */
+static int rx_map_set(uint8_t **map, size_t *map_sz, size_t bit)
+{
+    if (bit / 8 >= *map_sz)
+    {
+        size_t sz = *map_sz ? *map_sz : 16;
+        while (bit / 8 >= sz)
+            sz *= 2;
+        uint8_t *m = (uint8_t *)realloc(*map, sz);
+        if (m == NULL)
+            return RX_MALLOC_FAILED;
+        memset(m + *map_sz, 0x0, sz - *map_sz);
+        *map = m;
+        *map_sz = sz;
+    }
+    if ((*map)[bit / 8] & (1 << (bit % 8)))
+        return 0;
+    (*map)[bit / 8] |= 1 << (bit % 8);
+    return 1;
+}
+
+/*
+ * Reassembly table entry of a packet ID. A new packet takes a free entry, or
+ * the least recently updated one which is evicted. Called with run_m held.
+ */
+static rxmodem_pack_t *rx_run_entry(rxmodem *dev, uint64_t pack_id)
+{
+    rxmodem_pack_t *empty = NULL;
+    for (int i = 0; i < RXMODEM_REASM_SLOTS; i++)
+    {
+        rxmodem_pack_t *p = &(dev->table[i]);
+        if ((p->frame_num > 0) && (p->pack_id == pack_id))
+            return p;
+        if ((p->frame_num == 0) && (empty == NULL))
+            empty = p;
+    }
+    if (empty == NULL)
+    {
+        empty = rx_run_lru(dev, NULL);
+        rx_run_evict(dev, empty, "table full");
+    }
+    return empty;
+}
+
+/*
+ * Add a frame with a valid header that landed at ring position pos, taking
+ * bytes of the RX ring, to its packet in the reassembly table. Data frames are
+ * kept by frame ID, the parity frames after them by block. late is set if a
+ * data frame with a higher ID came in first. Called with run_m held. Returns
+ * the packet, NULL if the frame is a duplicate or unusable.
+ */
+static rxmodem_pack_t *rx_run_insert(rxmodem *dev, modem_frame_info_t *info, uint64_t pos, uint64_t bytes, int *late)
+{
+    ssize_t ofst = pos % dev->dma->mem_sz;
+    int parity = (info->frame_id & MODEM_FRAME_PARITY) != 0;
+    size_t bit = info->frame_id & ~MODEM_FRAME_PARITY;
+    if (bit >= (size_t)dev->max_frames) // not a frame of a packet that fits in the DMA buffer
+        return NULL;
+    if (parity)
+    {
+        modem_fec_header_t fec_hdr[1];
+        if (info->frame_sz < sizeof(modem_fec_header_t))
+            return NULL;
+        memcpy(fec_hdr, dev->dma->mem_virt_addr + ofst + info->hdr_sz, sizeof(modem_fec_header_t));
+        if (fec_hdr->idx >= FEC_MAX_SHARDS)
+            return NULL;
+        bit = bit * FEC_MAX_SHARDS + fec_hdr->idx;
+    }
+    uint64_t now = rx_nsec();
+    for (int i = 0; i < RXMODEM_REASM_SLOTS; i++)
+    {
+        if ((dev->reasm_done[i] != info->pack_id) || (now - dev->reasm_done_ns[i] > RXMODEM_PACK_TIMEOUT * 1000000LL))
+            continue;
+        if ((info->frame_id == 0) && info->has_desc) // packet IDs are reused, by a restarted transmitter as well
+        {
+            dev->reasm_done[i] = UINT64_MAX;
+            continue;
+        }
+        dev->num_dups++; // late frame of a packet handed over
+        return NULL;
+    }
+    rxmodem_pack_t *p = rx_run_entry(dev, info->pack_id);
+    if (p->frame_num == 0)
+    {
+        if ((p->crc == NULL) && ((p->crc = (rx_pack_crc_t *)malloc(sizeof(rx_pack_crc_t))) == NULL))
+            return NULL;
+        memset(p->crc, 0x0, sizeof(rx_pack_crc_t));
+        p->crc->broken = 1; // until frame 0 arrives
+        p->pack_id = info->pack_id;
+        p->start = pos;
+    }
+    int ret = parity ? rx_map_set(&(p->parity_map), &(p->parity_map_sz), bit) : rx_map_set(&(p->data_map), &(p->data_map_sz), bit);
+    if (ret == 0)
+        dev->num_dups++;
+    if (ret <= 0)
+        return NULL;
+    if (p->frame_num == p->max_frames)
+    {
+        int max_frames = p->max_frames ? 2 * p->max_frames : 16;
+        ssize_t *frame_ofst = (ssize_t *)realloc(p->frame_ofst, max_frames * sizeof(ssize_t));
+        if (frame_ofst != NULL)
+            p->frame_ofst = frame_ofst;
+        uint32_t *frame_id = (uint32_t *)realloc(p->frame_id, max_frames * sizeof(uint32_t));
+        if (frame_id != NULL)
+            p->frame_id = frame_id;
+        if ((frame_ofst == NULL) || (frame_id == NULL))
+        {
+            eprintf("Unable to allocate memory for frame offsets");
+            return NULL;
+        }
+        p->max_frames = max_frames;
+    }
+    int i = p->frame_num;
+    for (; (i > 0) && (p->frame_id[i - 1] > info->frame_id); i--) // frames mostly arrive in order
+    {
+        p->frame_ofst[i] = p->frame_ofst[i - 1];
+        p->frame_id[i] = p->frame_id[i - 1];
+    }
+    *late = !parity && (i < p->frame_num) && !(p->frame_id[i + 1] & MODEM_FRAME_PARITY);
+    p->frame_ofst[i] = ofst;
+    p->frame_id[i] = info->frame_id;
+    p->frame_num++;
+    p->bytes += bytes;
+    p->last_ns = rx_nsec();
+    if (info->has_desc)
+        p->num_frames = info->num_frames;
+    return p;
+}
+
+/*
+ * Reset the modem and the RX FIFO and arm the modem
+ */
+static int rx_run_arm(rxmodem *dev)
+{
+    rxmodem_write_conf(dev, dev->conf);
+    // Clear FIFO contents by toggling the RST pin
+    int fifo_rst_count = 0;
+    while ((rxmodem_fifo_rst() == EXIT_FAILURE) && (fifo_rst_count < 10))
+        fifo_rst_count++;
+    return rxmodem_start(dev);
+}
+
+/*
+ * Pass a frame that landed at ofst to a RXMODEM_HANDLER_FRAMES handler. info
+ * is NULL if the frame header is invalid.
+ */
+static void rx_run_frame(rxmodem *dev, rxmodem_handler_t handler, void *user, ssize_t ofst, uint32_t frame_sz, modem_frame_info_t *info)
+{
+    rxmodem_event_t ev[1];
+    memset(ev, 0x0, sizeof(rxmodem_event_t));
+    ev->frame_id = -1;
+    ev->status = RX_FRAME_HDR_CRC_MISMATCH;
+    if ((info != NULL) && (info->hdr_sz + info->frame_sz <= frame_sz))
+    {
+        const uint8_t *payload = dev->dma->mem_virt_addr + ofst + info->hdr_sz;
+        ev->data = payload;
+        ev->size = info->frame_sz;
+        ev->pack_sz = info->has_desc ? info->pack_sz : 0;
+        ev->pack_id = info->pack_id;
+        ev->frame_id = info->frame_id;
+        ev->flags = info->flags;
+        ev->status = crc16_final(crc16_update(CRC16_INIT, payload, info->frame_sz)) == info->frame_crc ? 1 : RX_FRAME_CRC_FAILED;
+    }
+    handler(ev, user);
+}
+
+static void *rx_run_thread(void *__dev)
+{
+    rxmodem *dev = (rxmodem *)__dev;
+    uint64_t size = dev->dma->mem_sz;
+    uint32_t frame_sz = 0;
+    int retcode = 1;
+    while (!(dev->rx_done))
+    {
+        if ((retcode = uio_unmask_irq(dev->bus)) < 0)
+            break;
+        if ((retcode = uio_wait_irq(dev->bus, RXMODEM_RUN_POLL_MS)) < 0)
+            break;
+        if (retcode == 0) // no frame, hand over incomplete packets once they timed out
+        {
+            pthread_mutex_lock(&(dev->run_m));
+            rx_run_expire(dev, NULL);
+            pthread_mutex_unlock(&(dev->run_m));
+            continue;
+        }
+        uio_read(dev->bus, RXMODEM_PAYLOAD_LEN, &frame_sz);
+#ifdef RXDEBUG
+        eprintf("Payload length: %u", frame_sz);
+#endif
+        if ((frame_sz == 0) || (frame_sz == 0x1ffc) || (frame_sz > TXRX_MTU_MAX))
+        {
+            eprintf("Received invalid frame size %u, resetting", frame_sz);
+            pthread_mutex_lock(&(dev->run_m));
+            rx_run_flush(dev);
+            pthread_mutex_unlock(&(dev->run_m));
+            if ((retcode = rx_run_arm(dev)) < 0)
+                break;
+            continue;
+        }
+        uint64_t pos;
+        pthread_mutex_lock(&(dev->run_m));
+        int ok = rx_run_alloc(dev, frame_sz, &pos);
+        uint64_t bytes = dev->ring_head - pos;
+        rxmodem_handler_t frame_handler = (dev->handler_flags & RXMODEM_HANDLER_FRAMES) ? dev->handler : NULL;
+        void *frame_user = dev->handler_user;
+        pthread_mutex_unlock(&(dev->run_m));
+        if (!ok)
+            break;
+        ssize_t ofst = pos % size;
+        modem_frame_info_t info[1];
+        if ((retcode = adidma_read(dev->dma, ofst, frame_sz + sizeof(uint32_t))) <= 0)
+        {
+            eprintf("DMA read error %d", retcode);
+            pthread_mutex_lock(&(dev->run_m));
+            dev->ring_head = pos; // the frame is lost
+            pthread_mutex_unlock(&(dev->run_m));
+            continue;
+        }
+#ifdef RXDEBUG
+        fprint_frame_hdr(stdout, dev->dma->mem_virt_addr + ofst);
+#endif
+        int hdr_ok = (modem_parse_frame_hdr(dev->dma->mem_virt_addr + ofst, info) > 0) && info->hdr_ok && (info->hdr_sz + info->frame_sz <= frame_sz);
+        if (frame_handler != NULL) // streaming, the frame is free again once the handler returns
+        {
+            pthread_mutex_lock(&(dev->run_m));
+            rx_run_flush(dev);
+            frame_handler = (dev->handler_flags & RXMODEM_HANDLER_FRAMES) ? dev->handler : NULL; // may have been removed meanwhile
+            frame_user = dev->handler_user;
+            dev->handler_busy = (frame_handler != NULL);
+            pthread_mutex_unlock(&(dev->run_m));
+            if (frame_handler == NULL)
+                continue;
+            rx_run_frame(dev, frame_handler, frame_user, ofst, frame_sz, hdr_ok ? info : NULL);
+            pthread_mutex_lock(&(dev->run_m));
+            dev->handler_busy = 0;
+            pthread_cond_broadcast(&(dev->run_cond)); // rxmodem_set_handler waits for the call to return
+            pthread_mutex_unlock(&(dev->run_m));
+            continue;
+        }
+        pthread_mutex_lock(&(dev->run_m));
+        int late = 0;
+        rxmodem_pack_t *p = hdr_ok ? rx_run_insert(dev, info, pos, bytes, &late) : NULL;
+        if (p == NULL) // belongs to no packet, or a duplicate
+            dev->ring_head = pos;
+        else
+        {
+            int last = rx_pack_crc_update(dev, p->crc, ofst, p->frame_num, late); // verify the packet CRC32 as frames land, rxmodem_read checks reordered packets
+            p->last_seen |= last;
+            p->pack_crc_status = p->crc->status;
+#ifdef RXDEBUG
+            eprintf("Packet 0x%llx: frame %d of %d", (unsigned long long)p->pack_id, p->frame_num, p->num_frames);
+#endif
+            if (((p->num_frames > 0) && (p->frame_num >= p->num_frames)) || rx_pack_ready(p) || (p->frame_num == dev->max_frames))
+                rx_run_queue(dev, p);
+        }
+        rx_run_expire(dev, p);
+        pthread_mutex_unlock(&(dev->run_m));
+    }
+    rxmodem_stop(dev);
+    pthread_mutex_lock(&(dev->run_m));
+    if (!(dev->rx_done))
+    {
+        eprintf("RX engine stopped on error %d", retcode);
+        dev->retcode = retcode < 0 ? retcode : RX_FRAME_INVALID;
+    }
+    pthread_cond_broadcast(&(dev->run_cond));
+    pthread_mutex_unlock(&(dev->run_m));
+    return NULL;
+}
+
+int rxmodem_run(rxmodem *dev)
+{
+    if (dev->running)
+        return 1;
+    dev->queue = (rxmodem_pack_t *)calloc(RXMODEM_RUN_QUEUE, sizeof(rxmodem_pack_t));
+    if (dev->queue == NULL)
+    {
+        eprintf("Unable to allocate memory for the packet queue");
+        return RX_MALLOC_FAILED;
+    }
+    memset(dev->table, 0x0, sizeof(dev->table));
+    memset(dev->reasm_done, 0xff, sizeof(dev->reasm_done));
+    memset(dev->reasm_done_ns, 0x0, sizeof(dev->reasm_done_ns));
+    dev->reasm_done_head = 0;
+    dev->queue_head = 0;
+    dev->queue_cnt = 0;
+    dev->loaned = 0;
+    dev->ring_head = 0;
+    dev->num_packs = 0;
+    dev->num_dropped = 0;
+    dev->num_evicted = 0;
+    dev->num_timeouts = 0;
+    dev->num_dups = 0;
+    dev->num_overflows = 0;
+    dev->ring_hwm = 0;
     dev->rx_done = 0;
-    int rc = pthread_create((dev->thr), rx_thr_attr, &rx_irq_thread, (void *)dev);
+    dev->frame_num = 0;
+    dev->last_seen = 0;
+    dev->pack_flags = 0;
+    dev->pack_crc_status = 0;
+    // clear memory for rx
+    memset(dev->dma->mem_virt_addr, 0x0, dev->dma->mem_sz);
+    int ret = rx_run_arm(dev);
+    if (ret < 0)
+    {
+        free(dev->queue);
+        return ret;
+    }
+    dev->retcode = 1;
+    int rc = pthread_create(dev->thr, NULL, &rx_run_thread, (void *)dev);
     if (rc != 0)
     {
-        eprintf("Unable to initialize interrupt monitor thread for TX");
+        eprintf("Unable to start the RX engine thread");
         perror("pthread_create");
+        rxmodem_stop(dev);
+        free(dev->queue);
         return RX_THREAD_SPAWN;
     }
-    // first wait
+    dev->running = 1;
+    return 1;
+}
+
+void rxmodem_halt(rxmodem *dev)
+{
+    if (!(dev->running))
+        return;
+    pthread_mutex_lock(&(dev->run_m));
+    dev->rx_done = 1;
+    pthread_cond_broadcast(&(dev->run_cond));
+    pthread_mutex_unlock(&(dev->run_m));
+    pthread_join(dev->thr[0], NULL);
+    pthread_mutex_lock(&(dev->run_m));
+    dev->running = 0;
+    dev->queue_cnt = 0;
+    rx_run_notify(dev);
+    pthread_mutex_unlock(&(dev->run_m));
+    for (int i = 0; i < RXMODEM_RUN_QUEUE; i++)
+        rx_pack_free(&(dev->queue[i]));
+    for (int i = 0; i < RXMODEM_REASM_SLOTS; i++)
+        rx_pack_free(&(dev->table[i]));
+    free(dev->queue);
+    dev->queue = NULL;
+}
+
+/*
+ * Parse a parity frame at ofst with a valid header and CRC and a usable FEC
+ * header. Returns 1 with the headers in info and fec_hdr, 0 otherwise.
+ */
+static int rx_parity_frame(rxmodem *dev, ssize_t ofst, modem_frame_info_t *info, modem_fec_header_t *fec_hdr)
+{
+    if ((modem_parse_frame_hdr(dev->dma->mem_virt_addr + ofst, info) < 0) || !(info->frame_id & MODEM_FRAME_PARITY) || !(info->hdr_ok) ||
+        (info->frame_sz < sizeof(modem_fec_header_t) + (TXRX_MTU_MIN)) || (info->frame_sz > TXRX_MTU_MAX))
+        return 0;
+    uint8_t *payload = dev->dma->mem_virt_addr + ofst + info->hdr_sz;
+    if (crc16_final(crc16_update(CRC16_INIT, payload, info->frame_sz)) != info->frame_crc)
+        return 0;
+    memcpy(fec_hdr, payload, sizeof(modem_fec_header_t));
+    return (fec_hdr->n > 0) && (fec_hdr->k > 0) && (fec_hdr->n + fec_hdr->k <= FEC_MAX_SHARDS);
+}
+
+/*
+ * Rebuild frame 0 of a packet from the frames of block 0 into the mtu sized
+ * shard. Returns 1 on success, 0 if too many frames of the block are lost.
+ */
+static int rx_fec_frame0(rxmodem *dev, modem_frame_info_t *ref, ssize_t mtu, uint8_t *shard)
+{
+    uint8_t *data[FEC_MAX_SHARDS];
+    const uint8_t *parity[FEC_MAX_SHARDS];
+    int data_ok[FEC_MAX_SHARDS] = {0}, parity_idx[FEC_MAX_SHARDS];
+    int n = 0, k = 0, num_parity = 0, ret = 0;
+    ssize_t stream_sz = 0;
+    uint8_t *scratch = NULL;
+    for (int pass = 0; pass < 2; pass++) // block 0 parity frames give the block size, then the data frames are collected
+    {
+        for (int i = 0; i < dev->frame_num; i++)
+        {
+            modem_frame_info_t frame_hdr[1];
+            modem_fec_header_t fec_hdr[1];
+            ssize_t ofst = (dev->frame_ofst)[i];
+            if (pass == 0)
+            {
+                if (!rx_parity_frame(dev, ofst, frame_hdr, fec_hdr) || (frame_hdr->frame_id != MODEM_FRAME_PARITY) || (frame_hdr->pack_id != ref->pack_id) ||
+                    (frame_hdr->frame_sz != sizeof(modem_fec_header_t) + mtu) || ((n > 0) && ((fec_hdr->n != n) || (fec_hdr->k != k))) || (fec_hdr->idx >= fec_hdr->k))
+                    continue;
+                n = fec_hdr->n;
+                k = fec_hdr->k;
+                stream_sz = fec_hdr->stream_sz;
+                parity[num_parity] = dev->dma->mem_virt_addr + ofst + frame_hdr->hdr_sz + sizeof(modem_fec_header_t);
+                parity_idx[num_parity++] = fec_hdr->idx;
+                continue;
+            }
+            if ((modem_parse_frame_hdr(dev->dma->mem_virt_addr + ofst, frame_hdr) < 0) || !(frame_hdr->hdr_ok) || (frame_hdr->pack_id != ref->pack_id) ||
+                (frame_hdr->frame_id >= (uint32_t)n) || (frame_hdr->frame_sz > mtu))
+                continue;
+            uint8_t *payload = dev->dma->mem_virt_addr + ofst + frame_hdr->hdr_sz;
+            if (crc16_final(crc16_update(CRC16_INIT, payload, frame_hdr->frame_sz)) != frame_hdr->frame_crc)
+                continue;
+            memcpy(data[frame_hdr->frame_id], payload, frame_hdr->frame_sz); // zero padded for encoding
+            data_ok[frame_hdr->frame_id] = 1;
+        }
+        if ((pass == 0) && ((num_parity == 0) || ((scratch = (uint8_t *)calloc(n, mtu)) == NULL)))
+            return 0;
+        for (int j = 0; (pass == 0) && (j < n); j++)
+            data[j] = scratch + j * mtu;
+    }
+    int block_sz = (stream_sz + mtu - 1) / mtu; // the stream may end in block 0
+    block_sz = block_sz < n ? block_sz : n;
+    if ((block_sz > 0) && (fec_decode(block_sz, data, data_ok, parity, parity_idx, num_parity, mtu) >= 0))
+    {
+        memcpy(shard, data[0], mtu);
+        ret = 1;
+    }
+    free(scratch);
+    return ret;
+}
+
+/*
+ * Packet fields of a packet whose frame 0 was lost or damaged, from a parity
+ * frame: packet ID, flags and MTU from its header, the size from its FEC
+ * header. A compressed packet only carries its size in the descriptor, which
+ * is rebuilt from block 0. Returns 1 with the fields in info, 0 if no parity
+ * frame is usable.
+ */
+static int rx_parity_desc(rxmodem *dev, modem_frame_info_t *info)
+{
+    modem_fec_header_t fec_hdr[1];
+    int i;
+    for (i = 0; i < dev->frame_num; i++)
+    {
+        ssize_t ofst = (dev->frame_ofst)[i];
+        if (rx_parity_frame(dev, ofst, info, fec_hdr))
+            break;
+    }
+    if (i == dev->frame_num)
+        return 0;
+    ssize_t mtu = info->frame_sz - sizeof(modem_fec_header_t);
+    ssize_t trailer_sz = ((info->version == MODEM_HDR_V1) || (info->flags & MODEM_FLAG_PACK_CRC)) ? sizeof(uint32_t) : 0;
+    if (info->flags & MODEM_FLAG_LZ)
+    {
+        modem_packet_desc_t desc[1];
+        uint8_t *shard = (uint8_t *)malloc(mtu);
+        int ok = (shard != NULL) && rx_fec_frame0(dev, info, mtu, shard);
+        if (ok)
+            memcpy(desc, shard, sizeof(modem_packet_desc_t));
+        free(shard);
+        if (!ok || (desc->mtu != mtu))
+            return 0;
+        info->pack_sz = desc->pack_sz;
+        info->num_frames = desc->num_frames;
+    }
+    else
+    {
+        if (fec_hdr->stream_sz < info->prefix + trailer_sz)
+            return 0;
+        ssize_t num_data_frames = (fec_hdr->stream_sz + mtu - 1) / mtu;
+        info->pack_sz = fec_hdr->stream_sz - info->prefix - trailer_sz;
+        info->num_frames = num_data_frames + ((num_data_frames + fec_hdr->n - 1) / fec_hdr->n) * fec_hdr->k;
+    }
+    info->has_desc = 1;
+    info->mtu = mtu;
+    info->frame_sz = mtu;
+    info->frame_id = 0;
+    return 1;
+}
+
+/*
+ * rxmodem_receive, waiting for up to tout_ms
+ */
+static ssize_t rxmodem_receive_tout(rxmodem *dev, int tout_ms)
+{
+    int retcode = 0;
+    if (dev->running && (dev->retcode < 0)) // the engine stopped on an error, reported by the last call
+        rxmodem_halt(dev);
+    if (!(dev->running) && ((retcode = rxmodem_run(dev)) < 0))
+        return retcode;
+    retcode = 0;
+    // Initialize timed wait
+    struct timespec waitts;
+    getwaittime(&waitts, tout_ms);
+    rxmodem_release(dev);
+    pthread_mutex_lock(&(dev->run_m));
 #ifdef RXDEBUG
     eprintf("Waiting...");
 #endif
-    int retcode = pthread_cond_timedwait(&rx_rcv, &rx_rcv_m, &waitts);
-    if (retcode)
+    while ((dev->queue_cnt == 0) && (dev->retcode > 0) && (retcode == 0))
+        retcode = pthread_cond_timedwait(&(dev->run_cond), &(dev->run_m), &waitts);
+    if (dev->queue_cnt == 0)
     {
-        retcode = -retcode;
-        goto rxmodem_receive_end;
+        retcode = retcode ? -retcode : dev->retcode;
+        pthread_mutex_unlock(&(dev->run_m));
+        if (retcode != -ETIMEDOUT)
+        {
+            eprintf("Received error %d", retcode);
+        }
+        return retcode;
     }
-    // pthread_cond_wait(&rx_rcv, &rx_rcv_m);
+    rxmodem_pack_t *p = &(dev->queue[dev->queue_head]);
+    memcpy(dev->frame_ofst, p->frame_ofst, p->frame_num * sizeof(ssize_t));
+    dev->frame_num = p->frame_num;
+    dev->last_seen = p->last_seen;
+    dev->pack_crc_status = p->pack_crc_status;
+    dev->loaned = 1;
+    dev->loan_start = p->start;
+    dev->pack_id = p->pack_id;
+    dev->queue_head = (dev->queue_head + 1) % RXMODEM_RUN_QUEUE;
+    dev->queue_cnt--;
+    dev->num_packs++;
+    rx_run_notify(dev);
+    pthread_mutex_unlock(&(dev->run_m));
 #ifdef RXDEBUG
-    eprintf("Wait over!");
+    eprintf("Packet 0x%llx: %d frames", (unsigned long long)p->pack_id, dev->frame_num);
 #endif
-    // check for retcode
-    retcode = dev->retcode;
-    if (retcode <= 0)
+    dev->pack_flags = 0;
+    memset(&(dev->lz_stats), 0x0, sizeof(lz_stats_t));
+    // get total number of frames from the first frame, v1 and v2 headers are accepted
+    modem_frame_info_t frame_hdr[1];
+    uint8_t *first = dev->dma->mem_virt_addr + dev->frame_ofst[0];
+    int hdr_version = modem_parse_frame_hdr(first, frame_hdr);
+    if ((hdr_version == MODEM_HDR_V2) && (!(frame_hdr->has_desc) || !(frame_hdr->hdr_ok) || (frame_hdr->frame_id != 0) ||
+                                          (crc16_final(crc16_update(CRC16_INIT, first + frame_hdr->hdr_sz, frame_hdr->frame_sz)) != frame_hdr->frame_crc)))
     {
-        eprintf("Received error %d", retcode);
-        dev->rx_done = 1;
-        goto rxmodem_receive_end;
+        int recovered = rx_parity_desc(dev, frame_hdr); // frame 0 lost or damaged, the parity frames carry the packet fields
+        if (recovered)
+        {
+            eprintf("Packet 0x%llx: frame 0 lost, packet fields from the parity frames", (unsigned long long)frame_hdr->pack_id);
+        }
     }
-    // get total number of frames
-    modem_frame_header_t frame_hdr[1];
-    memcpy(frame_hdr, dev->dma->mem_virt_addr, sizeof(modem_frame_header_t));
     // check for things
-    if (frame_hdr->ident != PACKET_GUID)
+    if (hdr_version < 0)
     {
-        eprintf("Packet GUID does not match: 0x%x", frame_hdr->ident);
-        dev->rx_done = 1;
-        retcode = RX_INVALID_GUID;
-        goto rxmodem_receive_end;
+        uint32_t ident;
+        memcpy(&ident, first, sizeof(uint32_t));
+        eprintf("Packet GUID does not match: 0x%x", ident);
+        return RX_INVALID_GUID;
     }
-    else if ((frame_hdr->pack_sz == 0) || (frame_hdr->pack_sz > dev->dma->mem_sz))
+    else if (!(frame_hdr->has_desc) || ((hdr_version == MODEM_HDR_V2) && !(frame_hdr->hdr_ok))) // v2 packet fields are only in frame 0
+    {
+        eprintf("First frame does not carry a valid packet descriptor");
+        return RX_FRAME_INVALID;
+    }
+    else if ((frame_hdr->pack_sz == 0) || (frame_hdr->pack_sz > dev->max_pack_sz) || (!(frame_hdr->flags & MODEM_FLAG_LZ) && (frame_hdr->pack_sz > dev->dma->mem_sz))) // only the compressed stream has to fit in the RX ring
     {
         eprintf("Packet size %u", frame_hdr->pack_sz);
-        dev->rx_done = 1;
-        retcode = RX_PACK_SZ_ZERO;
-        goto rxmodem_receive_end;
+        return RX_PACK_SZ_ZERO;
     }
-    else if (frame_hdr->num_frames == 0)
+    else if ((frame_hdr->num_frames == 0) && !(frame_hdr->flags & MODEM_FLAG_LZ)) // compressed packets end with the frame flagged MODEM_FLAG_LAST
     {
         eprintf("Invalid number of frames!");
-        dev->rx_done = 1;
-        retcode = RX_NUM_FRAMES_ZERO;
-        goto rxmodem_receive_end;
+        return RX_NUM_FRAMES_ZERO;
     }
     else if ((frame_hdr->frame_sz == 0) || (frame_hdr->frame_sz > TXRX_MTU_MAX))
     {
         eprintf("Invalid start frame size!");
-        dev->rx_done = 1;
-        retcode = RX_FRAME_SZ_ZERO;
-        goto rxmodem_receive_end;
+        return RX_FRAME_SZ_ZERO;
     }
     else if ((frame_hdr->mtu < TXRX_MTU_MIN) || (frame_hdr->mtu > TXRX_MTU_MAX))
     {
         eprintf("Invalid MTU %x!\n", frame_hdr->mtu);
-        dev->rx_done = 1;
-        retcode = RX_FRAME_INVALID;
-        goto rxmodem_receive_end;
+        return RX_FRAME_INVALID;
     }
     // everything for the first header is a success!
-    int num_frames = frame_hdr->num_frames;
-#ifdef RXDEBUG
-    eprintf("Number of frames to be received: %d\n", num_frames);
-#endif
-    // getwaittime(&waitts);
-    // pthread_cond_timedwait(&rx_rcv, &rx_rcv_m, &waitts); // wait for return
-    // if (dev->retcode < 0)
-    //     retcode = dev->retcode;
-    int frame_num = 0;
-    while (1)
-    {
-        pthread_mutex_lock(&(rx_write));
-        memcpy(&frame_num, &(dev->frame_num), sizeof(int));
-        pthread_mutex_unlock(&(rx_write));
-#ifdef RXDEBUG
-        eprintf("Frame number = %d, Number of frames = %d\n", frame_num, num_frames);
-        fflush(stdout);
-#endif
-        if (frame_num >= num_frames)
+    dev->pack_flags = frame_hdr->flags;
+    return frame_hdr->pack_sz;
+}
+
+ssize_t rxmodem_receive(rxmodem *dev)
+{
+    return rxmodem_receive_tout(dev, RXMODEM_TIMEOUT);
+}
+
+void rxmodem_release(rxmodem *dev)
+{
+    pthread_mutex_lock(&(dev->run_m));
+    dev->loaned = 0;
+    dev->frame_num = 0;
+    pthread_cond_broadcast(&(dev->run_cond));
+    pthread_mutex_unlock(&(dev->run_m));
+}
+
+int rxmodem_fd(rxmodem *dev)
+{
+    int ret;
+    if (!(dev->running) && ((ret = rxmodem_run(dev)) < 0))
+        return ret;
+    return dev->fd;
+}
+
+static void *rx_handler_thread(void *__dev)
+{
+    rxmodem *dev = (rxmodem *)__dev;
+    while (!(dev->handler_done))
+    {
+        ssize_t pack_sz = rxmodem_receive_tout(dev, RXMODEM_RUN_POLL_MS);
+        if (pack_sz == -ETIMEDOUT)
+            continue;
+        rxmodem_event_t ev[1];
+        memset(ev, 0x0, sizeof(rxmodem_event_t));
+        ev->pack_sz = pack_sz;
+        ev->pack_id = dev->pack_id;
+        ev->frame_id = -1;
+        ev->flags = dev->pack_flags;
+        uint8_t *buf = NULL;
+        if ((pack_sz > 0) && ((buf = (uint8_t *)calloc(1, pack_sz)) == NULL)) // zeroed past a short read
         {
-#ifdef RXDEBUG
-            eprintf("%d >= %d triggered\n", frame_num, num_frames);
-            fflush(stdout);
-#endif
-            break;
+            eprintf("Unable to allocate memory for packet of %zd bytes", pack_sz);
+            ev->pack_sz = RX_MALLOC_FAILED;
+        }
+        else if (pack_sz > 0)
+        {
+            ev->data = buf;
+            ev->size = rxmodem_read(dev, buf, pack_sz);
+            ev->status = dev->pack_crc_status;
+            rxmodem_release(dev); // copied out, the engine may reuse the frames while the handler runs
+        }
+        else if (dev->retcode < 0) // the RX engine stopped, restarted by the next rxmodem_receive
+            usleep(RXMODEM_RUN_POLL_MS * 1000);
+        dev->handler(ev, dev->handler_user);
+        free(buf);
+    }
+    return NULL;
+}
+
+int rxmodem_set_handler(rxmodem *dev, rxmodem_handler_t cb, void *user, int flags)
+{
+    int ret;
+    if ((dev->handler != NULL) && !(dev->handler_flags & RXMODEM_HANDLER_FRAMES))
+    {
+        dev->handler_done = 1;
+        pthread_join(dev->handler_thr[0], NULL);
+    }
+    pthread_mutex_lock(&(dev->run_m));
+    dev->handler = NULL;
+    while (dev->handler_busy) // the RX engine is in the frame handler
+        pthread_cond_wait(&(dev->run_cond), &(dev->run_m));
+    pthread_mutex_unlock(&(dev->run_m));
+    if (cb == NULL)
+        return 1;
+    if (!(dev->running) && ((ret = rxmodem_run(dev)) < 0))
+        return ret;
+    pthread_mutex_lock(&(dev->run_m));
+    dev->handler = cb;
+    dev->handler_user = user;
+    dev->handler_flags = flags;
+    dev->handler_done = 0;
+    pthread_mutex_unlock(&(dev->run_m));
+    if (flags & RXMODEM_HANDLER_FRAMES)
+        return 1;
+    if (pthread_create(dev->handler_thr, NULL, &rx_handler_thread, (void *)dev) != 0)
+    {
+        eprintf("Unable to start the packet handler thread");
+        perror("pthread_create");
+        pthread_mutex_lock(&(dev->run_m));
+        dev->handler = NULL;
+        pthread_mutex_unlock(&(dev->run_m));
+        return RX_THREAD_SPAWN;
+    }
+    return 1;
+}
+
+ssize_t rxmodem_read(rxmodem *dev, uint8_t *buf, ssize_t size)
+{
+    return rxmodem_read_frames(dev, buf, size, NULL, 0, 0);
+}
+
+/*
+ * Copy len bytes found at stream_ofst of the packet stream into buf and the
+ * trailer. The stream is prefix bytes of packet descriptor, pack_sz bytes of
+ * data of which the first lim go to buf, then the CRC32 trailer. Returns the
+ * updated CRC16 register over all len bytes.
+ */
+static uint16_t rx_stream_copy(uint16_t crc, uint8_t *buf, ssize_t lim, ssize_t prefix, ssize_t pack_sz, uint8_t *trailer, ssize_t stream_ofst, const uint8_t *src, ssize_t len)
+{
+    uint8_t *dst[4] = {NULL, buf, NULL, trailer}; // destination of each region of the stream, NULL to only checksum
+    ssize_t start[4] = {0, prefix, prefix + lim, prefix + pack_sz};
+    ssize_t end[4] = {prefix, prefix + lim, prefix + pack_sz, prefix + pack_sz + sizeof(uint32_t)};
+    ssize_t done = 0;
+    for (int r = 0; (r < 4) && (done < len); r++)
+    {
+        ssize_t o = stream_ofst + done;
+        if (o >= end[r])
+            continue;
+        ssize_t sz = end[r] - o < len - done ? end[r] - o : len - done;
+        if (dst[r] != NULL)
+            crc = crc16_copy_update(crc, dst[r] + o - start[r], src + done, sz);
+        else
+            crc = crc16_update(crc, src + done, sz);
+        done += sz;
+    }
+    return crc16_update(crc, src + done, len - done);
+}
+
+/*
+ * Bytes of buf[0, lim) carried by len bytes at stream_ofst of the packet stream
+ */
+static inline ssize_t rx_stream_data_sz(ssize_t lim, ssize_t prefix, ssize_t stream_ofst, ssize_t len)
+{
+    ssize_t first = stream_ofst > prefix ? stream_ofst : prefix;
+    ssize_t last = stream_ofst + len < prefix + lim ? stream_ofst + len : prefix + lim;
+    return last > first ? last - first : 0;
+}
+
+/*
+ * Feed len bytes found at stream_ofst of a compressed packet stream to the
+ * decoder. The stream is prefix bytes of packet descriptor, data_sz bytes of
+ * liblz block stream, then the CRC32 trailer. The CRC32 of the block stream is
+ * updated if crc is not NULL. Returns the decoder state, see lz_dec_write.
+ */
+static int rx_stream_feed(lz_dec_t *dec, uint32_t *crc, uint8_t *trailer, ssize_t prefix, ssize_t data_sz, ssize_t stream_ofst, const uint8_t *src, ssize_t len)
+{
+    ssize_t skip = stream_ofst < prefix ? prefix - stream_ofst : 0; // packet descriptor
+    skip = skip < len ? skip : len;
+    ssize_t sz = prefix + data_sz - stream_ofst - skip;
+    sz = sz < 0 ? 0 : (sz < len - skip ? sz : len - skip);
+    if (crc != NULL)
+        *crc = crc32_update(*crc, src + skip, sz);
+    for (ssize_t i = skip + sz; (trailer != NULL) && (i < len); i++)
+    {
+        ssize_t t = stream_ofst + i - prefix - data_sz;
+        if (t < (ssize_t)sizeof(uint32_t))
+            trailer[t] = src[i];
+    }
+    return lz_dec_write(dec, src + skip, sz);
+}
+
+/*
+ * The size of a compressed packet stream is only carried by the parity frames
+ * of the last block and by the last data frame, take the largest one seen.
+ */
+static ssize_t rx_lz_stream_sz(rxmodem *dev, modem_frame_info_t *ref, ssize_t stream_sz)
+{
+    ssize_t max_stream_sz = dev->dma->mem_sz; // the compressed stream is held in the RX ring
+    for (int i = 0; i < dev->frame_num; i++)
+    {
+        modem_frame_info_t frame_hdr[1];
+        ssize_t ofst = (dev->frame_ofst)[i];
+        if ((modem_parse_frame_hdr(dev->dma->mem_virt_addr + ofst, frame_hdr) != ref->version) || !(frame_hdr->hdr_ok) || (frame_hdr->pack_id != ref->pack_id))
+            continue;
+        uint8_t *payload = dev->dma->mem_virt_addr + ofst + frame_hdr->hdr_sz;
+        ssize_t end = 0;
+        if (frame_hdr->frame_id & MODEM_FRAME_PARITY)
+        {
+            modem_fec_header_t phdr[1];
+            if ((frame_hdr->frame_sz != sizeof(modem_fec_header_t) + ref->mtu) ||
+                (crc16_final(crc16_update(CRC16_INIT, payload, frame_hdr->frame_sz)) != frame_hdr->frame_crc))
+                continue;
+            memcpy(phdr, payload, sizeof(modem_fec_header_t));
+            end = phdr->stream_sz;
+        }
+        else if (frame_hdr->frame_sz <= ref->mtu) // header CRC covers the frame ID and size
+            end = (ssize_t)(frame_hdr->frame_id) * ref->mtu + frame_hdr->frame_sz;
+        if ((end > stream_sz) && (end <= max_stream_sz))
+            stream_sz = end;
+    }
+    return stream_sz;
+}
+
+/*
+ * Compare the packet CRC32 trailer with the CRC32 of the data read out, for
+ * packets the IRQ thread could not check as their frames landed
+ */
+static void rx_pack_crc_check(rxmodem *dev, uint64_t pack_id, const uint8_t *trailer, uint32_t crcval)
+{
+    uint32_t crc;
+    memcpy(&crc, trailer, sizeof(uint32_t));
+    if (crc != crcval)
+    {
+        eprintf("Packet 0x%llx: Valid CRC32 = 0x%x, Calculated CRC32 = 0x%x", (unsigned long long)pack_id, crc, crcval);
+    }
+    pthread_mutex_lock(&(rx_write));
+    dev->pack_crc_status = crc == crcval ? 1 : RX_PACK_CRC_FAILED;
+    pthread_mutex_unlock(&(rx_write));
+}
+
+/*
+ * Read path for packets carrying erasure code parity frames. Data frames are
+ * placed by frame ID, then each block with lost or corrupted data frames is
+ * rebuilt from its parity frames. The status array is indexed by data frame
+ * ID. Compressed packets are decoded block by block once each block is whole.
+ */
+static ssize_t rxmodem_read_fec(rxmodem *dev, uint8_t *buf, ssize_t size, rxmodem_frame_status *status, int max_status, int flags, modem_frame_info_t *ref, modem_fec_header_t *fec_hdr)
+{
+    ssize_t valid_read = 0;
+    int lz = (ref->flags & MODEM_FLAG_LZ) != 0;
+    ssize_t mtu = ref->mtu, pack_sz = ref->pack_sz, prefix = ref->prefix, stream_sz = fec_hdr->stream_sz;
+    if (lz)
+    {
+        stream_sz = rx_lz_stream_sz(dev, ref, stream_sz);
+        pack_sz = stream_sz - prefix - ((ref->flags & MODEM_FLAG_PACK_CRC) ? sizeof(uint32_t) : 0); // size of the block stream
+    }
+    ssize_t lim = size < pack_sz ? size : pack_sz;
+    int n = fec_hdr->n, k = fec_hdr->k;
+    int num_data_frames = (stream_sz / mtu) + ((stream_sz % mtu) > 0);
+    int num_blocks = (num_data_frames / n) + ((num_data_frames % n) > 0);
+    uint8_t trailer[sizeof(uint32_t)] = {0};
+    lz_dec_t dec[1];
+    memset(dec, 0x0, sizeof(lz_dec_t));
+    uint32_t lz_crc = 0;
+    int *data_at = (int *)malloc(num_data_frames * sizeof(int));  // arrival index of each valid data frame
+    int *data_st = (int *)calloc(num_data_frames, sizeof(int));   // status of each data frame
+    ssize_t *data_out = (ssize_t *)calloc(2 * num_data_frames, sizeof(ssize_t)); // decompressed output range of each data frame
+    int *parity_at = (int *)malloc(num_blocks * k * sizeof(int)); // arrival index of each valid parity frame
+    ssize_t *hdr_sz = (ssize_t *)malloc(dev->frame_num * sizeof(ssize_t)); // header size of each arrived frame
+    uint8_t *scratch = (uint8_t *)malloc((n + 1) * mtu);          // rebuilt shards, and the zero padded last data frame
+    if ((data_at == NULL) || (data_st == NULL) || (data_out == NULL) || (parity_at == NULL) || (hdr_sz == NULL) || (scratch == NULL) ||
+        (lz && (lz_dec_init(dec, buf, size) < 0)))
+    {
+        eprintf("Unable to allocate memory for erasure decoding");
+        valid_read = RX_MALLOC_FAILED;
+        goto rxmodem_read_fec_end;
+    }
+    for (int i = 0; i < num_data_frames; i++)
+        data_at[i] = -1;
+    for (int i = 0; i < num_blocks * k; i++)
+        parity_at[i] = -1;
+    // copy out received data frames and check CRC in one pass, index parity frames
+    for (int i = 0; i < dev->frame_num; i++)
+    {
+        modem_frame_info_t frame_hdr[1];
+        ssize_t ofst = (dev->frame_ofst)[i];
+        if ((modem_parse_frame_hdr(dev->dma->mem_virt_addr + ofst, frame_hdr) != ref->version) || !(frame_hdr->hdr_ok) || (frame_hdr->pack_id != ref->pack_id))
+        {
+            eprintf("Loop %d: Invalid frame header\n", i); // frame ID can not be trusted
+            continue;
+        }
+        hdr_sz[i] = frame_hdr->hdr_sz;
+        uint8_t *payload = dev->dma->mem_virt_addr + ofst + frame_hdr->hdr_sz;
+        if (frame_hdr->frame_id & MODEM_FRAME_PARITY)
+        {
+            modem_fec_header_t phdr[1];
+            memcpy(phdr, payload, sizeof(modem_fec_header_t));
+            int block = frame_hdr->frame_id & ~MODEM_FRAME_PARITY;
+            if ((frame_hdr->frame_sz != sizeof(modem_fec_header_t) + mtu) || (block >= num_blocks) || (phdr->idx >= k))
+                continue;
+            if (crc16_final(crc16_update(CRC16_INIT, payload, frame_hdr->frame_sz)) == frame_hdr->frame_crc)
+                parity_at[block * k + phdr->idx] = i;
+            continue;
         }
-        // wait for wakeup
-        getwaittime(&waitts);
-        pthread_cond_timedwait(&rx_rcv, &rx_rcv_m, &waitts);
+        int id = frame_hdr->frame_id;
+        if ((id >= num_data_frames) || (frame_hdr->frame_sz > mtu) || (id * mtu + frame_hdr->frame_sz > stream_sz))
+            continue;
+        uint16_t crc;
+        if (lz) // decoded in stream order once the block is whole
+            crc = crc16_update(CRC16_INIT, payload, frame_hdr->frame_sz);
+        else
+            crc = rx_stream_copy(CRC16_INIT, buf, lim, prefix, pack_sz, trailer, id * mtu, payload, frame_hdr->frame_sz);
+        if (crc16_final(crc) == frame_hdr->frame_crc)
+        {
+            data_at[id] = i;
+            data_st[id] = 1;
+        }
+        else
+        {
+            eprintf("Loop %d: Valid CRC = 0x%x, Calculated CRC = 0x%x\n", i, frame_hdr->frame_crc, crc16_final(crc));
+            data_st[id] = RX_FRAME_CRC_FAILED;
+        }
+    }
+    // rebuild lost data frames block by block
+    int rebuilt = 0, lz_ok = lz;
+    for (int b = 0; b < num_blocks; b++)
+    {
+        int block_sz = (num_data_frames - b * n) < n ? num_data_frames - b * n : n;
+        uint8_t *data[FEC_MAX_SHARDS];
+        const uint8_t *parity[FEC_MAX_SHARDS];
+        int data_ok[FEC_MAX_SHARDS], parity_idx[FEC_MAX_SHARDS];
+        int missing = 0, num_parity = 0;
+        for (int j = 0; j < block_sz; j++)
+            missing += (data_st[b * n + j] <= 0);
+        if (missing == 0)
+            goto rxmodem_read_fec_decode;
+        for (int r = 0; r < k; r++)
+        {
+            int i = parity_at[b * k + r];
+            if (i < 0)
+                continue;
+            ssize_t ofst = (dev->frame_ofst)[i];
+            parity[num_parity] = dev->dma->mem_virt_addr + ofst + hdr_sz[i] + sizeof(modem_fec_header_t);
+            parity_idx[num_parity++] = r;
+        }
+        if (missing > num_parity)
+        {
+            eprintf("Block %d: %d frames lost, %d parity frames available", b, missing, num_parity);
+            goto rxmodem_read_fec_decode;
+        }
+        int nscratch = 0;
+        for (int j = 0; j < block_sz; j++)
+        {
+            int id = b * n + j;
+            data_ok[j] = data_st[id] > 0;
+            ssize_t len = (id + 1) * mtu < stream_sz ? mtu : stream_sz - id * mtu;
+            if (!data_ok[j])
+                data[j] = scratch + (nscratch++) * mtu;
+            else
+            {
+                int i = data_at[id];
+                ssize_t ofst = (dev->frame_ofst)[i];
+                data[j] = dev->dma->mem_virt_addr + ofst + hdr_sz[i];
+                if (len < mtu) // last data frame, zero padded for encoding
+                {
+                    memcpy(scratch + n * mtu, data[j], len);
+                    memset(scratch + n * mtu + len, 0x0, mtu - len);
+                    data[j] = scratch + n * mtu;
+                }
+            }
+        }
+        if (fec_decode(block_sz, data, data_ok, parity, parity_idx, num_parity, mtu) < 0)
+            goto rxmodem_read_fec_decode;
+        for (int j = 0; j < block_sz; j++)
+        {
+            int id = b * n + j;
+            if (data_ok[j])
+                continue;
+            ssize_t len = (id + 1) * mtu < stream_sz ? mtu : stream_sz - id * mtu;
+            if (!lz)
+                rx_stream_copy(CRC16_INIT, buf, lim, prefix, pack_sz, trailer, id * mtu, data[j], len);
+            data_at[id] = -1 - j; // rebuilt in data[j]
+            data_st[id] = 1;
+            rebuilt++;
+        }
+    rxmodem_read_fec_decode:
+        // feed the block to the decoder in stream order, the rebuilt shards are overwritten by the next block
+        for (int j = 0; lz_ok && (j < block_sz); j++)
+        {
+            int id = b * n + j;
+            if (data_st[id] <= 0)
+            {
+                eprintf("Data frame %d lost, decompressed %zu bytes", id, dec->dst_ofst);
+                lz_ok = 0;
+                break;
+            }
+            const uint8_t *src;
+            if (data_at[id] < 0)
+                src = data[-1 - data_at[id]];
+            else
+            {
+                ssize_t ofst = (dev->frame_ofst)[data_at[id]];
+                src = dev->dma->mem_virt_addr + ofst + hdr_sz[data_at[id]];
+            }
+            ssize_t len = (id + 1) * mtu < stream_sz ? mtu : stream_sz - id * mtu;
+            data_out[2 * id] = dec->dst_ofst;
+            if (rx_stream_feed(dec, &lz_crc, trailer, prefix, pack_sz, id * mtu, src, len) < 0)
+            {
+                eprintf("Data frame %d: Invalid compressed data", id);
+                data_st[id] = RX_DECOMPRESS_FAILED;
+                lz_ok = 0;
+            }
+            data_out[2 * id + 1] = dec->dst_ofst - data_out[2 * id];
+        }
+    }
 #ifdef RXDEBUG
-        eprintf("Current frame number: %d", frame_num);
-        fflush(stderr);
+    eprintf("Rebuilt %d of %d data frames", rebuilt, num_data_frames);
 #endif
-        // check retcode
-        if (dev->retcode <= 0) // timed out
+    for (int id = 0; id < num_data_frames; id++)
+    {
+        ssize_t ofst = id * mtu > prefix ? id * mtu - prefix : 0;
+        ssize_t len = rx_stream_data_sz(lim, prefix, id * mtu, mtu);
+        if (lz)
         {
-            eprintf("Device return code %d!", dev->retcode);
-            dev->rx_done = 1;
+            ofst = data_out[2 * id];
+            len = data_out[2 * id + 1];
+        }
+        if (data_st[id] > 0)
+            valid_read += len;
+        if ((status != NULL) && (id < max_status))
+        {
+            status[id].ofst = ofst;
+            status[id].len = len;
+            status[id].frame_id = id;
+            status[id].status = data_st[id];
+        }
+    }
+    // frames rebuilt here were not seen by the packet CRC32 check in the IRQ thread, which also gives up on lost parity frames
+    if (((rebuilt > 0) || (dev->pack_crc_status == 0)) && (stream_sz == prefix + pack_sz + sizeof(uint32_t)) && (lz ? lz_ok : (valid_read == pack_sz)))
+        rx_pack_crc_check(dev, ref->pack_id, trailer, lz ? lz_crc : crc32_update(0, buf, pack_sz));
+    if (lz)
+        dev->lz_stats = dec->stats;
+rxmodem_read_fec_end:
+    lz_dec_free(dec);
+    free(data_at);
+    free(data_st);
+    free(data_out);
+    free(parity_at);
+    free(hdr_sz);
+    free(scratch);
+    return valid_read;
+}
+
+/*
+ * In order read path for compressed packets without usable parity frames.
+ * Each frame is copied out of the DMA buffer and checked in one pass, then
+ * decoded from the copy. If check is set, the packet carries a CRC32 trailer
+ * the IRQ thread did not check, it is checked against the block stream here.
+ */
+static ssize_t rxmodem_read_lz(rxmodem *dev, uint8_t *buf, ssize_t size, rxmodem_frame_status *status, int max_status, ssize_t prefix, uint64_t pack_id, int check)
+{
+    lz_dec_t dec[1];
+    uint8_t frame[TXRX_MTU_MAX];
+    uint8_t trailer[sizeof(uint32_t)];
+    ssize_t stream_ofst = 0, data_sz = dev->dma->mem_sz;
+    uint32_t lz_crc = 0;
+    int lz_ok = 1;
+    // the trailer ends the stream, which ends with the frame flagged MODEM_FLAG_LAST
+    for (int i = 0, next = 0; check && (i < dev->frame_num); i++)
+    {
+        modem_frame_info_t frame_hdr[1];
+        ssize_t ofst = (dev->frame_ofst)[i];
+        if ((modem_parse_frame_hdr(dev->dma->mem_virt_addr + ofst, frame_hdr) < 0) || !(frame_hdr->hdr_ok) || (frame_hdr->frame_id != (uint32_t)next++))
             break;
+        stream_ofst += frame_hdr->frame_sz;
+        if (!(frame_hdr->flags & MODEM_FLAG_LAST))
+            continue;
+        if (stream_ofst >= prefix + (ssize_t)sizeof(uint32_t))
+            data_sz = stream_ofst - prefix - sizeof(uint32_t);
+        break;
+    }
+    check = check && (data_sz < (ssize_t)dev->dma->mem_sz);
+    stream_ofst = 0;
+    if (lz_dec_init(dec, buf, size) < 0)
+    {
+        eprintf("Unable to allocate memory for decompression");
+        return RX_MALLOC_FAILED;
+    }
+    for (int i = 0; i < dev->frame_num; i++)
+    {
+        modem_frame_info_t frame_hdr[1]; // frame header
+        ssize_t ofst = (dev->frame_ofst)[i];
+        if ((modem_parse_frame_hdr(dev->dma->mem_virt_addr + ofst, frame_hdr) < 0) || (frame_hdr->frame_sz > TXRX_MTU_MAX))
+        {
+            eprintf("Loop %d: Invalid frame header\n", i);
+            break; // frame size unknown, the rest can not be placed
+        }
+        if (frame_hdr->frame_id & MODEM_FRAME_PARITY) // no usable parity frame, read the data frames in order
+            continue;
+        int frame_status = 1;
+        ssize_t out_ofst = dec->dst_ofst;
+        if (!(frame_hdr->hdr_ok))
+        {
+            eprintf("Loop %d: CRC invalid in frame header\n", i);
+            frame_status = RX_FRAME_HDR_CRC_MISMATCH;
+        }
+        else
+        {
+            uint8_t *payload = dev->dma->mem_virt_addr + ofst + frame_hdr->hdr_sz;
+            uint16_t crcval = crc16_final(crc16_copy_update(CRC16_INIT, frame, payload, frame_hdr->frame_sz));
+            if (frame_hdr->frame_crc != crcval)
+            {
+                eprintf("Loop %d: Valid CRC = 0x%x, Calculated CRC = 0x%x\n", i, frame_hdr->frame_crc, crcval);
+                frame_status = RX_FRAME_CRC_FAILED;
+            }
+            else if (lz_ok && (rx_stream_feed(dec, check ? &lz_crc : NULL, check ? trailer : NULL, prefix, data_sz, stream_ofst, frame, frame_hdr->frame_sz) < 0)) // trailer is past the end of the block stream
+            {
+                eprintf("Loop %d: Invalid compressed data", i);
+                frame_status = RX_DECOMPRESS_FAILED;
+            }
+        }
+        if (lz_ok && (frame_status <= 0))
+        {
+            eprintf("Decompressed %zu bytes", dec->dst_ofst);
+            lz_ok = 0;
         }
+        if ((status != NULL) && (i < max_status))
+        {
+            status[i].ofst = out_ofst;
+            status[i].len = dec->dst_ofst - out_ofst;
+            status[i].frame_id = frame_hdr->frame_id;
+            status[i].status = frame_status;
+        }
+        stream_ofst += frame_hdr->frame_sz;
     }
-    retcode = frame_hdr->pack_sz; // on success or timeout, send the proper size
-rxmodem_receive_end:
-    dev->rx_done = 1; // indicate completion
-    pthread_cancel(dev->thr[0]);
-    return retcode;
+    if (check && lz_ok && (stream_ofst == prefix + data_sz + (ssize_t)sizeof(uint32_t)))
+        rx_pack_crc_check(dev, pack_id, trailer, lz_crc);
+    dev->lz_stats = dec->stats;
+    lz_dec_free(dec);
+    return dec->dst_ofst;
 }
 
-ssize_t rxmodem_read(rxmodem *dev, uint8_t *buf, ssize_t size)
+ssize_t rxmodem_read_frames(rxmodem *dev, uint8_t *buf, ssize_t size, rxmodem_frame_status *status, int max_status, int flags)
 {
-    ssize_t valid_read = 0, total_read = 0;
+    ssize_t valid_read = 0, stream_ofst = 0;
+    if ((status != NULL) && (max_status > 0))
+        memset(status, 0x0, max_status * sizeof(rxmodem_frame_status));
+    // look for a valid parity frame, the packet is then read by frame ID and rebuilt
+    for (int i = 0; i < dev->frame_num; i++)
+    {
+        modem_frame_info_t frame_hdr[1];
+        modem_fec_header_t fec_hdr[1];
+        ssize_t ofst = (dev->frame_ofst)[i];
+        if (!rx_parity_frame(dev, ofst, frame_hdr, fec_hdr))
+            continue;
+        // packet fields, v2 frames carry them in frame 0 only
+        ssize_t trailer_sz = ((frame_hdr->version == MODEM_HDR_V1) || (frame_hdr->flags & MODEM_FLAG_PACK_CRC)) ? sizeof(uint32_t) : 0;
+        frame_hdr->mtu = frame_hdr->frame_sz - sizeof(modem_fec_header_t);
+        if (frame_hdr->version == MODEM_HDR_V2)
+            frame_hdr->pack_sz = fec_hdr->stream_sz - frame_hdr->prefix - trailer_sz;
+        if ((frame_hdr->flags & MODEM_FLAG_LZ) ? (fec_hdr->stream_sz < frame_hdr->prefix + trailer_sz) // the compressed stream size is settled by rx_lz_stream_sz
+                                               : ((fec_hdr->stream_sz < frame_hdr->prefix + frame_hdr->pack_sz) || (fec_hdr->stream_sz > frame_hdr->prefix + frame_hdr->pack_sz + trailer_sz)))
+            continue;
+        return rxmodem_read_fec(dev, buf, size, status, max_status, flags, frame_hdr, fec_hdr);
+    }
+    // packet fields from frame 0, the caller's size if it did not make it
+    ssize_t pack_sz = size, prefix = 0, mtu = 0, trailer_sz = 0, trailer_read = 0;
+    uint64_t pack_id = 0;
+    if (dev->frame_num > 0)
+    {
+        modem_frame_info_t frame_hdr[1];
+        ssize_t ofst = (dev->frame_ofst)[0];
+        if (modem_parse_frame_hdr(dev->dma->mem_virt_addr + ofst, frame_hdr) > 0)
+        {
+            prefix = frame_hdr->prefix;
+            pack_id = frame_hdr->pack_id;
+            if (frame_hdr->has_desc)
+                pack_sz = frame_hdr->pack_sz;
+            if (frame_hdr->has_desc && (frame_hdr->mtu >= TXRX_MTU_MIN) && (frame_hdr->mtu <= TXRX_MTU_MAX))
+                mtu = frame_hdr->mtu;
+            // the IRQ thread checks the packet CRC32 of packets whose frames land in order only
+            if (frame_hdr->has_desc && (dev->pack_crc_status == 0) && ((frame_hdr->version == MODEM_HDR_V1) || (frame_hdr->flags & MODEM_FLAG_PACK_CRC)))
+                trailer_sz = sizeof(uint32_t);
+            if (frame_hdr->flags & MODEM_FLAG_LZ)
+                return rxmodem_read_lz(dev, buf, size < pack_sz ? size : pack_sz, status, max_status, prefix, pack_id, trailer_sz > 0);
+        }
+    }
+    ssize_t lim = size < pack_sz ? size : pack_sz;
+    uint8_t trailer[sizeof(uint32_t)];
     // for each frame
     for (int i = 0; i < dev->frame_num; i++)
     {
-        modem_frame_header_t frame_hdr[1]; // frame header
-        pthread_mutex_lock(&frame_ofst_m);
+        modem_frame_info_t frame_hdr[1]; // frame header
         ssize_t ofst = (dev->frame_ofst)[i];
-        pthread_mutex_unlock(&frame_ofst_m);
 #ifdef RXDEBUG
         eprintf("%s: Offset %d = %ld", __func__, i, ofst);
 #endif
         // read in frame header
-        memcpy(frame_hdr, dev->dma->mem_virt_addr + ofst, sizeof(modem_frame_header_t));
+        if (modem_parse_frame_hdr(dev->dma->mem_virt_addr + ofst, frame_hdr) < 0)
+        {
+            eprintf("Loop %d: Invalid frame header\n", i);
+            break; // frame size unknown, the rest can not be placed
+        }
+        if (frame_hdr->frame_id & MODEM_FRAME_PARITY) // no usable parity frame, read the data frames in order
+            continue;
+        if ((mtu > 0) && frame_hdr->hdr_ok) // frames are sorted by ID, a lost one leaves a gap
+            stream_ofst = (ssize_t)frame_hdr->frame_id * mtu;
         // copy out data, perform CRC etc
-        if (total_read + frame_hdr->frame_sz <= size) // memcpy valid only when this is true
+        ssize_t data_sz = rx_stream_data_sz(lim, prefix, stream_ofst, frame_hdr->frame_sz); // the descriptor and the packet CRC32 trailer are not copied out
+        int frame_status = 1;
+        if (!(frame_hdr->hdr_ok))
+        {
+            eprintf("Loop %d: CRC invalid in frame header\n", i);
+            frame_status = RX_FRAME_HDR_CRC_MISMATCH;
+        }
+        if ((frame_status > 0) || !(flags & RXMODEM_READ_SKIP_BAD_HDR))
         {
-            memcpy(buf + total_read, dev->dma->mem_virt_addr + ofst + sizeof(modem_frame_header_t), frame_hdr->frame_sz);
-            // check CRC
-            if (frame_hdr->frame_crc == frame_hdr->frame_crc2)
+            // copy out of the DMA buffer and check CRC in one pass
+            uint8_t *payload = dev->dma->mem_virt_addr + ofst + frame_hdr->hdr_sz;
+            uint16_t crc = rx_stream_copy(CRC16_INIT, buf, lim, prefix, pack_sz, trailer, stream_ofst, payload, frame_hdr->frame_sz);
+            uint16_t crcval = crc16_final(crc);
+            if (frame_status > 0)
             {
-                uint16_t crcval = crc16(buf + total_read, frame_hdr->frame_sz);
                 if (frame_hdr->frame_crc == crcval)
-                    valid_read += frame_hdr->frame_sz;
+                {
+                    valid_read += data_sz;
+                    trailer_read += rx_stream_data_sz(trailer_sz, prefix + pack_sz, stream_ofst, frame_hdr->frame_sz);
+                }
                 else
                 {
                     eprintf("Loop %d: Valid CRC = 0x%x, Calculated CRC = 0x%x\n", i, frame_hdr->frame_crc, crcval);
+                    frame_status = RX_FRAME_CRC_FAILED;
                 }
             }
-            else
-            {
-                eprintf("Loop %d: CRC invalid in frame header\n", i);
-            }
-            total_read += frame_hdr->frame_sz;
         }
-        else
-            break;
+        if ((status != NULL) && (i < max_status))
+        {
+            status[i].ofst = stream_ofst > prefix ? stream_ofst - prefix : 0;
+            status[i].len = data_sz;
+            status[i].frame_id = frame_hdr->frame_id;
+            status[i].status = frame_status;
+        }
+        stream_ofst += frame_hdr->frame_sz;
     }
+    if ((trailer_sz > 0) && (trailer_read == trailer_sz) && (lim == pack_sz) && (valid_read == pack_sz))
+        rx_pack_crc_check(dev, pack_id, trailer, crc32_update(0, buf, pack_sz));
     return valid_read;
 }
 
+int rxmodem_read_views(rxmodem *dev, rxmodem_frame_view *views, int max_views)
+{
+    if (dev->pack_flags & MODEM_FLAG_LZ)
+        return RX_PACK_COMPRESSED;
+    if (dev->frame_num == 0)
+        return 0;
+    // packet fields from frame 0, checked by rxmodem_receive
+    modem_frame_info_t frame_hdr[1];
+    ssize_t ofst = (dev->frame_ofst)[0];
+    if ((modem_parse_frame_hdr(dev->dma->mem_virt_addr + ofst, frame_hdr) < 0) || !(frame_hdr->has_desc))
+        return 0;
+    ssize_t pack_sz = frame_hdr->pack_sz, prefix = frame_hdr->prefix, mtu = frame_hdr->mtu, stream_ofst = 0;
+    int num_views = 0;
+    for (int i = 0; (i < dev->frame_num) && (num_views < max_views); i++)
+    {
+        ofst = (dev->frame_ofst)[i];
+        if ((modem_parse_frame_hdr(dev->dma->mem_virt_addr + ofst, frame_hdr) < 0) || !(frame_hdr->hdr_ok) || (frame_hdr->frame_sz > TXRX_MTU_MAX))
+            continue; // can not be placed
+        if (frame_hdr->frame_id & MODEM_FRAME_PARITY) // sorted after the data frames
+            break;
+        if ((mtu >= TXRX_MTU_MIN) && (mtu <= TXRX_MTU_MAX))
+            stream_ofst = (ssize_t)frame_hdr->frame_id * mtu;
+        uint8_t *payload = dev->dma->mem_virt_addr + ofst + frame_hdr->hdr_sz;
+        ssize_t skip_sz = stream_ofst < prefix ? prefix - stream_ofst : 0; // packet descriptor
+        ssize_t data_sz = rx_stream_data_sz(pack_sz, prefix, stream_ofst, frame_hdr->frame_sz); // the packet CRC32 trailer is left out
+        if (data_sz > 0)
+        {
+            rxmodem_frame_view *view = &(views[num_views++]);
+            view->ptr = payload + skip_sz;
+            view->len = data_sz;
+            view->ofst = stream_ofst + skip_sz - prefix;
+            view->frame_id = frame_hdr->frame_id;
+            view->crc_ok = crc16_final(crc16_update(CRC16_INIT, payload, frame_hdr->frame_sz)) == frame_hdr->frame_crc;
+        }
+        stream_ofst += frame_hdr->frame_sz;
+    }
+    return num_views;
+}
+
+int rxmodem_agg_next(const uint8_t *buf, ssize_t size, ssize_t *ofst, const uint8_t **msg, ssize_t *len)
+{
+    modem_agg_len_t msg_len;
+    if (*ofst >= size)
+        return 0;
+    if (*ofst + (ssize_t)sizeof(modem_agg_len_t) > size)
+        return RX_AGG_TRUNCATED;
+    memcpy(&msg_len, buf + *ofst, sizeof(modem_agg_len_t));
+    if (*ofst + (ssize_t)sizeof(modem_agg_len_t) + msg_len > size)
+        return RX_AGG_TRUNCATED;
+    *msg = buf + *ofst + sizeof(modem_agg_len_t);
+    *len = msg_len;
+    *ofst += sizeof(modem_agg_len_t) + msg_len;
+    return 1;
+}
+
 int rxmodem_reset(rxmodem *dev, rxmodem_conf_t *conf)
 {
     dev->frame_num = 0;
+    dev->last_seen = 0;
+    dev->pack_flags = 0;
+    dev->pack_crc_status = 0;
+    memset(&(dev->lz_stats), 0x0, sizeof(lz_stats_t));
+    rxmodem_write_conf(dev, conf);
+    if (dev->running) // keep the RX engine armed
+        uio_write(dev->bus, RXMODEM_RX_ENABLE, 0x1);
+    return 1;
+}
+
+static int rxmodem_write_conf(rxmodem *dev, rxmodem_conf_t *conf)
+{
     uio_write(dev->bus, RXMODEM_RESET, 0x1);
 #ifdef RXDEBUG
     eprintf();
@@ -524,6 +1893,11 @@ int rxmodem_reset(rxmodem *dev, rxmodem_conf_t *conf)
 
 void rxmodem_destroy(rxmodem *dev)
 {
+    rxmodem_set_handler(dev, NULL, NULL, 0);
+    rxmodem_halt(dev);
+    close(dev->fd);
+    pthread_mutex_destroy(&(dev->run_m));
+    pthread_cond_destroy(&(dev->run_cond));
     if (dev->frame_ofst != NULL)
         free(dev->frame_ofst);
     rxmodem_stop(dev);                       // stop the modem for safety
@@ -2,6 +2,67 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+ * Write the packet straight from the DMA buffer. Returns size once all of it
+ * is written, 0 with nothing written if a frame is missing or failed its CRC,
+ * or -1 if the write failed, with the file offset back where it was for the
+ * caller to write the packet over what made it out.
+ */
+static ssize_t write_views(rxmodem *dev, int fd, ssize_t size)
+{
+    int max_views = dev->frame_num;
+    rxmodem_frame_view *views = (rxmodem_frame_view *)malloc(max_views * sizeof(rxmodem_frame_view));
+    struct iovec *iov = (struct iovec *)malloc(max_views * sizeof(struct iovec));
+    int num_views = ((views != NULL) && (iov != NULL)) ? rxmodem_read_views(dev, views, max_views) : 0;
+    ssize_t total = 0, written = 0;
+    int i;
+    for (i = 0; (i < num_views) && views[i].crc_ok && (views[i].ofst == total); i++)
+    {
+        iov[i].iov_base = (void *)views[i].ptr;
+        iov[i].iov_len = views[i].len;
+        total += views[i].len;
+    }
+    if ((num_views > 0) && (i == num_views) && (total == size) && (dev->pack_crc_status >= 0))
+    {
+        off_t start = lseek(fd, 0, SEEK_CUR);
+        i = 0;
+        while (written < size)
+        {
+            ssize_t ret = writev(fd, iov + i, num_views - i < IOV_MAX ? num_views - i : IOV_MAX);
+            if ((ret < 0) && (errno == EINTR))
+                continue;
+            if (ret <= 0)
+                break;
+            written += ret;
+            while ((i < num_views) && (ret >= (ssize_t)iov[i].iov_len)) // views written out
+                ret -= iov[i++].iov_len;
+            if (ret > 0) // short write in the middle of a view
+            {
+                iov[i].iov_base = (uint8_t *)iov[i].iov_base + ret;
+                iov[i].iov_len -= ret;
+            }
+        }
+        if (written != size)
+        {
+            eprintf("Error: Wrote %zd out of %zd", written, size);
+            if ((start < 0) || (lseek(fd, start, SEEK_SET) < 0))
+                perror("lseek");
+            written = -1;
+        }
+    }
+    free(views);
+    free(iov);
+    return written;
+}
 
 int main(int argc, char **argv)
 {
@@ -28,13 +89,30 @@ int main(int argc, char **argv)
         return -1;
     }
 
-    uint8_t *buffer = malloc(bufferSize);
-
     ssize_t rd = 0;
 
+    if ((rd = write_views(RX, fileno(fPhoto), bufferSize)) == bufferSize)
+    {
+        rxmodem_release(RX);
+        fclose(fPhoto);
+        sync();
+        return 0;
+    }
+
+    uint8_t *buffer = malloc(bufferSize);
+
     if ((rd = rxmodem_read(RX, buffer, bufferSize)) != bufferSize)
     {
-        eprintf("Error: Read %d out of %d", rd, bufferSize);
+        eprintf("Error: Read %zd out of %zd", rd, bufferSize);
+    }
+    rxmodem_release(RX);
+    if (RX->pack_crc_status < 0)
+    {
+        eprintf("Error: Packet CRC32 check failed");
+    }
+    if (RX->lz_stats.out_sz > 0)
+    {
+        printf("Decompressed %llu bytes to %llu in %.3f ms\n", (unsigned long long)RX->lz_stats.in_sz, (unsigned long long)RX->lz_stats.out_sz, RX->lz_stats.ns * 1e-6);
     }
 
     fwrite(buffer, bufferSize, 1, fPhoto);
@@ -65,11 +65,22 @@ int main(int argc, char *argv[])
         printf("%s: Received data size: %d\n", __func__, rcv_sz);
         fflush(stdout);
         char *buf = (char *)malloc(rcv_sz);
-        ssize_t rd_sz = rxmodem_read(dev, (uint8_t *)buf, rcv_sz);
+        int num_frames = dev->frame_num;
+        rxmodem_frame_status *status = (rxmodem_frame_status *)malloc(num_frames * sizeof(rxmodem_frame_status));
+        ssize_t rd_sz = rxmodem_read_frames(dev, (uint8_t *)buf, rcv_sz, status, num_frames, 0);
+        rxmodem_release(dev);
         if (rcv_sz != rd_sz)
         {
-            eprintf("%s: Read size = %d out of %d\n", __func__, rd_sz, rcv_sz);
+            eprintf("%s: Read size = %zd out of %zd\n", __func__, rd_sz, rcv_sz);
+            for (int i = 0; (status != NULL) && (i < num_frames); i++)
+            {
+                if (status[i].status <= 0)
+                {
+                    eprintf("%s: Frame %d, bytes %zd to %zd invalid (%d)\n", __func__, status[i].frame_id, status[i].ofst, status[i].ofst + status[i].len, status[i].status);
+                }
+            }
         }
+        free(status);
         printf("Message:");
         for (int i = 0; i < rd_sz; i++)
             printf("%c", buf[i]);
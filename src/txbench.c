@@ -0,0 +1,332 @@
+/**
+ * @file txbench.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Throughput of txmodem_write against txmodem_write_async, and latency
+ * of small urgent packets sent while bulk packets are on air, through
+ * txmodem_write and through the priority classes of txmodem_sched_t. Uses an
+ * in-memory stand-in for the TX DMA engine that takes the airtime of each
+ * transfer.
+ * @version 0.1
+ * @date 2021-06-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include "txmodem.h"
+
+#define BENCH_DMA_MEM (4 << 20) // TX DMA buffer size
+#define BENCH_PACKS 500         // packets per measurement
+#define BENCH_PACK_SZ 16000     // packet size, 4 frames at a 4064 byte MTU
+#define BENCH_AIR_RATE 20e6     // bytes per second on air
+#define BENCH_BULK_SZ (1 << 20) // bulk packet size, latency measurement
+#define BENCH_BULK_PACKS 4      // bulk packets per latency measurement
+#define BENCH_URGENT_SZ 64      // urgent packet size
+
+static double air_rate = BENCH_AIR_RATE;
+static uint64_t dma_bytes = 0;
+
+static inline uint64_t get_nsec()
+{
+    struct timespec mac_ts;
+    timespec_get(&mac_ts, TIME_UTC);
+    return (uint64_t)mac_ts.tv_sec * 1000000000L + ((uint64_t)mac_ts.tv_nsec);
+}
+
+static void sleep_nsec(uint64_t ns)
+{
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000L;
+    ts.tv_nsec = ns % 1000000000L;
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+}
+
+/*
+ * In-memory DMA engine: submitted transfers queue up on air back to back and
+ * complete once their bytes are out, a blocking write returns once it is out
+ */
+static uint64_t air_end_ns = 0;                     // time the last submitted transfer is out
+static uint64_t xfer_end_ns[ADIDMA_MAX_XFERS] = {0}; // time each outstanding transfer is out, by handle
+
+int adidma_init(adidma *dev, int uio_id, unsigned char ext_buffer_enb)
+{
+    dev->mem_sz = BENCH_DMA_MEM;
+    dev->mem_virt_addr = (uint8_t *)malloc(BENCH_DMA_MEM);
+    return dev->mem_virt_addr == NULL ? -1 : 1;
+}
+
+void adidma_destroy(adidma *dev)
+{
+    free(dev->mem_virt_addr);
+}
+
+int adidma_write(adidma *dev, unsigned int offset, ssize_t size, unsigned char cyclic)
+{
+    dma_bytes += size;
+    sleep_nsec(size * 1e9 / air_rate);
+    return 1;
+}
+
+int adidma_stop(adidma *dev)
+{
+    return 1;
+}
+
+int adidma_wait(adidma *dev, int64_t xfer)
+{
+    uint64_t now = get_nsec(), end = xfer_end_ns[xfer % ADIDMA_MAX_XFERS];
+    if (end > now)
+        sleep_nsec(end - now);
+    return 1;
+}
+
+int64_t adidma_submit(adidma *dev, unsigned int offset, ssize_t size, unsigned char dir)
+{
+    if (dev->xfer_submitted >= ADIDMA_MAX_XFERS) // the DMAC queue is full, wait for the oldest transfer
+        adidma_wait(dev, dev->xfer_submitted - ADIDMA_MAX_XFERS);
+    uint64_t now = get_nsec();
+    air_end_ns = (air_end_ns > now ? air_end_ns : now) + size * 1e9 / air_rate;
+    xfer_end_ns[dev->xfer_submitted % ADIDMA_MAX_XFERS] = air_end_ns;
+    dma_bytes += size;
+    return dev->xfer_submitted++;
+}
+
+int adidma_poll(adidma *dev, int64_t xfer)
+{
+    return get_nsec() >= xfer_end_ns[xfer % ADIDMA_MAX_XFERS];
+}
+
+int uio_init(uio_dev *dev, int uio_id)
+{
+    return 1;
+}
+
+void uio_destroy(uio_dev *dev)
+{
+}
+
+int uio_write(uio_dev *dev, int offset, uint32_t data)
+{
+    return 1;
+}
+
+/* Producer: the packet takes work_ns to come up, e.g. a camera frame or a GUI frame */
+static void produce(uint8_t *buf, size_t size, int idx, uint64_t work_ns)
+{
+    memset(buf, idx, size);
+    sleep_nsec(work_ns);
+}
+
+static void print_result(const char *name, uint64_t ns, uint64_t blocked_ns, size_t size)
+{
+    printf("%-16s %10.2f %12.1f %12.1f\n", name, BENCH_PACKS * size * 1e3 / ns, ns * 1e-6, blocked_ns * 1e-6);
+}
+
+static void bench_sync(txmodem *dev, uint8_t **bufs, size_t size, uint64_t work_ns)
+{
+    uint64_t blocked = 0, start = get_nsec();
+    for (int i = 0; i < BENCH_PACKS; i++)
+    {
+        produce(bufs[0], size, i, work_ns);
+        uint64_t tstart = get_nsec();
+        txmodem_write(dev, bufs[0], size);
+        blocked += get_nsec() - tstart;
+    }
+    print_result("sync", get_nsec() - start, blocked, size);
+}
+
+/* Buffer i % depth is free again once write i - depth has completed, which it has once write i is queued */
+static void bench_async_poll(txmodem *dev, uint8_t **bufs, int depth, size_t size, uint64_t work_ns)
+{
+    txmodem_async_t q[1];
+    if (txmodem_async_init(q, dev, depth, NULL, NULL) < 0)
+        return;
+    txmodem_async_cpl_t cpl[TXMODEM_ASYNC_DEPTH];
+    int done = 0, errors = 0;
+    uint64_t blocked = 0, start = get_nsec();
+    for (int i = 0; i < BENCH_PACKS; i++)
+    {
+        produce(bufs[i % depth], size, i, work_ns);
+        uint64_t tstart = get_nsec();
+        txmodem_write_async(q, bufs[i % depth], size, NULL);
+        blocked += get_nsec() - tstart;
+        for (int n; (n = txmodem_async_poll(q, cpl, depth)) > 0; done += n)
+            for (int j = 0; j < n; j++)
+                errors += cpl[j].ret < 0;
+    }
+    struct pollfd pfd = {.fd = txmodem_async_fd(q), .events = POLLIN};
+    while ((done < BENCH_PACKS) && (poll(&pfd, 1, 1000) > 0))
+    {
+        int n = txmodem_async_poll(q, cpl, depth);
+        for (int j = 0; j < n; j++)
+            errors += cpl[j].ret < 0;
+        done += n;
+    }
+    print_result("async + poll", get_nsec() - start, blocked, size);
+    if ((done != BENCH_PACKS) || errors)
+        printf("Completed %d of %d packets, %d errors\n", done, BENCH_PACKS, errors);
+    txmodem_async_destroy(q);
+}
+
+static void count_cpl(const txmodem_async_cpl_t *cpl, void *user)
+{
+    (*(int *)user)++;
+}
+
+static void bench_async_cb(txmodem *dev, uint8_t **bufs, int depth, size_t size, uint64_t work_ns)
+{
+    txmodem_async_t q[1];
+    int done = 0;
+    if (txmodem_async_init(q, dev, depth, &count_cpl, &done) < 0)
+        return;
+    uint64_t blocked = 0, start = get_nsec();
+    for (int i = 0; i < BENCH_PACKS; i++)
+    {
+        produce(bufs[i % depth], size, i, work_ns);
+        uint64_t tstart = get_nsec();
+        txmodem_write_async(q, bufs[i % depth], size, NULL);
+        blocked += get_nsec() - tstart;
+    }
+    txmodem_async_drain(q);
+    print_result("async + cb", get_nsec() - start, blocked, size);
+    if ((done != BENCH_PACKS) || q->num_errors)
+        printf("Completed %d of %d packets, %llu errors\n", done, BENCH_PACKS, (unsigned long long)q->num_errors);
+    txmodem_async_destroy(q);
+}
+
+typedef struct
+{
+    txmodem *dev;
+    txmodem_sched_t *s; // NULL to send through txmodem_write
+    pthread_mutex_t *m; // serializes txmodem_write
+    uint8_t *buf;
+    volatile int done;
+} bench_bulk_t;
+
+static int bench_prio_write(bench_bulk_t *b, int prio, uint8_t *buf, size_t size)
+{
+    if (b->s != NULL)
+        return txmodem_sched_write(b->s, prio, buf, size);
+    pthread_mutex_lock(b->m);
+    int ret = txmodem_write(b->dev, buf, size);
+    pthread_mutex_unlock(b->m);
+    return ret;
+}
+
+static void *bench_bulk_thread(void *arg)
+{
+    bench_bulk_t *b = (bench_bulk_t *)arg;
+    for (int i = 0; i < BENCH_BULK_PACKS; i++)
+        bench_prio_write(b, TXMODEM_PRIO_BULK, b->buf, BENCH_BULK_SZ);
+    b->done = 1;
+    return NULL;
+}
+
+/*
+ * An urgent packet every period_ns while a thread sends bulk packets back to
+ * back. Returns the longest time an urgent packet took to go on air with the
+ * scheduler, 0 without it.
+ */
+static uint64_t bench_prio(txmodem *dev, txmodem_sched_t *s, uint64_t period_ns)
+{
+    pthread_mutex_t m;
+    pthread_mutex_init(&m, NULL);
+    bench_bulk_t b = {.dev = dev, .s = s, .m = &m, .done = 0};
+    b.buf = (uint8_t *)malloc(BENCH_BULK_SZ);
+    memset(b.buf, 0xa5, BENCH_BULK_SZ);
+    uint8_t msg[BENCH_URGENT_SZ];
+    uint64_t lat = 0, max_lat = 0, start = get_nsec();
+    int num = 0;
+    pthread_t thr;
+    pthread_create(&thr, NULL, &bench_bulk_thread, &b);
+    while (!b.done)
+    {
+        sleep_nsec(period_ns);
+        memset(msg, num, sizeof(msg));
+        uint64_t tstart = get_nsec();
+        bench_prio_write(&b, TXMODEM_PRIO_URGENT, msg, sizeof(msg));
+        uint64_t ns = get_nsec() - tstart;
+        lat += ns;
+        max_lat = ns > max_lat ? ns : max_lat;
+        num++;
+    }
+    pthread_join(thr, NULL);
+    uint64_t ns = get_nsec() - start;
+    txmodem_sched_stats_t st[1];
+    memset(st, 0x0, sizeof(txmodem_sched_stats_t));
+    if (s != NULL)
+        txmodem_sched_stats(s, TXMODEM_PRIO_URGENT, st);
+    printf("%-16s %10d %12.3f %12.3f %12.3f %10.2f\n", s == NULL ? "txmodem_write" : "sched", num, lat * 1e-6 / (num > 0 ? num : 1), max_lat * 1e-6,
+           st->max_lat_ns * 1e-6, (double)BENCH_BULK_PACKS * BENCH_BULK_SZ * 1e3 / ns);
+    pthread_mutex_destroy(&m);
+    free(b.buf);
+    return st->max_lat_ns;
+}
+
+int main(int argc, char *argv[])
+{
+    prctl(PR_SET_TIMERSLACK, 1UL); // the DMA stand-in sleeps for the airtime, by default up to 50 us too long
+    size_t size = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_PACK_SZ;
+    air_rate = argc > 2 ? atof(argv[2]) * 1e6 : BENCH_AIR_RATE;
+    int depth = argc > 3 ? atoi(argv[3]) : 4;
+    if ((size == 0) || (air_rate <= 0) || (depth < 1) || (depth > TXMODEM_ASYNC_DEPTH))
+    {
+        printf("Invocation: %s [Packet size] [Air rate, MB/s] [Queue depth, 1 - %d]\n", argv[0], TXMODEM_ASYNC_DEPTH);
+        return 0;
+    }
+    txmodem dev[1];
+    if (txmodem_init(dev, 0, 0) < 0)
+        return -1;
+    dev->mtu = 4064;
+    uint8_t *bufs[TXMODEM_ASYNC_DEPTH];
+    for (int i = 0; i < depth; i++)
+        bufs[i] = (uint8_t *)malloc(size);
+    // airtime of a packet, with framing overhead
+    dma_bytes = 0;
+    txmodem_write(dev, bufs[0], size);
+    uint64_t air_ns = dma_bytes * 1e9 / air_rate;
+    printf("%d packets of %zu bytes, %.1f MB/s on air, %.3f ms airtime, queue depth %d\n", BENCH_PACKS, size, air_rate * 1e-6, air_ns * 1e-6, depth);
+    uint64_t work[] = {0, air_ns / 2, air_ns};
+    for (int w = 0; w < (int)(sizeof(work) / sizeof(work[0])); w++)
+    {
+        printf("\nProducer work per packet: %.3f ms\n", work[w] * 1e-6);
+        printf("%-16s %10s %12s %12s\n", "Mode", "MB/s", "Total (ms)", "Blocked (ms)");
+        bench_sync(dev, bufs, size, work[w]);
+        bench_async_poll(dev, bufs, depth, size, work[w]);
+        bench_async_cb(dev, bufs, depth, size, work[w]);
+    }
+    // airtime of a full frame
+    uint8_t *frame = (uint8_t *)calloc(1, dev->mtu);
+    dma_bytes = 0;
+    txmodem_write(dev, frame, dev->mtu);
+    free(frame);
+    uint64_t frame_ns = dma_bytes * 1e9 / air_rate;
+    printf("\nUrgent %d byte packets every 5 frames, bulk %d byte packets back to back, %.3f ms per frame\n", BENCH_URGENT_SZ, BENCH_BULK_SZ, frame_ns * 1e-6);
+    printf("%-16s %10s %12s %12s %12s %10s\n", "Mode", "Urgent", "Mean (ms)", "Max (ms)", "On air (ms)", "Bulk MB/s");
+    bench_prio(dev, NULL, 5 * frame_ns);
+    txmodem_sched_t s[1];
+    int ret = EXIT_SUCCESS;
+    if (txmodem_sched_init(s, dev, 0) > 0)
+    {
+        uint64_t on_air_ns = bench_prio(dev, s, 5 * frame_ns);
+        txmodem_sched_destroy(s);
+        // the scheduler puts urgent packets on air once the frame on air is out
+        if (on_air_ns > frame_ns)
+        {
+            printf("FAIL: urgent packets on air after up to %.3f ms, more than a frame time (%.3f ms)\n", on_air_ns * 1e-6, frame_ns * 1e-6);
+            ret = EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < depth; i++)
+        free(bufs[i]);
+    txmodem_destroy(dev);
+    return ret;
+}
@@ -13,8 +13,16 @@
 #include "adidma.h"
 #include "txmodem.h"
 #include "txrx_packdef.h"
+#include "libfec.h"
+#include "liblz.h"
 #include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+static int txmodem_ring_init(txmodem *dev);
+static void txmodem_ring_destroy(txmodem *dev);
 
 int txmodem_init(txmodem *dev, int txmodem_id, int txdma_id)
 {
@@ -41,10 +49,27 @@ int txmodem_init(txmodem *dev, int txmodem_id, int txdma_id)
     if (adidma_init(dev->dma, txdma_id, 0) < 0)
         return -1;
     dev->dma->tx_check_completion = 0;
+    dev->pack_crc = 0;
+    dev->fec_n = 0;
+    dev->fec_k = 0;
+    dev->hdr_version = MODEM_HDR_V1;
+    dev->compress = 0;
+    memset(&(dev->lz_stats), 0x0, sizeof(lz_stats_t));
+    dev->frames_tx = 0;
+    dev->tx_batch = TXMODEM_TX_BATCH;
+    dev->frame_acquired = 0;
+    dev->frame_cap = 0;
 #ifdef TXMODEM_DEBUG
     eprintf();
 #endif
-    dev->max_pack_sz = dev->dma->mem_sz;
+    dev->max_pack_sz = UINT32_MAX;
+    if (txmodem_ring_init(dev) < 0)
+    {
+        eprintf("Could not start the TX ring");
+        adidma_destroy(dev->dma);
+        uio_destroy(dev->bus);
+        return -1;
+    }
     return 1;
 }
 
@@ -55,123 +80,1481 @@ int txmodem_reset(txmodem *dev, int src_sel)
     return 1;
 }
 
-int txmodem_write(txmodem *dev, uint8_t *buf, ssize_t size)
+/*
+ * Add src, found at byte ofst of data frame j of the block, to the k parity
+ * shards of the block.
+ */
+static inline void txmodem_fec_update(int k, int j, uint8_t *parity, size_t mtu, size_t ofst, const uint8_t *src, size_t len)
 {
-    static uint32_t pack_id = 0;
-    if (size < 0)
+    uint8_t *parity_ptr[FEC_MAX_SHARDS];
+    for (int r = 0; r < k; r++)
+        parity_ptr[r] = parity + r * mtu + ofst;
+    fec_encode_update(k, j, src, len, parity_ptr);
+}
+
+/**
+ * @brief The packet goes on air as a stream of bytes cut into MTU sized
+ * frames: the packet descriptor (v2 only), the data, then the CRC32 trailer
+ * if enabled. The data is a list of fragments, read in place. Compressed data
+ * is produced block by block while it is framed, so its size is not known up
+ * front.
+ */
+typedef struct
+{
+    const uint8_t *seg[3];             /// Descriptor, data (unused, see iov), trailer
+    ssize_t seg_sz[3];                 /// Size of each segment (the data segment is the liblz block stream if lz is set)
+    int seg_idx;                       /// Segment being read
+    ssize_t seg_ofst;                  /// Read offset in the segment
+    const struct iovec *iov;           /// Data fragments
+    int iov_idx;                       /// Data fragment being read
+    size_t iov_ofst;                   /// Read offset in the data fragment
+    lz_enc_t *lz;                      /// Compressor of the data, NULL if sent as is
+    int pack_crc;                      /// Compute the CRC32 trailer
+    uint32_t crc;                      /// CRC32 of the data so far
+    uint8_t trailer[sizeof(uint32_t)]; /// CRC32 trailer, valid once the data has been consumed
+} txmodem_stream_t;
+
+/*
+ * Skip over exhausted segments, returns 1 at the end of the stream.
+ */
+static int txmodem_stream_eof(txmodem_stream_t *st)
+{
+    for (; st->seg_idx < 3; st->seg_idx++, st->seg_ofst = 0)
     {
-        eprintf("Data buffer size less than 0: %d\n", size);
-        return -1;
+        if ((st->seg_idx == 1) && (st->lz != NULL) ? !lz_enc_eof(st->lz) : (st->seg_ofst < st->seg_sz[st->seg_idx]))
+            break;
     }
+    return st->seg_idx == 3;
+}
+
+/*
+ * Read up to len bytes of the packet stream into the frame payload dst,
+ * updating the frame CRC16, the packet CRC32 and, if parity is not NULL, the
+ * parity shards of the block with data frame j. The source is read once.
+ * Returns the number of bytes read, less than len only at the end of the stream.
+ */
+static ssize_t txmodem_stream_read(txmodem_stream_t *st, uint16_t *crc, uint8_t *dst, ssize_t len, int k, int j, uint8_t *parity, size_t mtu)
+{
+    ssize_t dst_ofst = 0;
+    while ((dst_ofst < len) && !txmodem_stream_eof(st))
+    {
+        const uint8_t *src;
+        ssize_t sz;
+        if ((st->seg_idx == 1) && (st->lz != NULL)) // compresses the next block when the current one runs out
+            sz = lz_enc_next(st->lz, &src, len - dst_ofst);
+        else if (st->seg_idx == 1) // frames cross fragment boundaries
+        {
+            while (st->iov_ofst == st->iov[st->iov_idx].iov_len) // skip over consumed and empty fragments
+            {
+                st->iov_idx++;
+                st->iov_ofst = 0;
+            }
+            src = (const uint8_t *)st->iov[st->iov_idx].iov_base + st->iov_ofst;
+            sz = st->iov[st->iov_idx].iov_len - st->iov_ofst;
+            sz = sz < len - dst_ofst ? sz : len - dst_ofst;
+            st->iov_ofst += sz;
+        }
+        else
+        {
+            src = st->seg[st->seg_idx] + st->seg_ofst;
+            sz = st->seg_sz[st->seg_idx] - st->seg_ofst;
+            sz = sz < len - dst_ofst ? sz : len - dst_ofst;
+        }
+        *crc = crc16_copy_update(*crc, dst + dst_ofst, src, sz);
+        if ((st->seg_idx == 1) && st->pack_crc)
+        {
+            st->crc = crc32_update(st->crc, src, sz); // source is still in cache
+            memcpy(st->trailer, &(st->crc), sizeof(uint32_t));
+        }
+        if (parity != NULL)
+            txmodem_fec_update(k, j, parity, mtu, dst_ofst, src, sz);
+        st->seg_ofst += sz;
+        dst_ofst += sz;
+    }
+    return dst_ofst;
+}
+
+/*
+ * Revert an unset or out of range MTU to the default, and align it. Parity
+ * frames (fec) carry a header in front of the MTU sized shard.
+ */
+static void txmodem_check_mtu(txmodem *dev, int fec)
+{
     if (dev->mtu == 0 || dev->mtu < TXRX_MTU_MIN || dev->mtu > TXRX_MTU_MAX) // MTU not set or too small or too large, revert to default
     {
         // dev->mtu = 4072 - sizeof(modem_frame_header_t);
         dev->mtu = DEFAULT_FRAME_SZ - sizeof(modem_frame_header_t) - FRAME_PADDING * sizeof(uint64_t); // padding
     }
+    if (fec && (dev->mtu > (TXRX_MTU_MAX) - sizeof(modem_fec_header_t))) // parity frames carry a header in front of the shard
+        dev->mtu = (TXRX_MTU_MAX) - sizeof(modem_fec_header_t);
     // MODEM_BYTE_ALIGN-byte align MTU
     if (dev->mtu % MODEM_BYTE_ALIGN)
         dev->mtu = (dev->mtu / MODEM_BYTE_ALIGN) * MODEM_BYTE_ALIGN;
+}
+
+static uint32_t txmodem_pack_id = 0; // ID of the last packet, shared by txmodem_write and the zero-copy frames
+
+/*
+ * Close the frame at frame_ofst of the DMA buffer, whose frame_sz byte payload
+ * (CRC16 register crc) is already in place behind the header: write the TX IP
+ * frame size, the v1 or v2 header and the padding. flags go in the v2 header,
+ * pack_sz and num_frames in the v1 header. Returns the size of the frame in
+ * the DMA buffer, frame size included.
+ */
+static ssize_t txmodem_frame_close(txmodem *dev, ssize_t frame_ofst, int v2, int flags, uint32_t pack_id, uint32_t frame_id, uint16_t frame_sz, uint16_t crc, ssize_t pack_sz, int num_frames)
+{
+    ssize_t hdr_sz = v2 ? sizeof(modem_frame_header_v2_t) : sizeof(modem_frame_header_t);
+    uint8_t *frame = dev->dma->mem_virt_addr + frame_ofst;
+
+    /* Calculate frame padding */
+    size_t frame_padding = (frame_sz) % sizeof(uint64_t);                       // calculate how many bytes we are off by
+    frame_padding = (frame_padding > 0) ? sizeof(uint64_t) - frame_padding : 0; // calculate proper padding
 #ifdef TXDEBUG
-    eprintf("MTU: %u\n", dev->mtu);
+    if (frame_padding > 0)
+        eprintf("Frame padding = %u\n", frame_padding);
 #endif
-    // check how many frames possible at this MTU
-    ssize_t max_frame_sz = dev->mtu + sizeof(modem_frame_header_t) + ((FRAME_PADDING + 1) * sizeof(uint64_t)); // mtu + frame header + padding + frame length for TX make up one frame in mem
-    int max_num_frames = (dev->max_pack_sz) / (max_frame_sz);
-    int num_frames = (size / dev->mtu) + ((size % dev->mtu) > 0);
-    if (num_frames * max_frame_sz >= dev->max_pack_sz)
+    /* TX IP Core Frame Size */
+    uint64_t dma_frame_sz = frame_sz + frame_padding + hdr_sz + FRAME_PADDING * sizeof(uint64_t);
+    // dma_frame_sz += dma_frame_sz % MODEM_BYTE_ALIGN ? MODEM_BYTE_ALIGN - (dma_frame_sz % MODEM_BYTE_ALIGN) : 0; // 4-bytes aligned, will pad DMA buffer with extra zeros at the end if necessary
+
+    /* Copy frame size (used by the TX IP Core) */
+    memcpy(frame, &(dma_frame_sz), sizeof(uint64_t));
+    frame += sizeof(uint64_t);
+
+    /* Copy frame header */
+    if (v2)
     {
-        eprintf("Total required size exceeds buffer memory size", __func__);
-        return -1;
+        modem_frame_header_v2_t frame_hdr[1];
+        frame_hdr->ident = PACKET_GUID_V2;
+        frame_hdr->version = MODEM_HDR_V2;
+        frame_hdr->flags = flags;
+        frame_hdr->pack_id = pack_id;
+        frame_hdr->frame_sz = frame_sz;
+        frame_hdr->frame_id = frame_id;
+        frame_hdr->frame_crc = crc16_final(crc); // crc of frame
+        frame_hdr->hdr_crc = crc16((unsigned char *)frame_hdr, sizeof(modem_frame_header_v2_t) - sizeof(uint16_t));
+        memcpy(frame, frame_hdr, sizeof(modem_frame_header_v2_t));
     }
-#ifdef TXDEBUG
-    eprintf("Max Frames: %d | Frames: %d | Size: %ld\n", max_num_frames, num_frames, size);
-#endif
-    pack_id++; // increment packet ID on each call
-    ssize_t frame_ofst = 0;
-    ssize_t data_ofst = 0;
-    for (int i = 0; i < num_frames; i++) // for each frame
+    else
     {
-        /* Create header */
         modem_frame_header_t frame_hdr[1];
         frame_hdr->ident = PACKET_GUID;
         frame_hdr->pack_id = pack_id;
-        frame_hdr->pack_sz = size;
-        frame_hdr->frame_id = i;
+        frame_hdr->pack_sz = pack_sz;
+        frame_hdr->frame_id = frame_id;
         frame_hdr->num_frames = num_frames;
         frame_hdr->mtu = dev->mtu;
-        frame_hdr->frame_sz = dev->mtu < (size - data_ofst) ? dev->mtu : size - data_ofst; // data of frame
-        frame_hdr->frame_crc = crc16(buf + data_ofst, frame_hdr->frame_sz);                // crc of frame
-        frame_hdr->frame_crc2 = frame_hdr->frame_crc;                                      // copy of crc
-        /* Calculate frame padding */
-        size_t frame_padding = (frame_hdr->frame_sz) % sizeof(uint64_t);            // calculate how many bytes we are off by
-        frame_padding = (frame_padding > 0) ? sizeof(uint64_t) - frame_padding : 0; // calculate proper padding
-#ifdef TXDEBUG
-        if (frame_padding > 0)
-            eprintf("Frame padding = %u\n", frame_padding);
-#endif
-        /* TX IP Core Frame Size */
-        uint64_t dma_frame_sz = frame_hdr->frame_sz + frame_padding + sizeof(modem_frame_header_t) + FRAME_PADDING * sizeof(uint64_t);
-        // dma_frame_sz += dma_frame_sz % MODEM_BYTE_ALIGN ? MODEM_BYTE_ALIGN - (dma_frame_sz % MODEM_BYTE_ALIGN) : 0; // 4-bytes aligned, will pad DMA buffer with extra zeros at the end if necessary
+        frame_hdr->frame_sz = frame_sz;
+        frame_hdr->frame_crc = crc16_final(crc);      // crc of frame
+        frame_hdr->frame_crc2 = frame_hdr->frame_crc; // copy of crc
+        memcpy(frame, frame_hdr, sizeof(modem_frame_header_t));
+    }
+    frame += hdr_sz + frame_sz;
+
+    /* Padding Frame, then padding FRAME_PADDING * 8 bytes */
+    memset(frame, 0x0, frame_padding + FRAME_PADDING * sizeof(uint64_t));
+    return sizeof(uint64_t) + dma_frame_sz;
+}
+
+static inline uint64_t txmodem_nsec()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000L + ((uint64_t)ts.tv_nsec);
+}
+
+/*
+ * Bytes at the end of the buffer skipped by the head are never sent: a
+ * position at the gap moves on to the start of the next lap.
+ */
+static inline uint64_t txmodem_ring_skip(txmodem_ring_t *r, uint64_t pos)
+{
+    return (r->gap && (pos == r->gap)) ? (r->gap / r->size + 1) * r->size : pos;
+}
+
+/*
+ * Retire the oldest transfer in flight, ret is what adidma_wait or adidma_poll
+ * returned for it. Called with the ring locked.
+ */
+static void txmodem_ring_retire(txmodem_ring_t *r, int ret)
+{
+    r->tail = txmodem_ring_skip(r, r->xfer_end[r->xfer_head]);
+    r->xfer_head = (r->xfer_head + 1) % ADIDMA_MAX_XFERS;
+    r->xfer_cnt--;
+    r->idle_ns = txmodem_nsec();
+    if (ret < 0)
+        r->error = ret;
+    pthread_cond_broadcast(&(r->space));
+}
+
+/*
+ * Drain thread: queues the ready spans to the DMA, splitting them at the end
+ * of the buffer and at the gap, and retires the transfers that are out. It
+ * blocks on the oldest transfer only while the DMAC queue is full or a writer
+ * waits for frames in flight that are not out yet, otherwise it polls so newly
+ * ready frames go out right away. It also loops the beacon while the ring is idle, and stops
+ * it at the end of a repeat when frames are ready.
+ */
+static void *txmodem_ring_thread(void *arg)
+{
+    txmodem *dev = (txmodem *)arg;
+    txmodem_ring_t *r = dev->ring;
+    pthread_mutex_lock(&(r->m));
+    for (;;)
+    {
+        r->sent = txmodem_ring_skip(r, r->sent);
+        if ((r->xfer_cnt > 0) && ((r->xfer_cnt == ADIDMA_MAX_XFERS) || ((r->sent == r->ready) && ((r->tail < r->wait_pos) || r->done))))
+        {
+            int64_t xfer = r->xfer[r->xfer_head];
+            pthread_mutex_unlock(&(r->m));
+            int ret = adidma_wait(dev->dma, xfer);
+            pthread_mutex_lock(&(r->m));
+            txmodem_ring_retire(r, ret);
+        }
+        else if (r->sent < r->ready)
+        {
+            uint64_t start = r->sent;
+            uint64_t end = (start / r->size + 1) * r->size; // end of the buffer
+            if ((r->gap > start) && (r->gap < end))
+                end = r->gap;
+            if (r->ready < end)
+                end = r->ready;
+            else
+                r->num_splits++;
+            int takeover = r->beacon_on;
+            r->beacon_on = 0;
+            r->num_takeovers += takeover;
+            pthread_mutex_unlock(&(r->m));
+            if (takeover) // the beacon repeat on air is the last one and runs to its end
+                adidma_stop(dev->dma);
+            int64_t xfer = adidma_submit(dev->dma, start % r->size, end - start, ADIDMA_DIR_TX);
+            pthread_mutex_lock(&(r->m));
+            r->sent = end;
+            if (xfer < 0)
+            {
+                eprintf("Could not queue %llu bytes at %llu", (unsigned long long)(end - start), (unsigned long long)(start % r->size));
+                r->error = xfer;
+                r->tail = txmodem_ring_skip(r, end); // the transfers in flight complete first, none are
+                pthread_cond_broadcast(&(r->space));
+                continue;
+            }
+            int idx = (r->xfer_head + r->xfer_cnt++) % ADIDMA_MAX_XFERS;
+            r->xfer[idx] = xfer;
+            r->xfer_end[idx] = end;
+            r->num_xfers++;
+        }
+        else if (r->xfer_cnt > 0)
+        {
+            int64_t xfer = r->xfer[r->xfer_head];
+            pthread_mutex_unlock(&(r->m));
+            int ret = adidma_poll(dev->dma, xfer);
+            pthread_mutex_lock(&(r->m));
+            if (ret != 0)
+                txmodem_ring_retire(r, ret);
+            else if ((r->sent == r->ready) && (r->tail >= r->wait_pos) && !(r->done)) // nothing came in while polling
+            {
+                struct timespec ts;
+                timespec_get(&ts, TIME_UTC);
+                ts.tv_nsec += TXMODEM_RING_POLL_US * 1000L;
+                ts.tv_sec += ts.tv_nsec / 1000000000L;
+                ts.tv_nsec %= 1000000000L;
+                pthread_cond_timedwait(&(r->cond), &(r->m), &ts);
+            }
+        }
+        else if (r->done)
+            break;
+        else if (r->beacon_on && !(r->beacon))
+        {
+            pthread_mutex_unlock(&(r->m));
+            adidma_stop(dev->dma);
+            pthread_mutex_lock(&(r->m));
+            r->beacon_on = 0;
+            pthread_cond_broadcast(&(r->space));
+        }
+        else if (r->beacon && !(r->beacon_on)) // loops the beacon once the ring has been idle for a while
+        {
+            uint64_t start = r->idle_ns + TXMODEM_BEACON_IDLE_US * 1000ULL;
+            if (txmodem_nsec() < start)
+            {
+                struct timespec ts;
+                ts.tv_sec = start / 1000000000L;
+                ts.tv_nsec = start % 1000000000L;
+                pthread_cond_timedwait(&(r->cond), &(r->m), &ts);
+                continue;
+            }
+            pthread_mutex_unlock(&(r->m));
+            int ret = adidma_write(dev->dma, r->beacon_ofst, r->beacon_sz, 1);
+            pthread_mutex_lock(&(r->m));
+            if (ret < 0)
+            {
+                eprintf("Could not start the beacon: %d", ret);
+                r->beacon = 0;
+                continue;
+            }
+            r->beacon_on = 1;
+            r->num_beacons++;
+        }
+        else
+            pthread_cond_wait(&(r->cond), &(r->m));
+    }
+    if (r->beacon_on)
+    {
+        adidma_stop(dev->dma);
+        r->beacon_on = 0;
+    }
+    pthread_mutex_unlock(&(r->m));
+    return NULL;
+}
+
+static int txmodem_ring_init(txmodem *dev)
+{
+    txmodem_ring_t *r = dev->ring;
+    memset(r, 0x0, sizeof(txmodem_ring_t));
+    r->size = dev->dma->mem_sz;
+    pthread_mutex_init(&(r->m), NULL);
+    pthread_cond_init(&(r->cond), NULL);
+    pthread_cond_init(&(r->space), NULL);
+    if (pthread_create(r->thr, NULL, &txmodem_ring_thread, dev) != 0)
+    {
+        pthread_mutex_destroy(&(r->m));
+        pthread_cond_destroy(&(r->cond));
+        pthread_cond_destroy(&(r->space));
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Hand the frames up to the head to the drain thread. Called with the ring locked.
+ */
+static inline void txmodem_ring_publish(txmodem_ring_t *r)
+{
+    if (r->ready < r->head)
+    {
+        r->ready = r->head;
+        pthread_cond_signal(&(r->cond));
+    }
+}
+
+/*
+ * Wait for sz contiguous bytes at the head of the ring, and return the
+ * position they start at. If they do not fit before the end of the buffer, the
+ * rest of the buffer is skipped and they start at offset 0. The frames already
+ * written are handed to the drain thread if the ring is full. The head is held
+ * until the writer moves past its frame with txmodem_ring_advance, other
+ * writers wait here meanwhile.
+ */
+static uint64_t txmodem_ring_reserve(txmodem *dev, size_t sz)
+{
+    txmodem_ring_t *r = dev->ring;
+    pthread_mutex_lock(&(r->m));
+    while (r->held)
+        pthread_cond_wait(&(r->space), &(r->m));
+    uint64_t pos = r->head;
+    if ((pos % r->size) + sz > r->size)
+        pos += r->size - (pos % r->size);
+    if (pos + sz - r->tail > r->size)
+    {
+        txmodem_ring_publish(r);
+        if (r->wait_pos < pos + sz - r->size)
+            r->wait_pos = pos + sz - r->size;
+        while (pos + sz - r->tail > r->size)
+            pthread_cond_wait(&(r->space), &(r->m));
+    }
+    if (pos != r->head) // the drain thread moves past the gap
+    {
+        r->gap = r->head;
+        r->head = pos;
+        r->ready = txmodem_ring_skip(r, r->ready);
+        r->sent = txmodem_ring_skip(r, r->sent);
+        r->tail = txmodem_ring_skip(r, r->tail);
+    }
+    r->held = 1;
+    pthread_mutex_unlock(&(r->m));
+    return pos;
+}
 
-        /* Copy frame size (used by the TX IP Core) */
-        memcpy(dev->dma->mem_virt_addr + frame_ofst, &(dma_frame_sz), sizeof(uint64_t));
-        frame_ofst += sizeof(uint64_t);
+/*
+ * Move the head to end, past the frame written at the position
+ * txmodem_ring_reserve returned, and let the other writers in
+ */
+static void txmodem_ring_advance(txmodem_ring_t *r, uint64_t end)
+{
+    pthread_mutex_lock(&(r->m));
+    r->head = end;
+    r->held = 0;
+    pthread_cond_broadcast(&(r->space));
+    pthread_mutex_unlock(&(r->m));
+}
+
+/*
+ * Hand the frames up to the head to the drain thread and wait until the ones
+ * before pos are out.
+ */
+static void txmodem_ring_wait(txmodem *dev, uint64_t pos)
+{
+    txmodem_ring_t *r = dev->ring;
+    pthread_mutex_lock(&(r->m));
+    txmodem_ring_publish(r);
+    if (r->wait_pos < pos)
+        r->wait_pos = pos;
+    pthread_cond_signal(&(r->cond)); // the drain thread may be polling
+    while (r->tail < pos)
+        pthread_cond_wait(&(r->space), &(r->m));
+    pthread_mutex_unlock(&(r->m));
+}
+
+/*
+ * Returns the DMA error since the last call, if any, and clears it
+ */
+static int txmodem_ring_error(txmodem_ring_t *r)
+{
+    pthread_mutex_lock(&(r->m));
+    int ret = r->error < 0 ? r->error : 1;
+    r->error = 0;
+    pthread_mutex_unlock(&(r->m));
+    return ret;
+}
+
+/*
+ * Hand the frames up to the head to the drain thread and wait until they are
+ * out. Returns the DMA error since the last wait, if any.
+ */
+static int txmodem_ring_sync(txmodem *dev)
+{
+    txmodem_ring_wait(dev, dev->ring->head);
+    return txmodem_ring_error(dev->ring);
+}
+
+/*
+ * Wait until the frames in flight are out and resize the ring, the positions
+ * move on to the start of a lap of the new size. Returns the DMA error since
+ * the last wait, if any.
+ */
+static int txmodem_ring_resize(txmodem *dev, uint64_t size)
+{
+    txmodem_ring_t *r = dev->ring;
+    int ret = txmodem_ring_sync(dev);
+    pthread_mutex_lock(&(r->m));
+    uint64_t pos = (r->head / size + 1) * size;
+    r->size = size;
+    r->head = pos;
+    r->ready = pos;
+    r->sent = pos;
+    r->tail = pos;
+    r->gap = 0;
+    pthread_mutex_unlock(&(r->m));
+    return ret;
+}
+
+static void txmodem_ring_destroy(txmodem *dev)
+{
+    txmodem_ring_t *r = dev->ring;
+    txmodem_ring_sync(dev);
+    pthread_mutex_lock(&(r->m));
+    r->done = 1;
+    pthread_cond_signal(&(r->cond));
+    pthread_mutex_unlock(&(r->m));
+    pthread_join(r->thr[0], NULL);
+    pthread_mutex_destroy(&(r->m));
+    pthread_cond_destroy(&(r->cond));
+    pthread_cond_destroy(&(r->space));
+}
+
+/**
+ * @brief Framing state of a packet. Its frames are written to the TX ring
+ * one at a time, so the frames of several packets can be interleaved. The
+ * stream points into the struct, which must not move once initialized.
+ */
+typedef struct
+{
+    txmodem *dev;                /// TX modem the packet is framed for
+    txmodem_stream_t st[1];      /// Packet stream
+    modem_packet_desc_t desc[1]; /// Packet descriptor, first in the stream
+    lz_enc_t enc[1];             /// Compressor, if lz is set
+    uint8_t *parity;             /// Parity shards of the block, if fec is set
+    ssize_t size;                /// Packet size
+    ssize_t stream_sz;           /// Stream size, upper bound if compressed
+    ssize_t max_frame_sz;        /// Size of a frame in the TX ring, frame size included
+    ssize_t data_ofst;           /// Stream bytes framed so far
+    int lz;                      /// Compressed
+    int fec;                     /// Erasure coded
+    int v2;                      /// v2 headers
+    int pack_flags;              /// Flags set in every v2 header
+    uint32_t pack_id;            /// Packet ID
+    int num_frames;              /// Frames of the packet, upper bound if compressed
+    int frame_idx;               /// Frames written so far
+    int data_frame;              /// Data frames written so far
+    int block, block_frame, parity_idx; /// Erasure code block position
+    int closed;                  /// Every data and parity frame is written
+} txmodem_pack_t;
+
+/*
+ * Set up the framing of the packet made of the iovcnt fragments of iov,
+ * pack_flags (MODEM_FLAG_AGG) are set in the v2 header of every frame and
+ * select v2 headers.
+ */
+static int txmodem_pack_init(txmodem_pack_t *p, txmodem *dev, const struct iovec *iov, int iovcnt, int pack_flags)
+{
+    ssize_t size = 0;
+    if ((iov == NULL) || (iovcnt < 0))
+    {
+        eprintf("Invalid fragment list");
+        return -1;
+    }
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if ((iov[i].iov_base == NULL) && (iov[i].iov_len > 0))
+        {
+            eprintf("Fragment %d has no data", i);
+            return -1;
+        }
+        size += iov[i].iov_len;
+    }
+    if (size < 0)
+    {
+        eprintf("Data buffer size less than 0: %d\n", size);
+        return -1;
+    }
+    int fec = (dev->fec_n > 0) && (dev->fec_k > 0);
+    if (fec && (dev->fec_n + dev->fec_k > FEC_MAX_SHARDS))
+    {
+        eprintf("Erasure code block of %d + %d frames too large", dev->fec_n, dev->fec_k);
+        return -1;
+    }
+    txmodem_check_mtu(dev, fec);
 #ifdef TXDEBUG
-        eprintf("Loop %d | Frame sz: %u, Frame ofst: %d, data ofst: %d, wrote frame sz\n", i, frame_hdr->frame_sz, frame_ofst, data_ofst);
+    eprintf("MTU: %u\n", dev->mtu);
 #endif
-
-        /* Copy frame header */
-        memcpy(dev->dma->mem_virt_addr + frame_ofst, &(frame_hdr), sizeof(modem_frame_header_t)); // copy frame header
-        frame_ofst += sizeof(modem_frame_header_t);
+    memset(p, 0x0, sizeof(txmodem_pack_t));
+    p->dev = dev;
+    p->size = size;
+    p->fec = fec;
+    p->lz = dev->compress;
+    p->v2 = p->lz || pack_flags || (dev->hdr_version == MODEM_HDR_V2); // compressed and aggregated packets are marked in the v2 header
+    p->pack_flags = pack_flags;
+    ssize_t hdr_sz = p->v2 ? sizeof(modem_frame_header_v2_t) : sizeof(modem_frame_header_t);
+    // check how many frames possible at this MTU
+    p->max_frame_sz = dev->mtu + hdr_sz + ((FRAME_PADDING + 1) * sizeof(uint64_t)); // mtu + frame header + padding + frame length for TX make up one frame in mem
+    if (fec)
+        p->max_frame_sz += sizeof(modem_fec_header_t);
+    /* Packet stream: descriptor, data, trailer */
+    txmodem_stream_t *st = p->st;
+    st->seg[0] = (uint8_t *)(p->desc);
+    st->seg_sz[0] = p->v2 ? sizeof(modem_packet_desc_t) : 0;
+    st->seg[1] = NULL;
+    st->seg_sz[1] = p->lz ? LZ_STREAM_BOUND(size) : size; // upper bound if compressed
+    st->iov = iov;
+    st->seg[2] = st->trailer;
+    st->seg_sz[2] = dev->pack_crc ? sizeof(uint32_t) : 0; // packet CRC32 trailer is framed after the data
+    st->pack_crc = dev->pack_crc;
+    p->stream_sz = st->seg_sz[0] + st->seg_sz[1] + st->seg_sz[2];
+    int num_data_frames = (p->stream_sz / dev->mtu) + ((p->stream_sz % dev->mtu) > 0);
+    p->num_frames = num_data_frames; // upper bound if compressed
+    if (fec) // fec_k parity frames after each block of fec_n data frames
+        p->num_frames += dev->fec_k * ((num_data_frames / dev->fec_n) + ((num_data_frames % dev->fec_n) > 0));
+    if ((size_t)size > dev->max_pack_sz)
+    {
+        eprintf("Packet size exceeds the maximum packet size");
+        return -1;
+    }
+    if (2 * p->max_frame_sz > (ssize_t)dev->ring->size) // frames stream through the TX ring
+    {
+        eprintf("TX ring too small for the MTU");
+        return -1;
+    }
+    if (p->lz && (lz_enc_init_iov(p->enc, iov, iovcnt) < 0))
+    {
+        eprintf("Unable to allocate memory for compression");
+        return -1;
+    }
+    st->lz = p->lz ? p->enc : NULL;
+    if (fec && ((p->parity = (uint8_t *)calloc(dev->fec_k, dev->mtu)) == NULL))
+    {
+        eprintf("Unable to allocate memory for parity frames");
+        if (p->lz)
+            lz_enc_free(p->enc);
+        return -1;
+    }
 #ifdef TXDEBUG
-        eprintf("Loop %d | Frame sz: %u, Frame ofst: %d, data ofst: %d, wrote frame hdr\n", i, frame_hdr->frame_sz, frame_ofst, data_ofst);
+    eprintf("Frames: %d | Size: %ld\n", p->num_frames, size);
 #endif
+    p->pack_id = ++txmodem_pack_id; // increment packet ID on each call
+    p->desc->pack_sz = size;
+    p->desc->num_frames = p->lz ? 0 : p->num_frames;
+    p->desc->mtu = dev->mtu;
+    return 1;
+}
 
-        /* Copy frame data */
-        memcpy(dev->dma->mem_virt_addr + frame_ofst, buf + data_ofst, frame_hdr->frame_sz); // copy data
-        /* Fix frame offset for DMA */
-        frame_ofst += frame_hdr->frame_sz;
+/*
+ * Write the next frame of the packet at the head of the TX ring, waiting for
+ * space. The frames are handed to the drain thread every tx_batch bytes.
+ * Returns 1 if a frame was written, 0 once the packet is fully framed.
+ */
+static int txmodem_pack_next(txmodem_pack_t *p)
+{
+    txmodem *dev = p->dev;
+    txmodem_ring_t *r = dev->ring;
+    txmodem_stream_t *st = p->st;
+    if (p->closed)
+        return 0;
+    int data_done = txmodem_stream_eof(st);
+    int is_parity = p->fec && ((p->block_frame == dev->fec_n) || (data_done && (p->block_frame > 0))); // data frames of this block are out
+    if ((p->frame_idx == p->num_frames) || (data_done && !is_parity))
+    {
+        p->closed = 1;
+        if (p->num_frames <= 5)
+            return 0;
+        // create back pressure, the closing frame goes out with the last batch
+        ssize_t max_frame_sz = p->max_frame_sz;
+        uint64_t pos = txmodem_ring_reserve(dev, max_frame_sz);
+        ssize_t frame_ofst = pos % r->size;
+        memset(dev->dma->mem_virt_addr + frame_ofst, 0x0, max_frame_sz);
+        max_frame_sz -= sizeof(uint64_t);
+        memcpy(dev->dma->mem_virt_addr + frame_ofst, &max_frame_sz, sizeof(uint64_t));
+        txmodem_ring_advance(r, pos + max_frame_sz + sizeof(uint64_t));
+        return 1;
+    }
+    ssize_t hdr_sz = p->v2 ? sizeof(modem_frame_header_v2_t) : sizeof(modem_frame_header_t);
+    uint32_t frame_id = is_parity ? MODEM_FRAME_PARITY | p->block : p->data_frame;
+    uint16_t frame_sz;
+    int last;
 
-        /* Padding Frame */
-        memset(dev->dma->mem_virt_addr + frame_ofst, 0x0, frame_padding);
-        frame_ofst += frame_padding;
+    /* Copy frame data and calculate its CRC in the same pass, frame size and header go in front of it afterwards */
+    uint64_t pos = txmodem_ring_reserve(dev, p->max_frame_sz);
+    ssize_t frame_ofst = pos % r->size;
+    uint8_t *payload = dev->dma->mem_virt_addr + frame_ofst + sizeof(uint64_t) + hdr_sz;
+    uint16_t crc = CRC16_INIT;
+    if (is_parity)
+    {
+        modem_fec_header_t fec_hdr[1];
+        fec_hdr->stream_sz = p->lz ? p->data_ofst : p->stream_sz; // compressed stream size is only known at the last block
+        fec_hdr->n = dev->fec_n;
+        fec_hdr->k = dev->fec_k;
+        fec_hdr->idx = p->parity_idx;
+        fec_hdr->rsvd = 0;
+        crc = crc16_copy_update(crc, payload, fec_hdr, sizeof(modem_fec_header_t));
+        crc = crc16_copy_update(crc, payload + sizeof(modem_fec_header_t), p->parity + p->parity_idx * dev->mtu, dev->mtu);
+        frame_sz = sizeof(modem_fec_header_t) + dev->mtu;
+        last = data_done && (p->parity_idx == dev->fec_k - 1);
+    }
+    else
+    {
+        frame_sz = txmodem_stream_read(st, &crc, payload, dev->mtu, dev->fec_k, p->block_frame, p->parity, dev->mtu);
+        last = !p->fec && txmodem_stream_eof(st);
+    }
 
-        /* Padding FRAME_PADDING * 8 bytes */
-        memset(dev->dma->mem_virt_addr + frame_ofst, 0x0, FRAME_PADDING * sizeof(uint64_t));
-        frame_ofst += FRAME_PADDING * sizeof(uint64_t);
+    int flags = (dev->pack_crc ? MODEM_FLAG_PACK_CRC : 0) | (p->fec ? MODEM_FLAG_FEC : 0) | (p->lz ? MODEM_FLAG_LZ : 0) | p->pack_flags;
+    if (frame_id == 0)
+        flags |= MODEM_FLAG_DESC;
+    if (last)
+        flags |= MODEM_FLAG_LAST;
+    txmodem_ring_advance(r, pos + txmodem_frame_close(dev, frame_ofst, p->v2, flags, p->pack_id, frame_id, frame_sz, crc, p->size, p->num_frames));
 
-        /* Data offset */
-        data_ofst += frame_hdr->frame_sz;
-#ifdef TXDEBUG
-        eprintf("Loop %d | Frame sz: %u, Frame ofst: %d, data ofst: %d, CRC: 0x%04x, wrote frame data\n", i, frame_hdr->frame_sz, frame_ofst, data_ofst, frame_hdr->frame_crc);
-#endif
-        if (num_frames > 5)
+    /* Data offset, erasure code block position */
+    if (is_parity)
+    {
+        if (++(p->parity_idx) == dev->fec_k) // block done
         {
-            frame_ofst = 0;
-            adidma_write(dev->dma, 0x0, dma_frame_sz + sizeof(uint64_t), 0);
-            if (((i % 4) == 0) && (i > 0))
-                usleep(1000);
+            memset(p->parity, 0x0, dev->fec_k * dev->mtu);
+            p->parity_idx = 0;
+            p->block_frame = 0;
+            p->block++;
         }
     }
+    else
+    {
+        p->data_ofst += frame_sz;
+        p->data_frame++;
+        p->block_frame++;
+    }
 #ifdef TXDEBUG
-    FILE *fp = fopen("out_tx.txt", "wb");
-    fwrite(dev->dma->mem_virt_addr, 0x1, frame_ofst, fp);
-    fclose(fp);
+    eprintf("Loop %d | Frame sz: %u, Frame ofst: %d, data ofst: %d, CRC: 0x%04x, wrote frame data\n", p->frame_idx, frame_sz, frame_ofst, p->data_ofst, crc16_final(crc));
 #endif
-    if (num_frames <= 5)
-        return adidma_write(dev->dma, 0x0, frame_ofst, 0);
-    else // create back pressure
+    p->frame_idx++;
+    dev->frames_tx++;
+    if (r->head - r->ready >= dev->tx_batch) // frames go out in batches, framed while the drain thread queues the ones before
     {
-        memset(dev->dma->mem_virt_addr, 0x0, max_frame_sz);
-        max_frame_sz -= sizeof(uint64_t);
-        memcpy(dev->dma->mem_virt_addr, &max_frame_sz, sizeof(uint64_t));
-        return adidma_write(dev->dma, 0x0, max_frame_sz + sizeof(uint64_t), 0);
+        pthread_mutex_lock(&(r->m));
+        txmodem_ring_publish(r);
+        pthread_mutex_unlock(&(r->m));
     }
-    return 0;
+    return 1;
+}
+
+/*
+ * Free the framing state, the compression statistics go to the txmodem
+ */
+static void txmodem_pack_free(txmodem_pack_t *p)
+{
+    if (p->lz)
+    {
+        p->dev->lz_stats = p->enc->stats;
+        lz_enc_free(p->enc);
+    }
+    free(p->parity);
+}
+
+/*
+ * Frame and transmit the packet made of the iovcnt fragments of iov,
+ * pack_flags (MODEM_FLAG_AGG) are set in the v2 header of every frame and
+ * select v2 headers.
+ */
+static int txmodem_write_packet(txmodem *dev, const struct iovec *iov, int iovcnt, int pack_flags)
+{
+    txmodem_pack_t p[1];
+    if (txmodem_pack_init(p, dev, iov, iovcnt, pack_flags) < 0)
+        return -1;
+    while (txmodem_pack_next(p) > 0)
+        ;
+    txmodem_pack_free(p);
+    return txmodem_ring_sync(dev);
+}
+
+int txmodem_write(txmodem *dev, uint8_t *buf, ssize_t size)
+{
+    if (dev->frame_acquired)
+    {
+        eprintf("A frame is acquired");
+        return -1;
+    }
+    if (size < 0)
+    {
+        eprintf("Data buffer size less than 0: %zd", size);
+        return -1;
+    }
+    struct iovec iov[1];
+    iov->iov_base = buf;
+    iov->iov_len = size;
+    return txmodem_write_packet(dev, iov, 1, 0);
+}
+
+int txmodem_writev(txmodem *dev, const struct iovec *iov, int iovcnt)
+{
+    if (dev->frame_acquired)
+    {
+        eprintf("A frame is acquired");
+        return -1;
+    }
+    return txmodem_write_packet(dev, iov, iovcnt, 0);
+}
+
+/*
+ * Send the pending messages. The fill buffer is swapped out under the lock, so
+ * producers keep queueing while the packet is on air; flushes are serialized
+ * in order by tx_m.
+ */
+static int txmodem_agg_send(txmodem_agg_t *agg)
+{
+    int ret = 0;
+    pthread_mutex_lock(&(agg->tx_m));
+    pthread_mutex_lock(&(agg->m));
+    uint8_t *buf = agg->buf[agg->fill];
+    size_t sz = agg->sz;
+    int num_msgs = agg->pend_msgs;
+    agg->fill = !(agg->fill);
+    agg->sz = 0;
+    agg->pend_msgs = 0;
+    pthread_cond_broadcast(&(agg->swap));
+    pthread_mutex_unlock(&(agg->m));
+    if (sz > 0)
+    {
+        struct iovec iov[1];
+        iov->iov_base = buf;
+        iov->iov_len = sz;
+        ret = txmodem_write_packet(agg->dev, iov, 1, MODEM_FLAG_AGG);
+        agg->num_packs++;
+        agg->num_msgs += num_msgs;
+        agg->num_bytes += sz;
+    }
+    pthread_mutex_unlock(&(agg->tx_m));
+    return ret;
+}
+
+/*
+ * Flushes the pending messages once the oldest one has waited max_delay_ms
+ */
+static void *txmodem_agg_thread(void *__agg)
+{
+    txmodem_agg_t *agg = (txmodem_agg_t *)__agg;
+    pthread_mutex_lock(&(agg->m));
+    while (!(agg->done))
+    {
+        if (agg->sz == 0)
+        {
+            pthread_cond_wait(&(agg->cond), &(agg->m));
+            continue;
+        }
+        uint64_t deadline = agg->first_ns + agg->max_delay_ms * 1000000ULL;
+        if (txmodem_nsec() < deadline)
+        {
+            struct timespec ts;
+            ts.tv_sec = deadline / 1000000000L;
+            ts.tv_nsec = deadline % 1000000000L;
+            pthread_cond_timedwait(&(agg->cond), &(agg->m), &ts);
+            continue;
+        }
+        pthread_mutex_unlock(&(agg->m));
+        txmodem_agg_send(agg);
+        pthread_mutex_lock(&(agg->m));
+    }
+    pthread_mutex_unlock(&(agg->m));
+    return NULL;
+}
+
+int txmodem_agg_init(txmodem_agg_t *agg, txmodem *dev, size_t threshold, int max_delay_ms)
+{
+    if ((agg == NULL) || (dev == NULL))
+        return -1;
+    memset(agg, 0x0, sizeof(txmodem_agg_t));
+    if ((threshold == 0) || (threshold > dev->max_pack_sz))
+        threshold = TXMODEM_AGG_THRESHOLD;
+    agg->dev = dev;
+    agg->threshold = threshold;
+    agg->max_delay_ms = max_delay_ms > 0 ? max_delay_ms : TXMODEM_AGG_MAX_DELAY;
+    agg->cap = threshold + sizeof(modem_agg_len_t) + MODEM_AGG_MAX_MSG; // a message is always appended before the threshold check
+    agg->buf[0] = (uint8_t *)malloc(agg->cap);
+    agg->buf[1] = (uint8_t *)malloc(agg->cap);
+    if ((agg->buf[0] == NULL) || (agg->buf[1] == NULL))
+    {
+        eprintf("Unable to allocate memory for aggregation buffers");
+        free(agg->buf[0]);
+        free(agg->buf[1]);
+        return -1;
+    }
+    pthread_mutex_init(&(agg->m), NULL);
+    pthread_mutex_init(&(agg->tx_m), NULL);
+    pthread_cond_init(&(agg->cond), NULL);
+    pthread_cond_init(&(agg->swap), NULL);
+    if (pthread_create(agg->thr, NULL, &txmodem_agg_thread, agg) != 0)
+    {
+        eprintf("Unable to start aggregation timer thread");
+        perror("pthread_create");
+        pthread_mutex_destroy(&(agg->m));
+        pthread_mutex_destroy(&(agg->tx_m));
+        pthread_cond_destroy(&(agg->cond));
+        pthread_cond_destroy(&(agg->swap));
+        free(agg->buf[0]);
+        free(agg->buf[1]);
+        return -1;
+    }
+    return 1;
+}
+
+int txmodem_agg_writev(txmodem_agg_t *agg, const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (len > MODEM_AGG_MAX_MSG)
+    {
+        eprintf("Message of %zu bytes too large to aggregate", len);
+        return -1;
+    }
+    modem_agg_len_t msg_len = len;
+    pthread_mutex_lock(&(agg->m));
+    while (agg->sz + sizeof(modem_agg_len_t) + len > agg->cap) // past the threshold, the producer that crossed it is sending
+        pthread_cond_wait(&(agg->swap), &(agg->m));
+    uint8_t *dst = agg->buf[agg->fill] + agg->sz;
+    memcpy(dst, &msg_len, sizeof(modem_agg_len_t));
+    dst += sizeof(modem_agg_len_t);
+    for (int i = 0; i < iovcnt; i++) // fragments are copied straight into the fill buffer
+    {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+    if (agg->sz == 0) // arm the timer for the oldest message
+    {
+        agg->first_ns = txmodem_nsec();
+        pthread_cond_signal(&(agg->cond));
+    }
+    agg->sz += sizeof(modem_agg_len_t) + len;
+    agg->pend_msgs++;
+    int flush = agg->sz >= agg->threshold;
+    pthread_mutex_unlock(&(agg->m));
+    int ret = flush ? txmodem_agg_send(agg) : 1;
+    return ret == 0 ? 1 : ret; // 0 if another producer or the timer sent the message first
+}
+
+int txmodem_agg_write(txmodem_agg_t *agg, const uint8_t *msg, size_t len)
+{
+    struct iovec iov[1];
+    iov->iov_base = (void *)msg;
+    iov->iov_len = len;
+    return txmodem_agg_writev(agg, iov, 1);
+}
+
+int txmodem_agg_flush(txmodem_agg_t *agg)
+{
+    return txmodem_agg_send(agg);
+}
+
+void txmodem_agg_destroy(txmodem_agg_t *agg)
+{
+    pthread_mutex_lock(&(agg->m));
+    agg->done = 1;
+    pthread_cond_signal(&(agg->cond));
+    pthread_mutex_unlock(&(agg->m));
+    pthread_join(agg->thr[0], NULL);
+    txmodem_agg_send(agg);
+    pthread_mutex_destroy(&(agg->m));
+    pthread_mutex_destroy(&(agg->tx_m));
+    pthread_cond_destroy(&(agg->cond));
+    pthread_cond_destroy(&(agg->swap));
+    free(agg->buf[0]);
+    free(agg->buf[1]);
+}
+
+/*
+ * Transmits the queued packets in order. The request stays in the ring while
+ * it is on air, so a slot only frees up once its completion is delivered. The
+ * worker pauses while the completion ring is full.
+ */
+static void *txmodem_async_thread(void *__q)
+{
+    txmodem_async_t *q = (txmodem_async_t *)__q;
+    pthread_mutex_lock(&(q->m));
+    while (1)
+    {
+        if ((q->req_cnt == 0) && q->done)
+            break;
+        if ((q->req_cnt == 0) || ((q->cpl_cnt == q->depth) && !(q->done)))
+        {
+            pthread_cond_wait(&(q->cond), &(q->m));
+            continue;
+        }
+        txmodem_async_req_t req = q->req[q->req_head];
+        q->busy = 1;
+        pthread_mutex_unlock(&(q->m));
+
+        txmodem_async_cpl_t cpl;
+        cpl.id = req.id;
+        cpl.tag = req.tag;
+        struct iovec iov[1];
+        iov->iov_base = (void *)req.buf;
+        iov->iov_len = req.size;
+        cpl.ret = req.size < 0 ? -1 : txmodem_write_packet(q->dev, iov, 1, 0);
+        if (q->cb != NULL)
+            q->cb(&cpl, q->user);
+
+        pthread_mutex_lock(&(q->m));
+        q->req_head = (q->req_head + 1) % q->depth;
+        q->req_cnt--;
+        q->busy = 0;
+        if (cpl.ret < 0)
+            q->num_errors++;
+        else
+        {
+            q->num_packs++;
+            q->num_bytes += req.size;
+        }
+        if (q->cb == NULL)
+        {
+            if (q->cpl_cnt == q->depth) // shutting down, nobody polls any more
+            {
+                q->cpl_head = (q->cpl_head + 1) % q->depth;
+                q->cpl_cnt--;
+            }
+            q->cpl[(q->cpl_head + q->cpl_cnt) % q->depth] = cpl;
+            q->cpl_cnt++;
+            uint64_t one = 1;
+            if (write(q->efd, &one, sizeof(uint64_t)) != sizeof(uint64_t))
+            {
+                eprintf("Could not signal completion of write %llu", (unsigned long long)cpl.id);
+            }
+        }
+        pthread_cond_broadcast(&(q->space));
+    }
+    pthread_mutex_unlock(&(q->m));
+    return NULL;
+}
+
+int txmodem_async_init(txmodem_async_t *q, txmodem *dev, int depth, txmodem_async_cb_t cb, void *user)
+{
+    if ((q == NULL) || (dev == NULL))
+        return -1;
+    memset(q, 0x0, sizeof(txmodem_async_t));
+    q->dev = dev;
+    q->depth = depth > 0 ? depth : TXMODEM_ASYNC_DEPTH;
+    q->cb = cb;
+    q->user = user;
+    q->next_id = 1;
+    q->efd = -1;
+    q->req = (txmodem_async_req_t *)calloc(q->depth, sizeof(txmodem_async_req_t));
+    q->cpl = (txmodem_async_cpl_t *)calloc(q->depth, sizeof(txmodem_async_cpl_t));
+    if ((q->req == NULL) || (q->cpl == NULL))
+    {
+        eprintf("Unable to allocate memory for the TX queue");
+        goto err;
+    }
+    if ((cb == NULL) && ((q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0))
+    {
+        eprintf("Unable to create completion eventfd");
+        perror("eventfd");
+        goto err;
+    }
+    pthread_mutex_init(&(q->m), NULL);
+    pthread_cond_init(&(q->cond), NULL);
+    pthread_cond_init(&(q->space), NULL);
+    if (pthread_create(q->thr, NULL, &txmodem_async_thread, q) != 0)
+    {
+        eprintf("Unable to start TX worker thread");
+        perror("pthread_create");
+        pthread_mutex_destroy(&(q->m));
+        pthread_cond_destroy(&(q->cond));
+        pthread_cond_destroy(&(q->space));
+        goto err;
+    }
+    return 1;
+err:
+    if (q->efd >= 0)
+        close(q->efd);
+    free(q->req);
+    free(q->cpl);
+    return -1;
+}
+
+int64_t txmodem_write_async(txmodem_async_t *q, const uint8_t *buf, ssize_t size, void *tag)
+{
+    if ((buf == NULL) || (size < 0))
+    {
+        eprintf("Invalid data buffer");
+        return -1;
+    }
+    pthread_mutex_lock(&(q->m));
+    while ((q->req_cnt >= q->depth) && !(q->done)) // back pressure
+        pthread_cond_wait(&(q->space), &(q->m));
+    if (q->done)
+    {
+        pthread_mutex_unlock(&(q->m));
+        return -1;
+    }
+    txmodem_async_req_t *req = &(q->req[(q->req_head + q->req_cnt) % q->depth]);
+    req->buf = buf;
+    req->size = size;
+    req->tag = tag;
+    req->id = q->next_id++;
+    q->req_cnt++;
+    int64_t id = req->id;
+    pthread_cond_signal(&(q->cond));
+    pthread_mutex_unlock(&(q->m));
+    return id;
+}
+
+int txmodem_async_fd(txmodem_async_t *q)
+{
+    return q->efd;
+}
+
+int txmodem_async_poll(txmodem_async_t *q, txmodem_async_cpl_t *cpl, int max)
+{
+    int num = 0;
+    pthread_mutex_lock(&(q->m));
+    uint64_t cnt;
+    if ((q->efd >= 0) && (read(q->efd, &cnt, sizeof(uint64_t)) < 0)) // clear readiness, the ring holds the completions
+        cnt = 0;
+    for (; (num < max) && (q->cpl_cnt > 0); num++)
+    {
+        cpl[num] = q->cpl[q->cpl_head];
+        q->cpl_head = (q->cpl_head + 1) % q->depth;
+        q->cpl_cnt--;
+    }
+    if ((q->cpl_cnt > 0) && (q->efd >= 0)) // stay readable for the rest
+    {
+        cnt = 1;
+        if (write(q->efd, &cnt, sizeof(uint64_t)) != sizeof(uint64_t))
+        {
+            eprintf("Could not signal pending completions");
+        }
+    }
+    if (num > 0) // the worker may wait for room in the completion ring
+        pthread_cond_signal(&(q->cond));
+    pthread_mutex_unlock(&(q->m));
+    return num;
+}
+
+void txmodem_async_drain(txmodem_async_t *q)
+{
+    pthread_mutex_lock(&(q->m));
+    while (q->req_cnt > 0)
+        pthread_cond_wait(&(q->space), &(q->m));
+    pthread_mutex_unlock(&(q->m));
+}
+
+void txmodem_async_destroy(txmodem_async_t *q)
+{
+    pthread_mutex_lock(&(q->m));
+    q->done = 1;
+    pthread_cond_signal(&(q->cond));
+    pthread_cond_broadcast(&(q->space));
+    pthread_mutex_unlock(&(q->m));
+    pthread_join(q->thr[0], NULL);
+    pthread_mutex_destroy(&(q->m));
+    pthread_cond_destroy(&(q->cond));
+    pthread_cond_destroy(&(q->space));
+    if (q->efd >= 0)
+        close(q->efd);
+    free(q->req);
+    free(q->cpl);
+}
+
+/*
+ * Frames the queued packets one frame at a time, the next frame always comes
+ * from the most urgent class with data. Before each frame the thread waits
+ * until at most lookahead - 1 frames are left in the TX ring, then picks the
+ * class again, as a more urgent packet may have been queued meanwhile. Frames
+ * are counted rather than bytes, so a short urgent frame in the ring does not
+ * let the link run dry.
+ */
+static void *txmodem_sched_thread(void *__s)
+{
+    txmodem_sched_t *s = (txmodem_sched_t *)__s;
+    txmodem *dev = s->dev;
+    txmodem_ring_t *r = dev->ring;
+    txmodem_pack_t pack[TXMODEM_SCHED_CLASSES];                 // framing state of the packet in progress in each class
+    txmodem_sched_req_t *active[TXMODEM_SCHED_CLASSES] = {NULL}; // packet in progress in each class
+    int last = -1;                                              // class of the last frame
+    int paced = 0;                                              // waited for the link since the last frame
+    uint64_t frame_end[TXMODEM_SCHED_LOOKAHEAD_MAX] = {0};      // TX ring position each of the last lookahead frames ends at
+    uint64_t num_framed = 0;                                    // frames framed, the next one takes slot num_framed % lookahead
+    pthread_mutex_lock(&(s->m));
+    for (;;)
+    {
+        int c = 0;
+        while ((c < TXMODEM_SCHED_CLASSES) && (active[c] == NULL) && (s->head[c] == NULL))
+            c++;
+        if (c == TXMODEM_SCHED_CLASSES)
+        {
+            if (s->done)
+                break;
+            pthread_cond_wait(&(s->cond), &(s->m));
+            continue;
+        }
+        if (active[c] == NULL) // start the oldest packet of the class
+        {
+            txmodem_sched_req_t *req = s->head[c];
+            s->head[c] = req->next;
+            if (s->head[c] == NULL)
+                s->tail[c] = NULL;
+            s->stats[c].queued--;
+            pthread_mutex_unlock(&(s->m));
+            int ret = txmodem_pack_init(&(pack[c]), dev, req->iov, req->iovcnt, 0);
+            pthread_mutex_lock(&(s->m));
+            if (ret < 0)
+            {
+                req->ret = ret;
+                req->framed = 1;
+                s->stats[c].num_errors++;
+                pthread_cond_broadcast(&(s->framed));
+                continue;
+            }
+            active[c] = req;
+        }
+        if (!paced)
+        {
+            uint64_t pos = frame_end[num_framed % s->lookahead]; // end of the frame lookahead frames back
+            pthread_mutex_unlock(&(s->m));
+            txmodem_ring_wait(dev, pos);
+            pthread_mutex_lock(&(s->m));
+            paced = 1;
+            continue;
+        }
+        paced = 0;
+        txmodem_pack_t *p = &(pack[c]);
+        int first = (p->frame_idx == 0) && !(p->closed);
+        pthread_mutex_unlock(&(s->m));
+        int ret = txmodem_pack_next(p);
+        pthread_mutex_lock(&(r->m));
+        txmodem_ring_publish(r); // every frame goes out right away
+        if (ret > 0)
+            frame_end[num_framed++ % s->lookahead] = r->head;
+        pthread_mutex_unlock(&(r->m));
+        uint64_t now = txmodem_nsec();
+        pthread_mutex_lock(&(s->m));
+        txmodem_sched_stats_t *st = &(s->stats[c]);
+        if ((last > c) && (active[last] != NULL)) // preempted between two frames
+            s->stats[last].num_preempt++;
+        last = c;
+        if (ret > 0)
+        {
+            st->num_frames++;
+            if (first)
+            {
+                uint64_t lat = now - active[c]->queued_ns;
+                st->lat_ns += lat;
+                st->max_lat_ns = lat > st->max_lat_ns ? lat : st->max_lat_ns;
+            }
+            continue;
+        }
+        txmodem_pack_free(p);
+        active[c]->end = r->head;
+        active[c]->ret = 1;
+        active[c]->framed = 1;
+        active[c] = NULL;
+        st->num_packs++;
+        st->num_bytes += p->size;
+        pthread_cond_broadcast(&(s->framed));
+    }
+    pthread_mutex_unlock(&(s->m));
+    return NULL;
+}
+
+int txmodem_sched_init(txmodem_sched_t *s, txmodem *dev, int lookahead)
+{
+    if ((s == NULL) || (dev == NULL))
+        return -1;
+    if (lookahead > TXMODEM_SCHED_LOOKAHEAD_MAX)
+    {
+        eprintf("Lookahead %d is larger than %d", lookahead, TXMODEM_SCHED_LOOKAHEAD_MAX);
+        return -1;
+    }
+    memset(s, 0x0, sizeof(txmodem_sched_t));
+    s->dev = dev;
+    s->lookahead = lookahead > 0 ? lookahead : TXMODEM_SCHED_LOOKAHEAD;
+    pthread_mutex_init(&(s->m), NULL);
+    pthread_cond_init(&(s->cond), NULL);
+    pthread_cond_init(&(s->framed), NULL);
+    if (pthread_create(s->thr, NULL, &txmodem_sched_thread, s) != 0)
+    {
+        eprintf("Unable to start TX scheduler thread");
+        perror("pthread_create");
+        pthread_mutex_destroy(&(s->m));
+        pthread_cond_destroy(&(s->cond));
+        pthread_cond_destroy(&(s->framed));
+        return -1;
+    }
+    return 1;
+}
+
+int txmodem_sched_writev(txmodem_sched_t *s, int prio, const struct iovec *iov, int iovcnt)
+{
+    if ((prio < 0) || (prio >= TXMODEM_SCHED_CLASSES))
+    {
+        eprintf("Invalid priority class %d", prio);
+        return -1;
+    }
+    txmodem_sched_req_t req[1];
+    memset(req, 0x0, sizeof(txmodem_sched_req_t));
+    req->iov = iov;
+    req->iovcnt = iovcnt;
+    req->queued_ns = txmodem_nsec();
+    pthread_mutex_lock(&(s->m));
+    if (s->done)
+    {
+        pthread_mutex_unlock(&(s->m));
+        return -1;
+    }
+    if (s->tail[prio] == NULL)
+        s->head[prio] = req;
+    else
+        s->tail[prio]->next = req;
+    s->tail[prio] = req;
+    txmodem_sched_stats_t *st = &(s->stats[prio]);
+    if (++(st->queued) > st->max_queued)
+        st->max_queued = st->queued;
+    pthread_cond_signal(&(s->cond));
+    while (!(req->framed))
+        pthread_cond_wait(&(s->framed), &(s->m));
+    pthread_mutex_unlock(&(s->m));
+    if (req->ret < 0)
+        return req->ret;
+    txmodem_ring_wait(s->dev, req->end);
+    return txmodem_ring_error(s->dev->ring);
+}
+
+int txmodem_sched_write(txmodem_sched_t *s, int prio, const uint8_t *buf, ssize_t size)
+{
+    if (size < 0)
+    {
+        eprintf("Data buffer size less than 0: %zd", size);
+        return -1;
+    }
+    struct iovec iov[1];
+    iov->iov_base = (void *)buf;
+    iov->iov_len = size;
+    return txmodem_sched_writev(s, prio, iov, 1);
+}
+
+int txmodem_sched_stats(txmodem_sched_t *s, int prio, txmodem_sched_stats_t *stats)
+{
+    if ((s == NULL) || (stats == NULL) || (prio < 0) || (prio >= TXMODEM_SCHED_CLASSES))
+        return -1;
+    pthread_mutex_lock(&(s->m));
+    *stats = s->stats[prio];
+    pthread_mutex_unlock(&(s->m));
+    return 1;
+}
+
+void txmodem_sched_destroy(txmodem_sched_t *s)
+{
+    pthread_mutex_lock(&(s->m));
+    s->done = 1;
+    pthread_cond_signal(&(s->cond));
+    pthread_mutex_unlock(&(s->m));
+    pthread_join(s->thr[0], NULL);
+    pthread_mutex_destroy(&(s->m));
+    pthread_cond_destroy(&(s->cond));
+    pthread_cond_destroy(&(s->framed));
+}
+
+/*
+ * Close the frame at frame_ofst of the DMA buffer as a single frame packet
+ * whose len data bytes are already in place, behind the room for the v2
+ * packet descriptor: write the descriptor and the CRC32 trailer around them,
+ * then the frame header. Returns the size of the frame in the DMA buffer.
+ */
+static ssize_t txmodem_frame_single(txmodem *dev, ssize_t frame_ofst, int v2, size_t len)
+{
+    ssize_t hdr_sz = v2 ? sizeof(modem_frame_header_v2_t) : sizeof(modem_frame_header_t);
+    uint8_t *payload = dev->dma->mem_virt_addr + frame_ofst + sizeof(uint64_t) + hdr_sz;
+    uint8_t *data = payload;
+    /* The packet stream around the data: descriptor in front, CRC32 trailer behind */
+    if (v2)
+    {
+        modem_packet_desc_t desc[1];
+        memset(desc, 0x0, sizeof(modem_packet_desc_t));
+        desc->pack_sz = len;
+        desc->num_frames = 1;
+        desc->mtu = dev->mtu;
+        memcpy(payload, desc, sizeof(modem_packet_desc_t));
+        data += sizeof(modem_packet_desc_t);
+    }
+    if (dev->pack_crc)
+    {
+        uint32_t crc32 = crc32_update(0, data, len);
+        memcpy(data + len, &crc32, sizeof(uint32_t));
+    }
+    uint16_t frame_sz = (data - payload) + len + (dev->pack_crc ? sizeof(uint32_t) : 0);
+    uint16_t crc = crc16_update(CRC16_INIT, payload, frame_sz);
+    int flags = MODEM_FLAG_DESC | MODEM_FLAG_LAST | (dev->pack_crc ? MODEM_FLAG_PACK_CRC : 0);
+    return txmodem_frame_close(dev, frame_ofst, v2, flags, ++txmodem_pack_id, 0, frame_sz, crc, len, 1);
+}
+
+int txmodem_frame_acquire(txmodem *dev, uint8_t **payload, size_t *capacity)
+{
+    if ((dev == NULL) || (payload == NULL) || (capacity == NULL))
+        return -1;
+    if (dev->frame_acquired)
+    {
+        eprintf("A frame is already acquired");
+        return -1;
+    }
+    txmodem_check_mtu(dev, 0);
+    int v2 = dev->hdr_version == MODEM_HDR_V2;
+    ssize_t hdr_sz = v2 ? sizeof(modem_frame_header_v2_t) : sizeof(modem_frame_header_t);
+    ssize_t max_frame_sz = sizeof(uint64_t) + hdr_sz + dev->mtu + FRAME_PADDING * sizeof(uint64_t);
+    if (2 * max_frame_sz > (ssize_t)dev->ring->size)
+    {
+        eprintf("TX ring too small for the MTU");
+        return -1;
+    }
+    ssize_t prefix = v2 ? sizeof(modem_packet_desc_t) : 0;
+    ssize_t trailer = dev->pack_crc ? sizeof(uint32_t) : 0;
+    dev->frame_pos = txmodem_ring_reserve(dev, max_frame_sz); // other writers wait until the frame is committed
+    dev->frame_acquired = 1;
+    dev->frame_v2 = v2;
+    dev->frame_cap = dev->mtu - prefix - trailer;
+    *payload = dev->dma->mem_virt_addr + (dev->frame_pos % dev->ring->size) + sizeof(uint64_t) + hdr_sz + prefix;
+    *capacity = dev->frame_cap;
+    return 1;
+}
+
+int txmodem_frame_commit(txmodem *dev, size_t len)
+{
+    if ((dev == NULL) || !dev->frame_acquired)
+    {
+        eprintf("No frame acquired");
+        return -1;
+    }
+    if (len > dev->frame_cap)
+    {
+        eprintf("Frame payload of %zu bytes exceeds the capacity of %zu bytes", len, dev->frame_cap);
+        return -1;
+    }
+    txmodem_ring_t *r = dev->ring;
+    dev->frame_acquired = 0;
+    if (len == 0) // releases the frame
+    {
+        txmodem_ring_advance(r, dev->frame_pos);
+        return 0;
+    }
+    ssize_t frame_len = txmodem_frame_single(dev, dev->frame_pos % r->size, dev->frame_v2, len);
+    txmodem_ring_advance(r, dev->frame_pos + frame_len);
+    pthread_mutex_lock(&(r->m));
+    txmodem_ring_publish(r);
+    int ret = r->error < 0 ? r->error : 1;
+    r->error = 0;
+    pthread_mutex_unlock(&(r->m));
+    dev->frames_tx++;
+    return ret;
+}
+
+int txmodem_frame_flush(txmodem *dev)
+{
+    return txmodem_ring_sync(dev);
+}
+
+int txmodem_beacon_start(txmodem *dev, const uint8_t *buf, size_t len)
+{
+    if ((dev == NULL) || (buf == NULL))
+        return -1;
+    if (dev->frame_acquired)
+    {
+        eprintf("A frame is acquired");
+        return -1;
+    }
+    txmodem_check_mtu(dev, 0);
+    int v2 = dev->hdr_version == MODEM_HDR_V2;
+    ssize_t hdr_sz = v2 ? sizeof(modem_frame_header_v2_t) : sizeof(modem_frame_header_t);
+    ssize_t prefix = v2 ? sizeof(modem_packet_desc_t) : 0;
+    ssize_t trailer = dev->pack_crc ? sizeof(uint32_t) : 0;
+    if ((len == 0) || (len > dev->mtu - prefix - trailer))
+    {
+        eprintf("Beacon of %zu bytes does not fit in a frame", len);
+        return -1;
+    }
+    ssize_t max_frame_sz = sizeof(uint64_t) + hdr_sz + dev->mtu + FRAME_PADDING * sizeof(uint64_t);
+    uint64_t ofst = (dev->dma->mem_sz - max_frame_sz) & ~(uint64_t)(MODEM_BYTE_ALIGN - 1); // the ring ends where the beacon starts
+    if (2 * max_frame_sz > (ssize_t)ofst)
+    {
+        eprintf("TX ring too small for the MTU");
+        return -1;
+    }
+    txmodem_beacon_stop(dev);
+    int ret = txmodem_ring_resize(dev, ofst);
+    memcpy(dev->dma->mem_virt_addr + ofst + sizeof(uint64_t) + hdr_sz + prefix, buf, len);
+    ssize_t beacon_sz = txmodem_frame_single(dev, ofst, v2, len);
+    txmodem_ring_t *r = dev->ring;
+    pthread_mutex_lock(&(r->m));
+    r->beacon_ofst = ofst;
+    r->beacon_sz = beacon_sz;
+    r->beacon = 1;
+    r->idle_ns = 0; // loops right away
+    pthread_cond_signal(&(r->cond));
+    pthread_mutex_unlock(&(r->m));
+    return ret;
+}
+
+int txmodem_beacon_stop(txmodem *dev)
+{
+    if (dev == NULL)
+        return -1;
+    txmodem_ring_t *r = dev->ring;
+    pthread_mutex_lock(&(r->m));
+    int set = r->beacon;
+    r->beacon = 0;
+    pthread_cond_signal(&(r->cond));
+    while (r->beacon_on) // the drain thread stops it
+        pthread_cond_wait(&(r->space), &(r->m));
+    pthread_mutex_unlock(&(r->m));
+    if (!set)
+        return 0;
+    return txmodem_ring_resize(dev, dev->dma->mem_sz);
 }
 
 void txmodem_destroy(txmodem *dev)
 {
+    txmodem_ring_destroy(dev);
     adidma_destroy(dev->dma);
     uio_destroy(dev->bus);
 }
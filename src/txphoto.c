@@ -9,6 +9,11 @@ int main(int argc, char **argv)
         eprintf("Error initializing TX modem");
         return 0;
     }
+    TX->pack_crc = 1; // receiver checks the whole photo against the CRC32 trailer
+    TX->fec_n = 16;   // 2 parity frames per 16 data frames, any 2 lost frames per block are rebuilt
+    TX->fec_k = 2;
+    TX->hdr_version = MODEM_HDR_V2; // compact frame headers
+    TX->compress = (argc > 2) && atoi(argv[2]); // pays off for raw images, not for JPEGs
     FILE *fPhoto = NULL;
     char *photoName = argv[1];
     fPhoto = fopen(photoName, "rb");
@@ -30,6 +35,11 @@ int main(int argc, char **argv)
     {
         eprintf("Check size");
     }
+    else if (TX->compress)
+    {
+        printf("Compressed %llu bytes to %llu (%.1f%%) in %.3f ms\n", (unsigned long long)TX->lz_stats.in_sz, (unsigned long long)TX->lz_stats.out_sz,
+               100.0 * TX->lz_stats.out_sz / (TX->lz_stats.in_sz > 0 ? TX->lz_stats.in_sz : 1), TX->lz_stats.ns * 1e-6);
+    }
 
     free(buffer);
     fclose(fPhoto);
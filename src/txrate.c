@@ -0,0 +1,90 @@
+/**
+ * @file txrate.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Measures the frame rate txmodem_write achieves against the rate the
+ * air interface can carry at a given sample rate.
+ * @version 0.1
+ * @date 2021-06-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "txmodem.h"
+
+#define TXRATE_MTU 4064      // frame payload size
+#define TXRATE_PACK_SZ 64000 // packet size, 16 frames at TXRATE_MTU
+#define TXRATE_PACKS 64      // packets per measurement
+#define TXRATE_SPS 10        // samples per symbol
+#define TXRATE_BPS 1         // bits per symbol
+
+static inline uint64_t get_nsec()
+{
+    struct timespec mac_ts;
+    timespec_get(&mac_ts, TIME_UTC);
+    return (uint64_t)mac_ts.tv_sec * 1000000000L + ((uint64_t)mac_ts.tv_nsec);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Invocation: %s <Sample rate, Hz> [Samples per symbol (%d)] [Bits per symbol (%d)] [MTU (%d)] [Packet size (%d)]\n", argv[0], TXRATE_SPS, TXRATE_BPS, TXRATE_MTU, TXRATE_PACK_SZ);
+        return 0;
+    }
+    double samp = atof(argv[1]);
+    int sps = argc > 2 ? atoi(argv[2]) : TXRATE_SPS;
+    int bps = argc > 3 ? atoi(argv[3]) : TXRATE_BPS;
+    int mtu = argc > 4 ? atoi(argv[4]) : TXRATE_MTU;
+    ssize_t size = argc > 5 ? atol(argv[5]) : TXRATE_PACK_SZ;
+    if ((samp <= 0) || (sps <= 0) || (bps <= 0) || (size <= 0))
+    {
+        eprintf("Invalid parameters");
+        return -1;
+    }
+    txmodem dev[1];
+    if (txmodem_init(dev, uio_get_id("tx_ipcore"), uio_get_id("tx_dma")) < 0)
+    {
+        eprintf("Error initializing TX modem");
+        return -1;
+    }
+    txmodem_reset(dev, 0);
+    dev->mtu = mtu;
+    uint8_t *buf = (uint8_t *)malloc(size);
+    if (buf == NULL)
+    {
+        eprintf("Unable to allocate memory for the packet");
+        txmodem_destroy(dev);
+        return -1;
+    }
+    for (ssize_t i = 0; i < size; i++)
+        buf[i] = rand();
+    txmodem_write(dev, buf, size); // sets up the MTU
+    // bytes on air per full frame: header, payload and padding
+    double air_rate = samp / sps * bps / 8;
+    double frame_air = sizeof(modem_frame_header_t) + dev->mtu + FRAME_PADDING * sizeof(uint64_t);
+    printf("Sample rate %.3f MHz, %d samples per symbol, %d bits per symbol: %.3f kB/s on air\n", samp * 1e-6, sps, bps, air_rate * 1e-3);
+    printf("MTU %zu, %.0f bytes per frame on air: %.1f frames/s theoretical\n", dev->mtu, frame_air, air_rate / frame_air);
+
+    uint64_t frames = dev->frames_tx;
+    uint64_t start = get_nsec();
+    for (int i = 0; i < TXRATE_PACKS; i++)
+    {
+        if (txmodem_write(dev, buf, size) < 0)
+        {
+            eprintf("Write %d failed", i);
+            break;
+        }
+    }
+    double dt = (get_nsec() - start) * 1e-9;
+    frames = dev->frames_tx - frames;
+    double fps = frames / dt;
+    printf("%llu frames in %.3f s: %.1f frames/s achieved, %.1f%% of theoretical\n", (unsigned long long)frames, dt, fps, 100.0 * fps * frame_air / air_rate);
+    free(buf);
+    txmodem_destroy(dev);
+    return 0;
+}
@@ -235,11 +235,14 @@ int main(int argc, char *argv[])
                          "End of transmission";
 
     ssize_t size;
+    struct iovec iov[2]; // message and second verse, framed without joining them
+    int iovcnt = 1;
     if (argc == 1)
     {
         size = snprintf(msg, (1 << 16) - 1, fmt_str, timeinfo->tm_year + 1900, timeinfo->tm_mon + 1, timeinfo->tm_mday, timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec);
-        memcpy(msg + size, msg2, strlen(msg2));
-        size += strlen(msg2);
+        iov[1].iov_base = msg2;
+        iov[1].iov_len = strlen(msg2);
+        iovcnt = 2;
     }
     else
     {
@@ -251,6 +254,8 @@ int main(int argc, char *argv[])
         fread(msg, 1, size, fp);
         fclose(fp);
     }
+    iov[0].iov_base = msg;
+    iov[0].iov_len = size;
     txmodem dev[1];
     if (txmodem_init(dev, uio_get_id("tx_ipcore"), uio_get_id("tx_dma")) < 0)
         return -1;
@@ -261,7 +266,7 @@ int main(int argc, char *argv[])
         char buf[10];
         scanf(" %s", buf);
         dev->mtu = strtol(buf, 0x0, 10);
-        txmodem_write(dev, (uint8_t *)msg, size);
+        txmodem_writev(dev, iov, iovcnt);
     }
     return 0;
 }
\ No newline at end of file